@@ -12,7 +12,12 @@
 
 #include "daisy_patch.h"
 #include "daisysp.h"
-#include <string>
+#include "generator_core.h"
+#include "replay_log.h"
+#include "stm32h7xx_hal.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 
 using namespace daisy;
 using namespace daisysp;
@@ -20,35 +25,16 @@ using namespace daisysp;
 // Hardware
 DaisyPatch hw;
 
+// Generator core clock (see generator_core.h)
+uint32_t platform_now_ms()
+{
+    return System::GetNow();
+}
+
 // Page system
 int   current_page = 0;      // 0, 1, 2, 3 for 4 pages
 const int NUM_PAGES = 4;
 const int PARAMS_PER_PAGE = 4;
-const int TOTAL_PARAMS = 16;
-
-// Parameter indices (for clarity)
-enum ParamIndex {
-    // Page 0: Performance - Direct Control
-    PARAM_MOTION = 0,
-    PARAM_MEMORY = 1,
-    PARAM_REGISTER = 2,
-    PARAM_DIRECTION = 3,
-    // Page 1: Performance - Macro & Evolution
-    PARAM_PHRASE = 4,
-    PARAM_ENERGY = 5,
-    PARAM_STABILITY = 6,
-    PARAM_FORGETFULNESS = 7,
-    // Page 2: Structural - Shape & Gravity
-    PARAM_LEAP_SHAPE = 8,
-    PARAM_DIRECTION_MEMORY = 9,
-    PARAM_HOME_REGISTER = 10,
-    PARAM_RANGE_WIDTH = 11,
-    // Page 3: Utility - Learning & I/O
-    PARAM_LEARN_TIMEOUT = 12,
-    PARAM_ECHO_NOTES = 13,
-    PARAM_RESERVED_1 = 14,
-    PARAM_RESERVED_2 = 15
-};
 
 // Parameter names for each page (4 params per page)
 const char* page_names[NUM_PAGES][PARAMS_PER_PAGE] = {
@@ -59,11 +45,12 @@ const char* page_names[NUM_PAGES][PARAMS_PER_PAGE] = {
     // Page 2: Structural - Shape & Gravity
     {"LEAP SHP", "DIR MEM", "HOME REG", "RANGE"},
     // Page 3: Utility - Learning & I/O
-    {"LRN TIME", "ECHO", "---", "---"}
+    {"LRN TIME", "ECHO", "VOICES", "ENGINE"}
 };
 
-// MIDI CC mapping (CC number to parameter index)
+// Default MIDI CC mapping (parameter index to CC number)
 // Using undefined CCs to avoid conflicts with standard MIDI controllers
+// Loaded into the runtime cc_param_map[] at startup
 const uint8_t MIDI_CC_COUNT = 16;
 const uint8_t midi_cc_numbers[MIDI_CC_COUNT] = {
     3,  // MOTION (Page 0, Param 0)
@@ -80,13 +67,14 @@ const uint8_t midi_cc_numbers[MIDI_CC_COUNT] = {
     27, // RANGE WIDTH (Page 2, Param 3)
     28, // LEARN TIMEOUT (Page 3, Param 0)
     29, // ECHO NOTES (Page 3, Param 1)
-    30, // RESERVED (Page 3, Param 2)
-    31  // RESERVED (Page 3, Param 3)
+    30, // VOICE COUNT (Page 3, Param 2)
+    31  // ENGINE (Page 3, Param 3)
 };
 
 // Parameter storage (all 12 parameters, 0.0 to 1.0)
 float parameters[TOTAL_PARAMS];
-float parameters_smoothed[TOTAL_PARAMS];  // Smoothed versions for display/use
+// parameters_smoothed[] (smoothed versions for display/use) lives in the generator core
+uint32_t persist_serial = 0;  // Bumped when saved state other than parameters changes
 
 // Soft takeover (parameter pickup)
 bool  param_pickup_active[TOTAL_PARAMS];  // True when pot has "caught" the stored value
@@ -105,27 +93,28 @@ const float SMOOTHING_COEFF = 0.15f;
 // Gate Input 1: Note trigger (generates new note when HIGH during GENERATING)
 bool  gate1_state = false;
 bool  gate1_prev = false;
-bool  note_triggered = false;  // True for one frame after rising edge
+bool  note_triggered = false;  // Set by scheduler on trigger, cleared each control tick
 
 // Gate Input 2: Clock/BPM detection
 bool  gate2_state = false;
 bool  gate2_prev = false;
-uint32_t last_clock_time = 0;
-uint32_t clock_interval = 0;    // Time between clock pulses (in ms)
+uint32_t last_clock_time_us = 0;   // Capture timestamp of last clock edge (us)
+uint32_t clock_interval_us = 0;    // Tracked clock period (in us), see TEMPO TRACKING
 float clock_bpm = 120.0f;        // Estimated tempo
 int   clock_pulse_indicator = 0; // Visual pulse countdown (frames)
 
-// Gate output state
+// Gate output state (owned by the audio-rate scheduler)
 bool  gate_out_state = false;    // Current gate output state
-uint32_t gate_out_start_time = 0; // When gate went high (ms)
-float gate_length_ms = 50.0f;    // Gate length in milliseconds
+uint32_t gate_off_sample = 0;    // Absolute sample time at which the gate falls
+uint32_t gate_length_samples = 0; // Gate length in samples
+float gate_length_ms = 50.0f;     // Generated note length (gate and MIDI Note Off)
 
 // Other state
 int   frame_counter = 0;
 int   page_change_timer = 0;  // For showing page name overlay
 
 // ============================================================================
-// DEBUG LOGGING (inspectable via debugger)
+// DEBUG LOGGING (inspectable via debugger or the SysEx log dump)
 // ============================================================================
 
 #define DEBUG_LOG_SIZE 64
@@ -162,841 +151,2932 @@ void log_debug(uint8_t event_type, uint8_t d1 = 0, uint8_t d2 = 0, uint8_t d3 =
 }
 
 // ============================================================================
-// NOTE LEARNING SYSTEM
+// HOT-PATH TRACING (DWT cycle counter, dumped over SysEx)
 // ============================================================================
-
-// Learning states
-enum LearningState {
-    STATE_IDLE,        // Waiting for input
-    STATE_LEARNING,    // Recording notes
-    STATE_GENERATING   // Playing back variations
+// Each trace point keeps running count/min/max/total and a log2 histogram of
+// its span in CPU cycles. All points are recorded from the main loop, so the
+// statistics need no locking; the gate-edge span starts in the capture ISR
+// and travels with the note (GateEdge -> NoteEvent -> MidiOutMessage).
+//
+// A SysEx query returns the statistics (and the debug log) on MIDI out, so
+// latency can be profiled on a unit in the rack without a probe:
+//
+//   F0 7D 47 01 F7   Dump trace statistics: one TRACE_REPLY per point
+//   F0 7D 47 02 F7   Reset trace statistics
+//   F0 7D 47 03 F7   Dump the debug log: one LOG_REPLY
+//   F0 7D 47 04-06   Replay log recording (see REPLAY LOG RECORDING)
+//
+// 0x7D is the non-commercial manufacturer ID, 0x47 ('G') the device. 32-bit
+// values are sent as five 7-bit bytes, least significant first:
+//
+//   F0 7D 47 11 <point> <count> <min> <max> <avg> <cycles/s> <hist x16> F7
+//   F0 7D 47 13 <next index> { <ms> <type> <d1 d2 d3 as 2 bytes each> } x64 F7
+//
+// Histogram bucket b counts spans of [2^(b+8), 2^(b+9)) cycles; the first
+// bucket also holds shorter spans, the last longer ones (~17 ms at 480 MHz).
+
+enum TracePoint {
+    TRACE_GATE_TO_MIDI = 0,   // Gate edge captured -> Note On queued for the UART
+    TRACE_MIDI_IN_DRAIN = 1,  // MIDI input queue drained (non-empty drains only)
+    TRACE_LEARN_ANALYSIS = 2, // One learned note folded into the corpus
+    TRACE_DISPLAY_FLUSH = 3,  // Blocking OLED framebuffer flush
+    TRACE_POINT_COUNT
 };
 
-LearningState learning_state = STATE_IDLE;
+#define TRACE_BUCKETS 16
+const int TRACE_BUCKET_SHIFT = 8;
 
-// Note buffer (stores MIDI note numbers 0-127)
-const int MIN_LEARN_NOTES = 4;
-const int MAX_LEARN_NOTES = 16;
-uint8_t note_buffer[MAX_LEARN_NOTES];
-int note_buffer_count = 0;
+struct TraceStats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[TRACE_BUCKETS];
+};
+TraceStats trace_stats[TRACE_POINT_COUNT];
 
-// Learning input detection
-uint8_t last_note_in = 0;          // Last received note
-bool note_in_active = false;       // True when a note is being held
-uint32_t last_note_time = 0;       // Time of last note input (ms)
-const uint32_t DEFAULT_LEARNING_TIMEOUT = 2000;  // Default: 2s (adjustable via parameter)
+// Cycles the counter missed while the core slept in WFI (added by
+// wait_for_main_events()), so spans across a sleep stay in wall-clock cycles
+uint32_t trace_sleep_cycles = 0;
 
-// ============================================================================
-// TENDENCY ANALYSIS (extracted from learned notes)
-// ============================================================================
+inline uint32_t trace_now()
+{
+    return DWT->CYCCNT + trace_sleep_cycles;
+}
 
-struct LearnedTendencies {
-    // Interval distribution (histogram of interval sizes)
-    int interval_counts[13];  // 0=unison, 1=semitone, ... 12=octave
-    int total_intervals;
-
-    // Direction tendencies
-    int ascending_count;
-    int descending_count;
-    int repeat_count;        // Same note twice in a row
-
-    // Register analysis
-    float register_center;   // Average MIDI note number
-    float register_range;    // Max - min note
-    uint8_t register_min;
-    uint8_t register_max;
-
-    // Most common intervals (for weighted generation)
-    int most_common_interval;
-    int second_common_interval;
-};
+void trace_reset()
+{
+    memset(trace_stats, 0, sizeof(trace_stats));
+}
 
-LearnedTendencies tendencies;
+// Enable the DWT cycle counter (unlocked first on the M7)
+void trace_init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR = 0xC5ACCE55;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    trace_reset();
+}
 
-// Analyze learned notes and extract tendencies
-void analyze_learned_notes()
+// Fold one span into its point (main loop context)
+void trace_record(TracePoint point, uint32_t cycles)
 {
-    // Clear previous analysis
-    tendencies = LearnedTendencies();
+    TraceStats& t = trace_stats[point];
+    if(t.count == 0 || cycles < t.min)
+        t.min = cycles;
+    if(cycles > t.max)
+        t.max = cycles;
+    t.total += cycles;
+    t.count++;
+
+    int bucket = (cycles >> TRACE_BUCKET_SHIFT)
+                     ? 31 - __builtin_clz(cycles >> TRACE_BUCKET_SHIFT)
+                     : 0;
+    t.histogram[bucket < TRACE_BUCKETS ? bucket : TRACE_BUCKETS - 1]++;
+}
+
+// SysEx transmit buffer, drained by service_midi_out() within the byte budget.
+// Note messages wait while a dump is being sent (nothing but real-time bytes
+// may interleave a SysEx message), so a dump delays MIDI out by ~0.15 s.
+#define SYSEX_TX_SIZE 1024
+const uint8_t SYSEX_MANUFACTURER = 0x7D;
+const uint8_t SYSEX_DEVICE = 0x47;
+enum SysexCommand {
+    SYSEX_TRACE_QUERY = 0x01,
+    SYSEX_TRACE_RESET = 0x02,
+    SYSEX_LOG_QUERY = 0x03,
+    SYSEX_REPLAY_START = 0x04,
+    SYSEX_REPLAY_STOP = 0x05,
+    SYSEX_REPLAY_QUERY = 0x06,
+    SYSEX_TRACE_REPLY = 0x11,
+    SYSEX_LOG_REPLY = 0x13,
+    SYSEX_REPLAY_REPLY = 0x16
+};
 
-    if(note_buffer_count < 2)
-        return;  // Need at least 2 notes to analyze
+uint8_t  sysex_tx[SYSEX_TX_SIZE];
+int      sysex_tx_length = 0;   // Bytes in the pending dump
+int      sysex_tx_pos = 0;      // Bytes already sent
+uint32_t sysex_tx_busy = 0;     // Queries ignored: previous dump still sending
 
-    // Find register min/max and calculate center
-    tendencies.register_min = 127;
-    tendencies.register_max = 0;
-    float note_sum = 0.0f;
+inline bool sysex_tx_pending()
+{
+    return sysex_tx_pos < sysex_tx_length;
+}
 
-    for(int i = 0; i < note_buffer_count; i++)
+int sysex_put_u32(uint8_t* buf, int n, uint32_t value)
+{
+    for(int i = 0; i < 5; i++)
     {
-        uint8_t note = note_buffer[i];
-        if(note < tendencies.register_min) tendencies.register_min = note;
-        if(note > tendencies.register_max) tendencies.register_max = note;
-        note_sum += note;
+        buf[n++] = value & 0x7F;
+        value >>= 7;
     }
+    return n;
+}
 
-    tendencies.register_center = note_sum / (float)note_buffer_count;
-    tendencies.register_range = tendencies.register_max - tendencies.register_min;
+uint32_t sysex_get_u32(const uint8_t* data)
+{
+    uint32_t value = 0;
+    for(int i = 0; i < 5; i++)
+        value |= (uint32_t)(data[i] & 0x7F) << (7 * i);
+    return value;
+}
+
+int sysex_begin(uint8_t* buf, int n, uint8_t command)
+{
+    buf[n++] = 0xF0;
+    buf[n++] = SYSEX_MANUFACTURER;
+    buf[n++] = SYSEX_DEVICE;
+    buf[n++] = command;
+    return n;
+}
 
-    // Analyze intervals between consecutive notes
-    for(int i = 0; i < note_buffer_count - 1; i++)
+// Snapshot the statistics into the transmit buffer
+int build_trace_dump(uint8_t* buf)
+{
+    int n = 0;
+    for(int p = 0; p < TRACE_POINT_COUNT; p++)
     {
-        int interval = note_buffer[i + 1] - note_buffer[i];
+        const TraceStats& t = trace_stats[p];
+        n = sysex_begin(buf, n, SYSEX_TRACE_REPLY);
+        buf[n++] = (uint8_t)p;
+        n = sysex_put_u32(buf, n, t.count);
+        n = sysex_put_u32(buf, n, t.min);
+        n = sysex_put_u32(buf, n, t.max);
+        n = sysex_put_u32(buf, n, t.count ? (uint32_t)(t.total / t.count) : 0);
+        n = sysex_put_u32(buf, n, SystemCoreClock);
+        for(int b = 0; b < TRACE_BUCKETS; b++)
+            n = sysex_put_u32(buf, n, t.histogram[b]);
+        buf[n++] = 0xF7;
+    }
+    return n;
+}
 
-        // Count direction
-        if(interval > 0)
-            tendencies.ascending_count++;
-        else if(interval < 0)
-            tendencies.descending_count++;
-        else
-            tendencies.repeat_count++;
+int build_log_dump(uint8_t* buf)
+{
+    int n = sysex_begin(buf, 0, SYSEX_LOG_REPLY);
+    buf[n++] = (uint8_t)debug_log_index;
+    for(int i = 0; i < DEBUG_LOG_SIZE; i++)
+    {
+        const DebugLogEntry& e = debug_log[i];
+        n = sysex_put_u32(buf, n, e.timestamp);
+        buf[n++] = e.event_type & 0x7F;
+        const uint8_t data[3] = {e.data1, e.data2, e.data3};
+        for(int d = 0; d < 3; d++)
+        {
+            buf[n++] = data[d] & 0x7F;
+            buf[n++] = data[d] >> 7;
+        }
+    }
+    buf[n++] = 0xF7;
+    return n;
+}
 
-        // Count interval size (use absolute value, cap at octave)
-        int interval_size = abs(interval);
-        if(interval_size > 12) interval_size = 12;  // Cap at octave
+static_assert(TRACE_POINT_COUNT * (4 + 1 + 5 * (5 + TRACE_BUCKETS) + 1) <= SYSEX_TX_SIZE,
+              "Trace dump does not fit the SysEx buffer");
+static_assert(4 + 1 + DEBUG_LOG_SIZE * (5 + 1 + 6) + 1 <= SYSEX_TX_SIZE,
+              "Debug log dump does not fit the SysEx buffer");
 
-        tendencies.interval_counts[interval_size]++;
-        tendencies.total_intervals++;
-    }
+// Replay log commands are acted on after the drain (service_replay_request())
+uint8_t  sysex_replay_request = 0;
+uint32_t sysex_replay_offset = 0;
 
-    // Find most common intervals
-    int max_count = 0;
-    int second_max_count = 0;
+// Incoming SysEx (data between F0 and F7) from the MIDI input drain
+void handle_sysex(const uint8_t* data, int length)
+{
+    if(length < 3 || data[0] != SYSEX_MANUFACTURER || data[1] != SYSEX_DEVICE)
+        return;
 
-    for(int i = 0; i <= 12; i++)
+    switch(data[2])
     {
-        if(tendencies.interval_counts[i] > max_count)
-        {
-            second_max_count = max_count;
-            tendencies.second_common_interval = tendencies.most_common_interval;
-            max_count = tendencies.interval_counts[i];
-            tendencies.most_common_interval = i;
-        }
-        else if(tendencies.interval_counts[i] > second_max_count)
-        {
-            second_max_count = tendencies.interval_counts[i];
-            tendencies.second_common_interval = i;
-        }
+        case SYSEX_TRACE_RESET: trace_reset(); break;
+        case SYSEX_TRACE_QUERY:
+        case SYSEX_LOG_QUERY:
+            if(sysex_tx_pending())
+            {
+                sysex_tx_busy++;
+                break;
+            }
+            sysex_tx_length = (data[2] == SYSEX_TRACE_QUERY) ? build_trace_dump(sysex_tx)
+                                                            : build_log_dump(sysex_tx);
+            sysex_tx_pos = 0;
+            break;
+        case SYSEX_REPLAY_START:
+        case SYSEX_REPLAY_STOP:
+        case SYSEX_REPLAY_QUERY:
+            sysex_replay_request = data[2];
+            sysex_replay_offset = (length >= 8) ? sysex_get_u32(data + 3) : 0;
+            break;
+        default: break;
     }
 }
 
 // ============================================================================
-// NOTE GENERATION SYSTEM
+// HEAP ALLOCATION COUNTER (inspectable via debugger)
 // ============================================================================
+// Every C++ allocation goes through these operators. main() records the count
+// once init is finished; heap_allocs_after_init() must stay at 0 while running.
 
-// Generation state
-uint8_t current_note = 60;       // Current generated note (MIDI)
-uint8_t previous_note = 60;      // Previous note for direction memory
-int last_interval = 0;           // Last interval taken
-bool last_direction_up = true;   // Last direction was ascending
-
-// Note history for memory/repetition bias
-#define NOTE_HISTORY_SIZE 8
-uint8_t note_history[NOTE_HISTORY_SIZE];
-int note_history_count = 0;
-int note_history_index = 0;
+uint32_t heap_alloc_count = 0;
+uint32_t heap_alloc_count_at_init = 0;
 
-// Phrase length tracking
-int phrase_note_count = 0;       // Notes generated in current phrase
-int phrase_target_length = 12;   // Target phrase length (updated from PHRASE parameter)
-
-// Simple random number generator (XORshift)
-uint32_t rng_state = 12345;
-uint32_t xorshift32()
+void* operator new(size_t size)
 {
-    rng_state ^= rng_state << 13;
-    rng_state ^= rng_state >> 17;
-    rng_state ^= rng_state << 5;
-    return rng_state;
+    heap_alloc_count++;
+    return malloc(size);
 }
 
-// Random float 0.0 to 1.0
-float random_float()
+void* operator new[](size_t size)
 {
-    return (float)xorshift32() / 4294967296.0f;
+    heap_alloc_count++;
+    return malloc(size);
 }
 
-// Add note to history buffer (circular buffer)
-void add_note_to_history(uint8_t note)
-{
-    note_history[note_history_index] = note;
-    note_history_index = (note_history_index + 1) % NOTE_HISTORY_SIZE;
-    if(note_history_count < NOTE_HISTORY_SIZE)
-        note_history_count++;
-}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
 
-// Check if note appears in recent history
-// Returns count of how many times it appears (0-8)
-int count_in_history(uint8_t note)
+uint32_t heap_allocs_after_init()
 {
-    int count = 0;
-    for(int i = 0; i < note_history_count; i++)
-    {
-        if(note_history[i] == note)
-            count++;
-    }
-    return count;
+    return heap_alloc_count - heap_alloc_count_at_init;
 }
 
-// Apply memory bias to note acceptance
-// Returns true if note should be accepted, false if it should be rejected
-bool apply_memory_bias(uint8_t candidate_note)
-{
-    // Get MEMORY parameter (0.0 = avoid repeats, 0.5 = neutral, 1.0 = favor repeats)
-    float memory_param = parameters_smoothed[PARAM_MEMORY];
+// ============================================================================
+// LOCK-FREE QUEUES (between the main loop and the interrupt contexts)
+// ============================================================================
 
-    // Apply energy scaling to memory
-    // High energy = seek more novelty (reduce memory toward 0.0)
-    float energy = parameters_smoothed[PARAM_ENERGY];
-    float energy_deviation = (energy - 0.5f) * 2.0f;  // -1.0 to +1.0
-    memory_param = memory_param - (energy_deviation * 0.3f);  // Energy biases toward novelty
-    if(memory_param < 0.0f) memory_param = 0.0f;
-    if(memory_param > 1.0f) memory_param = 1.0f;
+// Lock-free single-producer / single-consumer ring buffer
+// One context only pushes, one context only pops; SIZE must be a power of two
+template <typename T, uint32_t SIZE>
+struct SpscRing
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "SpscRing SIZE must be a power of two");
 
-    // Check if note is in recent history
-    int history_count = count_in_history(candidate_note);
+    T items[SIZE];
+    std::atomic<uint32_t> head{0};  // Written by producer only
+    std::atomic<uint32_t> tail{0};  // Written by consumer only
 
-    // If note not in history, always accept
-    if(history_count == 0)
+    // Producer side: returns false if the ring is full (item dropped)
+    bool Push(const T& item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) >= SIZE)
+            return false;
+        items[h & (SIZE - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
         return true;
+    }
 
-    // Calculate acceptance probability based on memory setting
-    float acceptance_probability = 1.0f;
-
-    if(memory_param < 0.4f)
+    // Consumer side: returns false if the ring is empty
+    bool Pop(T& item)
     {
-        // Low memory: Avoid repeats (seek novelty)
-        // The more the note appears in history, the lower the acceptance
-        float avoidance = (0.4f - memory_param) / 0.4f;  // 0.0 to 1.0
-        acceptance_probability = 1.0f - (avoidance * history_count / NOTE_HISTORY_SIZE);
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if(t == head.load(std::memory_order_acquire))
+            return false;
+        item = items[t & (SIZE - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
     }
-    else if(memory_param > 0.6f)
+
+    // Either side: items queued right now (the other side may change it)
+    uint32_t Size() const
     {
-        // High memory: Favor repeats
-        // The more the note appears in history, the higher the acceptance
-        float favoritism = (memory_param - 0.6f) / 0.4f;  // 0.0 to 1.0
-        acceptance_probability = 1.0f + (favoritism * history_count / NOTE_HISTORY_SIZE);
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
     }
-    // else: neutral range (0.4-0.6), acceptance = 1.0 (ignore history)
+};
+
+// ============================================================================
+// MAIN LOOP EVENTS (interrupt -> main loop wake-ups)
+// ============================================================================
+// The main loop sleeps in WFI until an interrupt leaves it work, instead of
+// polling every millisecond. Interrupts post event bits:
+//
+//   EVENT_CONTROL_TICK  Control tick timer (TIM3, CONTROL_RATE_HZ): pots,
+//                       encoder, smoothing and the control tick run at a fixed
+//                       rate, independent of loop load and of the gate sampling
+//   EVENT_NOTE_OUT      Audio callback queued generated notes: forwarded to
+//                       MIDI on that wake, not on the next poll
+//   EVENT_MIDI_IN       Gate capture timer moved received messages into
+//                       midi_in_queue (see MIDI CLOCK AND TRANSPORT)
+//
+// Gate edges go straight to the audio-rate scheduler; the main loop sees them
+// as EVENT_NOTE_OUT. The libDaisy MIDI and encoder drivers have no user hook:
+// the gate capture timer drains the MIDI parser queue, the encoder is
+// debounced by the control tick. After the events the loop runs its idle
+// work (lookahead, rhythm, persistence) and the display last, one unit
+// between event checks, so a flush never delays more than one pass.
+//
+// The sleep is cut short by every interrupt, not only by those that post
+// events: the audio callback (6 kHz at AUDIO_BLOCK_SIZE 8) and the gate
+// capture timer, which drops from 48 kHz to GATE_CAPTURE_IDLE_RATE_HZ while
+// nothing is timed (see GATE EDGE CAPTURE). main_loop_sleep_us over the
+// elapsed time is the sleep residency; the benchmark build reports it.
+
+enum MainEvent : uint32_t {
+    EVENT_CONTROL_TICK = 1u << 0,
+    EVENT_NOTE_OUT = 1u << 1,
+    EVENT_MIDI_IN = 1u << 2
+};
 
-    // Clamp probability
-    if(acceptance_probability < 0.0f) acceptance_probability = 0.0f;
-    if(acceptance_probability > 1.0f) acceptance_probability = 1.0f;
+const uint32_t CONTROL_RATE_HZ = 1000;
+std::atomic<uint32_t> main_events{0};
 
-    // Accept or reject based on probability
-    return random_float() < acceptance_probability;
-}
+// Sleep statistics (inspectable via debugger): CPU load = 1 - sleep / elapsed
+uint32_t main_loop_wakes = 0;
+uint64_t main_loop_sleep_us = 0;
 
-// Weighted random selection from interval histogram
-// Returns interval size (0-12 semitones)
-int select_interval_from_distribution()
+// Any interrupt context
+inline void post_main_event(uint32_t events)
 {
-    if(tendencies.total_intervals == 0)
-        return 2;  // Default to whole step if no data
+    main_events.fetch_or(events, std::memory_order_release);
+}
 
-    // Build cumulative weights
-    int cumulative[13];
-    int total = 0;
-    for(int i = 0; i <= 12; i++)
+// Main loop: take the pending events, sleeping until there are some (or
+// busy is set). Interrupts are masked between the check and WFI so an event
+// posted in between still ends the sleep: a pending interrupt wakes WFI,
+// then runs once they are unmasked.
+uint32_t wait_for_main_events(bool busy)
+{
+    for(;;)
     {
-        total += tendencies.interval_counts[i];
-        cumulative[i] = total;
+        __disable_irq();
+        uint32_t events = main_events.exchange(0, std::memory_order_acquire);
+        if(events != 0 || busy)
+        {
+            __enable_irq();
+            main_loop_wakes++;
+            return events;
+        }
+        uint32_t sleep_us = System::GetUs();
+        uint32_t sleep_cycles = trace_now();
+        __WFI();
+
+        // The core clock (and with it the cycle counter) may stop in sleep;
+        // the microsecond timer does not. Credit the trace clock with what
+        // it missed before any interrupt reads it.
+        uint32_t slept_us = System::GetUs() - sleep_us;
+        uint32_t slept_cycles = slept_us * (SystemCoreClock / 1000000);
+        uint32_t counted = trace_now() - sleep_cycles;
+        if(slept_cycles > counted)
+            trace_sleep_cycles += slept_cycles - counted;
+        main_loop_sleep_us += slept_us;
+        __enable_irq();
     }
+}
 
-    // Select random point in distribution
-    int rand_val = (int)(random_float() * total);
-
-    // Find which interval this corresponds to
-    for(int i = 0; i <= 12; i++)
-    {
-        if(rand_val < cumulative[i])
-            return i;
-    }
+TimerHandle control_tick_timer;
+const uint32_t CONTROL_TICK_COUNT_HZ = 1000000;  // TIM3 is 16-bit: count in us
 
-    return 2;  // Fallback
+void ControlTickCallback(void* data)
+{
+    post_main_event(EVENT_CONTROL_TICK);
 }
 
-// Select direction based on learned tendencies, DIRECTION parameter, and register gravity
-// Returns true for ascending, false for descending
-bool select_direction()
+// Configure TIM3 as the control tick (TIM2 is System's, TIM5 the gate capture)
+void StartControlTick()
 {
-    // Get direction parameter (0.0 = all down, 0.5 = neutral, 1.0 = all up)
-    float direction_bias = parameters_smoothed[PARAM_DIRECTION];
-
-    // Get register gravity parameter (0.0 = no gravity, 1.0 = strong pull to center)
-    float register_gravity = parameters_smoothed[PARAM_REGISTER];
+    TimerHandle::Config tim_cfg;
+    tim_cfg.periph = TimerHandle::Config::Peripheral::TIM_3;
+    tim_cfg.dir = TimerHandle::Config::CounterDir::UP;
+    tim_cfg.period = 0xFFFF;
+    tim_cfg.enable_irq = true;
+    control_tick_timer.Init(tim_cfg);
+    control_tick_timer.SetPrescaler(control_tick_timer.GetFreq() / CONTROL_TICK_COUNT_HZ - 1);
+    control_tick_timer.SetPeriod(CONTROL_TICK_COUNT_HZ / CONTROL_RATE_HZ - 1);
+    control_tick_timer.SetCallback(ControlTickCallback);
+    control_tick_timer.Start();
+}
 
-    // Calculate base probability from learned tendencies
-    float learned_up_probability = 0.5f;
-    int total_directional = tendencies.ascending_count + tendencies.descending_count;
-    if(total_directional > 0)
-    {
-        learned_up_probability = (float)tendencies.ascending_count / (float)total_directional;
-    }
+// ============================================================================
+// TEMPO TRACKING AND CLOCK MULTIPLICATION
+// ============================================================================
+// Gate 2 edges drive a phase-locked loop rather than a one-interval BPM: the
+// tracker predicts the next beat from its period estimate and corrects phase
+// and period by a fraction of the prediction error, so edge jitter is
+// averaged over several intervals. An edge further than TEMPO_OUTLIER from the
+// predicted grid is rejected (missed pulses are bridged: the error is taken
+// against the nearest predicted beat); TEMPO_RELOCK_EDGES rejections in a row
+// are a real tempo change and re-lock the tracker on the latest interval.
+//
+// In a clock rate other than CLOCK_RATE_OFF the grid, not Gate 1, triggers
+// generation: the gate capture timer ISR updates the tracker at the edge and
+// checks the next grid position (/2, x1, x2 or x4 of the beat, odd
+// subdivisions delayed by the swing) at every tick, pushing due positions into the gate
+// edge queue. Subdivided notes therefore land on the predicted grid with the
+// scheduler's sample-accurate latency, between clock edges as well as on them.
+
+const float    TEMPO_PHASE_GAIN = 0.4f;        // Phase error corrected per edge
+const float    TEMPO_PERIOD_GAIN = 0.05f;      // Phase error folded into the period (~critically damped)
+const float    TEMPO_OUTLIER = 0.2f;           // Reject edges > 20% of a period off the grid
+const uint8_t  TEMPO_RELOCK_EDGES = 3;         // Consecutive rejections that re-lock
+const float    TEMPO_TIMEOUT_PERIODS = 2.5f;   // No edge for this long: clock stopped
+const float    TEMPO_MIN_PERIOD_US = 200000.0f;   // 300 BPM
+const float    TEMPO_MAX_PERIOD_US = 3000000.0f;  // 20 BPM
+
+// Tracker state (gate capture ISR only)
+struct TempoTracker {
+    float    period_us;      // Beat period estimate, 0 = not locked
+    uint32_t beat_us;        // Grid time of the latest beat (phase reference)
+    uint32_t beat_index;     // Beats since boot
+    uint32_t last_edge_us;   // Latest edge, accepted or not
+    uint8_t  edges;          // Edges since the lock was lost (saturates at 2)
+    uint8_t  rejected;       // Consecutive outliers
+};
 
-    // Blend learned tendency with direction parameter
-    float blend_factor = fabs(direction_bias - 0.5f) * 2.0f;  // 0.0 to 1.0
-    float target_probability = (direction_bias > 0.5f) ? 1.0f : 0.0f;
-    float base_probability = learned_up_probability * (1.0f - blend_factor) +
-                             target_probability * blend_factor;
+TempoTracker tempo;
+std::atomic<uint32_t> tempo_period_us{0};  // Published period, 0 = no clock
+uint32_t tempo_outliers = 0;               // Rejected edges (inspectable via debugger)
+uint32_t tempo_relocks = 0;
+
+// Clock rate: grid positions per beat of the tracked clock
+enum ClockRate {
+    CLOCK_RATE_OFF = 0,  // Gate 1 triggers generation (default)
+    CLOCK_RATE_HALF,     // Every second beat
+    CLOCK_RATE_X1,       // Every beat (on the smoothed grid)
+    CLOCK_RATE_X2,       // Eighths of a quarter-note clock
+    CLOCK_RATE_X4,       // Sixteenths
+    CLOCK_RATE_COUNT
+};
 
-    // Apply register gravity - bias direction toward center pitch
-    // Gravity increases as we approach phrase target length, decreases with high energy
-    float gravity_influence = 0.0f;
-    float effective_gravity = register_gravity;
+// A grid position every `beats` / `ticks` beats
+struct ClockRateInfo {
+    const char* name;
+    uint8_t     beats;
+    uint8_t     ticks;
+};
 
-    // Apply energy scaling to gravity
-    // High energy = less gravity (more exploration)
-    float energy = parameters_smoothed[PARAM_ENERGY];
-    float energy_deviation = (energy - 0.5f) * 2.0f;  // -1.0 to +1.0
-    effective_gravity = register_gravity - (energy_deviation * 0.3f);  // Energy reduces gravity
-    if(effective_gravity < 0.0f) effective_gravity = 0.0f;
-    if(effective_gravity > 1.0f) effective_gravity = 1.0f;
+const ClockRateInfo clock_rates[CLOCK_RATE_COUNT] = {
+    {"",   1, 1},
+    {"/2", 2, 1},
+    {"x1", 1, 1},
+    {"x2", 1, 2},
+    {"x4", 1, 4},
+};
 
-    // Boost gravity near phrase boundaries
-    if(phrase_target_length > 0)
-    {
-        float phrase_progress = (float)phrase_note_count / (float)phrase_target_length;
-        if(phrase_progress > 0.7f)  // In last 30% of phrase
-        {
-            float phrase_boost = (phrase_progress - 0.7f) / 0.3f;  // 0.0 to 1.0
-            effective_gravity = effective_gravity + (phrase_boost * 0.3f);  // Add up to 0.3
-            if(effective_gravity > 1.0f) effective_gravity = 1.0f;
-        }
-    }
+const float CLOCK_SWING_MAX = 0.5f;  // Odd subdivisions delayed by up to half a step (75% swing)
 
-    if(effective_gravity > 0.05f)  // Only apply if gravity is meaningful
-    {
-        // Calculate distance from learned center (in semitones)
-        float distance_from_center = current_note - tendencies.register_center;
+// Settings (main loop -> gate capture ISR)
+std::atomic<uint8_t> clock_rate_setting{CLOCK_RATE_OFF};
+std::atomic<float>   clock_swing_setting{0.0f};
 
-        // Normalize to roughly -1.0 to +1.0 (assuming ±24 semitone typical range)
-        float normalized_distance = distance_from_center / 24.0f;
-        if(normalized_distance < -1.0f) normalized_distance = -1.0f;
-        if(normalized_distance > 1.0f) normalized_distance = 1.0f;
+// Grid trigger state (gate capture ISR only)
+uint8_t  clock_tick_rate = CLOCK_RATE_OFF;  // Rate the pending position was aimed for
+uint32_t clock_tick_index = 0;              // Pending position, counted in steps
+uint32_t clock_tick_due_us = 0;             // Its time on the current grid
 
-        // Gravity pulls toward center:
-        // If above center (positive distance), bias downward (negative influence)
-        // If below center (negative distance), bias upward (positive influence)
-        gravity_influence = -normalized_distance * effective_gravity;
-    }
+// Grid step of the current rate in us (the beat period when generation
+// follows Gate 1); 0 while no clock is locked. Any context.
+float clock_step_us()
+{
+    const ClockRateInfo& rate = clock_rates[clock_rate_setting.load(std::memory_order_relaxed)];
+    return (float)tempo_period_us.load(std::memory_order_relaxed) * rate.beats / rate.ticks;
+}
 
-    // Apply gravity as probability shift (-0.5 to +0.5 max)
-    float final_probability = base_probability + (gravity_influence * 0.5f);
-    if(final_probability < 0.0f) final_probability = 0.0f;
-    if(final_probability > 1.0f) final_probability = 1.0f;
+// Time of grid position `index` (steps of beats / ticks beats, odd
+// subdivisions of a beat swung)
+uint32_t clock_tick_time(uint32_t index)
+{
+    const ClockRateInfo& rate = clock_rates[clock_tick_rate];
+    int32_t from_beat = (int32_t)(index * rate.beats - tempo.beat_index * rate.ticks);
+    float beats = (float)from_beat / (float)rate.ticks;
+    if(rate.ticks > 1 && (index & 1))
+        beats += clock_swing_setting.load(std::memory_order_relaxed) / rate.ticks;
+    return tempo.beat_us + (uint32_t)(int32_t)(beats * tempo.period_us);
+}
 
-    return random_float() < final_probability;
+// Re-time the pending position on the current grid, dropping positions that
+// passed more than late_us ago (no burst of triggers after a phase jump)
+void clock_aim_tick(uint32_t now_us, uint32_t late_us)
+{
+    clock_tick_due_us = clock_tick_time(clock_tick_index);
+    while((int32_t)(now_us - clock_tick_due_us) > (int32_t)late_us)
+        clock_tick_due_us = clock_tick_time(++clock_tick_index);
 }
 
-// Apply octave displacement based on RANGE_WIDTH parameter
-// Occasionally transposes notes by ±1 or ±2 octaves for variety
-uint8_t apply_octave_displacement(uint8_t note)
+inline bool tempo_period_valid(float period_us)
 {
-    // Get RANGE_WIDTH parameter (0.0 = no displacement, 1.0 = frequent/large displacements)
-    float range_param = parameters_smoothed[PARAM_RANGE_WIDTH];
+    return period_us >= TEMPO_MIN_PERIOD_US && period_us <= TEMPO_MAX_PERIOD_US;
+}
 
-    // Apply energy scaling to range
-    // High energy = more octave displacements
-    float energy = parameters_smoothed[PARAM_ENERGY];
-    float energy_deviation = (energy - 0.5f) * 2.0f;  // -1.0 to +1.0
-    range_param = range_param + (energy_deviation * 0.3f);  // Energy adds up to ±0.3
-    if(range_param < 0.0f) range_param = 0.0f;
-    if(range_param > 1.0f) range_param = 1.0f;
+void tempo_publish()
+{
+    tempo_period_us.store((uint32_t)tempo.period_us, std::memory_order_relaxed);
+}
 
-    // No displacement if parameter very low
-    if(range_param < 0.1f)
-        return note;
+void tempo_unlock()
+{
+    tempo.period_us = 0.0f;
+    tempo.edges = 0;
+    tempo.rejected = 0;
+    tempo_publish();
+}
 
-    // Calculate displacement probability (0% at 0.0, ~20% at 1.0)
-    float displacement_probability = range_param * 0.2f;
+// Lock the grid on an edge with the given period
+void tempo_lock(uint32_t edge_us, float period_us)
+{
+    tempo.period_us = period_us;
+    tempo.beat_us = edge_us;
+    tempo.beat_index++;
+    tempo.rejected = 0;
+    tempo_publish();
+    clock_tick_rate = CLOCK_RATE_OFF;  // Grid triggers restart from this beat
+}
 
-    // Most of the time, no displacement
-    if(random_float() > displacement_probability)
-        return note;
+// Clock edge (gate capture ISR)
+void tempo_clock_edge(uint32_t edge_us)
+{
+    uint32_t interval_us = edge_us - tempo.last_edge_us;
+    tempo.last_edge_us = edge_us;
 
-    // Decide displacement amount based on RANGE setting
-    int octave_shift = 0;
-    if(range_param < 0.5f)
-    {
-        // Low range: only ±1 octave
-        octave_shift = (random_float() > 0.5f) ? 12 : -12;
-    }
-    else
+    if(tempo.edges < 2)
     {
-        // High range: can do ±1 or ±2 octaves
-        float roll = random_float();
-        if(roll < 0.5f)
-            octave_shift = 12;      // +1 octave
-        else if(roll < 0.75f)
-            octave_shift = -12;     // -1 octave
-        else if(roll < 0.875f)
-            octave_shift = 24;      // +2 octaves
+        // The first interval in range locks the tracker
+        if(tempo.edges == 1 && tempo_period_valid((float)interval_us))
+        {
+            tempo.edges = 2;
+            tempo_lock(edge_us, (float)interval_us);
+        }
         else
-            octave_shift = -24;     // -2 octaves
+        {
+            tempo.edges = 1;
+        }
+        return;
     }
 
-    // Apply displacement with MIDI range clamping
-    int displaced = note + octave_shift;
-    displaced = fmax(0, fmin(127, displaced));
+    // Error against the nearest predicted beat after the latest one
+    float since = (float)(int32_t)(edge_us - tempo.beat_us);
+    int32_t beats = (int32_t)(since / tempo.period_us + 0.5f);
+    float error = since - (float)beats * tempo.period_us;
+    if(beats < 1 || fabsf(error) > TEMPO_OUTLIER * tempo.period_us)
+    {
+        tempo_outliers++;
+        if(++tempo.rejected >= TEMPO_RELOCK_EDGES)
+        {
+            // Persistent disagreement: the tempo changed
+            tempo_relocks++;
+            if(tempo_period_valid((float)interval_us))
+                tempo_lock(edge_us, (float)interval_us);
+            else
+                tempo_unlock();
+        }
+        return;
+    }
 
-    return (uint8_t)displaced;
+    // PLL update: move the beat toward the edge, trim the period
+    tempo.rejected = 0;
+    tempo.beat_us += (uint32_t)(int32_t)((float)beats * tempo.period_us + TEMPO_PHASE_GAIN * error);
+    tempo.beat_index += (uint32_t)beats;
+    float period = tempo.period_us + TEMPO_PERIOD_GAIN * error / (float)beats;
+    if(period < TEMPO_MIN_PERIOD_US) period = TEMPO_MIN_PERIOD_US;
+    if(period > TEMPO_MAX_PERIOD_US) period = TEMPO_MAX_PERIOD_US;
+    tempo.period_us = period;
+    tempo_publish();
+
+    // The pending grid position follows the corrected grid
+    if(clock_tick_rate != CLOCK_RATE_OFF)
+        clock_aim_tick(edge_us, (uint32_t)(clock_step_us() * 0.5f));
 }
 
-// Generate next note based on learned tendencies and parameters
-uint8_t generate_next_note()
+// Gate capture ISR tick: true (and the position's grid time) when a grid
+// trigger is due
+bool clock_tick_due(uint32_t now_us, uint32_t& tick_us)
 {
-    uint8_t candidate_note = 0;
-    int attempts = 0;
-    const int MAX_ATTEMPTS = 4;  // Try up to 4 times to find acceptable note
-
-    // Get ENERGY macro parameter (0.0 = low energy/calm, 1.0 = high energy/wild)
-    float energy = parameters_smoothed[PARAM_ENERGY];
-
-    // Apply energy scaling to other parameters
-    // Energy modulates: motion (more leaps), memory (less repetition), phrase length
-    // Energy centered at 0.5 = neutral, deviations scale effects
-
-    float energy_deviation = (energy - 0.5f) * 2.0f;  // -1.0 to +1.0
+    if(tempo.period_us > 0.0f
+       && (float)(now_us - tempo.last_edge_us) > TEMPO_TIMEOUT_PERIODS * tempo.period_us)
+        tempo_unlock();
 
-    // Get MOTION parameter and apply energy boost
-    float motion_bias = parameters_smoothed[PARAM_MOTION];
-    motion_bias = motion_bias + (energy_deviation * 0.3f);  // Energy adds up to ±0.3
-    if(motion_bias < 0.0f) motion_bias = 0.0f;
-    if(motion_bias > 1.0f) motion_bias = 1.0f;
-
-    // Update phrase target length from PHRASE parameter, scaled by energy
-    float phrase_param = parameters_smoothed[PARAM_PHRASE];
-    phrase_param = phrase_param + (energy_deviation * 0.2f);  // Energy adds up to ±0.2
-    if(phrase_param < 0.0f) phrase_param = 0.0f;
-    if(phrase_param > 1.0f) phrase_param = 1.0f;
-    phrase_target_length = (int)(4.0f + phrase_param * 28.0f);  // 4 to 32 range
-
-    // Try generating notes until memory bias accepts one (or max attempts reached)
-    while(attempts < MAX_ATTEMPTS)
+    uint8_t rate = clock_rate_setting.load(std::memory_order_relaxed);
+    if(rate == CLOCK_RATE_OFF || tempo.period_us <= 0.0f)
     {
-        // Select interval size from learned distribution
-        int interval_size = select_interval_from_distribution();
+        clock_tick_rate = CLOCK_RATE_OFF;
+        return false;
+    }
 
-        // Bias toward smaller or larger intervals based on MOTION parameter
-        if(motion_bias < 0.5f)
-        {
-            // Bias toward smaller intervals
-            float scale = motion_bias * 2.0f;  // 0.0 to 1.0
-            interval_size = (int)(interval_size * scale + 0.5f);
-            if(interval_size == 0 && random_float() > 0.5f)
-                interval_size = 1;  // Prefer steps over repeats when going small
-        }
-        else
-        {
-            // Bias toward larger intervals
-            float scale = (motion_bias - 0.5f) * 2.0f;  // 0.0 to 1.0
-            int boost = (int)(scale * 4.0f);  // Add up to 4 semitones
-            interval_size = fmin(interval_size + boost, 12);
-        }
+    if(rate != clock_tick_rate)
+    {
+        // (Re)start at the first position from the latest beat on
+        clock_tick_rate = rate;
+        const ClockRateInfo& info = clock_rates[rate];
+        clock_tick_index = (tempo.beat_index * info.ticks + info.beats - 1) / info.beats;
+        clock_aim_tick(now_us, 0);
+    }
 
-        // Select direction (includes register gravity influence)
-        bool go_up = select_direction();
+    if((int32_t)(now_us - clock_tick_due_us) < 0)
+        return false;
+    tick_us = clock_tick_due_us;
+    clock_tick_index++;
+    clock_aim_tick(now_us, (uint32_t)(clock_step_us() * 0.5f));
+    return true;
+}
 
-        // Apply interval with direction
-        int signed_interval = go_up ? interval_size : -interval_size;
-        int new_note = current_note + signed_interval;
+// ============================================================================
+// SELF-CLOCKED RHYTHM (onsets drawn from the learned rhythm)
+// ============================================================================
+// In RHYTHM_MODE_LEARNED the module needs no trigger source: the main loop
+// keeps a few steps drawn from the active slot's rhythm histograms
+// (draw_rhythm_step()) in a queue, and the gate capture timer ISR times them.
+// Each due onset is pushed into the gate edge queue with its velocity and
+// length, and the next onset is due one drawn IOI later, so the gesture keeps
+// its timing whatever the main loop is doing.
+
+enum RhythmMode {
+    RHYTHM_MODE_OFF = 0,   // Notes follow Gate 1, audio input 4 or the clock rate
+    RHYTHM_MODE_LEARNED,   // Self-clocked from the learned rhythm
+    RHYTHM_MODE_COUNT
+};
 
-        // Clamp to MIDI range
-        new_note = fmax(0, fmin(127, new_note));
+std::atomic<uint8_t> rhythm_mode_setting{RHYTHM_MODE_OFF};  // Main loop -> ISR
 
-        // Apply octave displacement for variety
-        new_note = apply_octave_displacement(new_note);
+#define RHYTHM_STEP_QUEUE_SIZE 4
+SpscRing<RhythmStep, RHYTHM_STEP_QUEUE_SIZE> rhythm_step_queue;  // Main loop -> ISR
 
-        // Store candidate
-        candidate_note = (uint8_t)new_note;
+// Onset timing (gate capture ISR only)
+bool     rhythm_running = false;
+uint32_t rhythm_due_us = 0;
+uint32_t rhythm_underruns = 0;   // Onsets that found no drawn step (inspectable via debugger)
 
-        // Apply memory bias - accept or reject based on recent history
-        if(apply_memory_bias(candidate_note))
-        {
-            // Note accepted!
-            break;
-        }
+// Main loop: keep the queue topped up while generating
+void service_rhythm()
+{
+    if(rhythm_mode_setting.load(std::memory_order_relaxed) != RHYTHM_MODE_LEARNED
+       || learning_state != STATE_GENERATING || !phrase->tendencies_ready || !rhythm_ready())
+        return;
+    while(rhythm_step_queue.Push(draw_rhythm_step()))
+        ;
+}
 
-        attempts++;
+// Gate capture ISR tick: true (onset time and its step) when an onset is due.
+// Starts on the first drawn step, pauses when the queue runs dry.
+bool rhythm_onset_due(uint32_t now_us, uint32_t& onset_us, RhythmStep& step)
+{
+    if(rhythm_mode_setting.load(std::memory_order_relaxed) != RHYTHM_MODE_LEARNED)
+    {
+        rhythm_running = false;
+        return false;
+    }
+    if(!rhythm_running)
+    {
+        rhythm_due_us = now_us;
+    }
+    else if((int32_t)(now_us - rhythm_due_us) < 0)
+    {
+        return false;
     }
 
-    // Add accepted note to history
-    add_note_to_history(candidate_note);
+    if(!rhythm_step_queue.Pop(step))
+    {
+        if(rhythm_running)
+            rhythm_underruns++;
+        rhythm_running = false;
+        return false;
+    }
+    rhythm_running = true;
+    onset_us = rhythm_due_us;
+    rhythm_due_us += (uint32_t)step.ioi_ms * 1000u;
+    return true;
+}
 
-    // Update phrase tracking
-    phrase_note_count++;
+// ============================================================================
+// MIDI CLOCK AND TRANSPORT (24 PPQN in and out)
+// ============================================================================
+// MIDI clock drives the same tempo tracker as Gate 2: every 24th clock byte
+// is a beat, fed to tempo_clock_edge() and pushed into the gate edge queue
+// like a Gate 2 rising edge, so the clock rate grid and phrase switches
+// follow it. The clock is timed in the receive path, not the polled loop:
+// the gate capture ISR drains the MIDI parser queue on every tick, stamps
+// real-time messages with its own microsecond time and hands everything else
+// to the main loop through midi_in_queue. While MIDI clock arrives it takes
+// the tracker over from Gate 2.
+//
+// Start, Continue and Song Position (sixteenths, 6 clocks each) set the beat
+// phase, and the grid is re-phased on the next beat. Stop silences the grid
+// triggers until the next Start or Continue; the clocks a stopped master
+// keeps sending still track the tempo.
+//
+// Clock out: in CLOCK_OUT_FOLLOW the ISR emits 24 PPQN on the tracked grid
+// whatever its source (a Gate 2 clock comes out as MIDI clock) and forwards
+// transport messages; in CLOCK_OUT_INTERNAL the module is the master, an
+// internal beat at the INTERNAL_TEMPO_CC tempo replacing the external clocks
+// in the tracker, framed by a Start and a Stop. The ISR writes the bytes to
+// the UART itself, ahead of everything else (see MIDI UART TRANSMIT).
+
+const uint32_t MIDI_CLOCK_PPQN = 24;
+const uint32_t MIDI_CLOCKS_PER_SIXTEENTH = 6;   // Song Position unit
+const uint32_t MIDI_CLOCK_TIMEOUT_US = 250000;  // No clock for this long: back to Gate 2
+
+const uint8_t MIDI_TIMING_CLOCK = 0xF8;
+const uint8_t MIDI_START = 0xFA;
+const uint8_t MIDI_CONTINUE = 0xFB;
+const uint8_t MIDI_STOP = 0xFC;
+
+// What the tempo tracker follows, in order of precedence
+enum TempoSource {
+    TEMPO_SOURCE_GATE_2 = 0,  // Gate 2 edges (default)
+    TEMPO_SOURCE_MIDI,        // MIDI clock, while it arrives
+    TEMPO_SOURCE_INTERNAL     // Internal beat (CLOCK_OUT_INTERNAL)
+};
 
-    // Check if we should reset phrase (soft boundary)
-    if(phrase_note_count >= phrase_target_length)
-    {
-        // Probabilistic reset - higher chance as we go past target
-        float overrun = (float)(phrase_note_count - phrase_target_length);
-        float reset_probability = 0.5f + (overrun / (float)phrase_target_length) * 0.5f;
-        if(reset_probability > 1.0f) reset_probability = 1.0f;
+enum ClockOutMode {
+    CLOCK_OUT_OFF = 0,
+    CLOCK_OUT_FOLLOW,    // 24 PPQN of the tracked clock, transport forwarded
+    CLOCK_OUT_INTERNAL,  // Master at the internal tempo
+    CLOCK_OUT_COUNT
+};
 
-        if(random_float() < reset_probability)
-        {
-            phrase_note_count = 0;
-            // Optionally reseed RNG for variation
-            rng_state ^= System::GetNow();
-        }
-    }
+const int INTERNAL_TEMPO_MIN_BPM = 60;   // INTERNAL_TEMPO_CC 0-127 = 60-187 BPM
+const int INTERNAL_TEMPO_MAX_BPM = INTERNAL_TEMPO_MIN_BPM + 127;
 
-    // Store for next iteration
-    previous_note = current_note;
-    last_interval = candidate_note - current_note;
-    last_direction_up = (candidate_note > current_note);
+// Settings (main loop -> gate capture ISR)
+std::atomic<uint8_t> clock_out_setting{CLOCK_OUT_OFF};
+std::atomic<uint8_t> internal_bpm_setting{120};
 
-    return candidate_note;
-}
+// Published by the gate capture ISR
+std::atomic<uint8_t> tempo_source{TEMPO_SOURCE_GATE_2};
+std::atomic<bool>    midi_transport_running{true};  // No Stop since the last Start/Continue
 
-// Send MIDI note output
-void send_midi_note(uint8_t note, uint8_t velocity)
+// Received clock (gate capture ISR only)
+struct MidiClockIn {
+    uint32_t last_us;      // Latest clock byte
+    bool     seen;         // last_us is valid
+    uint8_t  ticks;        // Clocks since the latest beat, 0 = the next clock is a beat
+    uint32_t song_clocks;  // Song position in clocks (advances while running)
+    bool     resync;       // Re-phase the grid on the next beat
+};
+MidiClockIn midi_clock_in;
+
+// Clock out and internal beat (gate capture ISR only)
+bool     clock_out_running = false;
+uint32_t clock_out_index = 0;           // Next clock, counted in PPQN steps from beat 0
+bool     internal_clock_running = false;
+uint32_t internal_beat_due_us = 0;
+
+// Received messages other than real-time (gate capture ISR -> main loop).
+// The link carries about one message per ms, so this covers long passes.
+#define MIDI_IN_QUEUE_SIZE 16
+SpscRing<MidiEvent, MIDI_IN_QUEUE_SIZE> midi_in_queue;
+uint32_t midi_in_overflows = 0;
+
+// Outgoing clock and transport bytes (gate capture ISR only)
+#define MIDI_REALTIME_QUEUE_SIZE 16
+SpscRing<uint8_t, MIDI_REALTIME_QUEUE_SIZE> midi_realtime_out_queue;
+uint32_t midi_realtime_out_overflows = 0;
+
+void queue_midi_realtime(uint8_t status)
 {
-    // Hard clamp MIDI note to valid range: 0-127 (C0 to G9)
-    if(note > 127) note = 127;
-    // note is uint8_t so it can't be < 0
-
-    // Send Note On message (status byte + 2 data bytes)
-    uint8_t midi_data[3];
-    midi_data[0] = 0x90;  // Note On, channel 1
-    midi_data[1] = note;
-    midi_data[2] = velocity;
-    hw.midi.SendMessage(midi_data, 3);
+    if(!midi_realtime_out_queue.Push(status))
+        midi_realtime_out_overflows++;
 }
 
-// MIDI to CV conversion for pitch output (1V/octave)
-// Maps MIDI note to 0-5V DAC range
-// C1 (MIDI 36) = 0V, C2 (48) = 1V, C3 (60) = 2V, C4 (72) = 3V, C5 (84) = 4V, C6 (96) = 5V
-float midi_note_to_cv(uint8_t midi_note)
+TempoSource tempo_source_at(uint32_t now_us)
 {
-    // 1V/octave standard: each octave (12 semitones) = 1 volt
-    // Reference: MIDI 36 (C1) = 0V
-    float cv = (float)(midi_note - 36) / 12.0f;
-
-    // Clamp to DAC range (0-5V)
-    if(cv < 0.0f) cv = 0.0f;
-    if(cv > 5.0f) cv = 5.0f;
-
-    return cv;
+    if(clock_out_setting.load(std::memory_order_relaxed) == CLOCK_OUT_INTERNAL)
+        return TEMPO_SOURCE_INTERNAL;
+    if(midi_clock_in.seen && now_us - midi_clock_in.last_us < MIDI_CLOCK_TIMEOUT_US)
+        return TEMPO_SOURCE_MIDI;
+    return TEMPO_SOURCE_GATE_2;
 }
 
-// CV to MIDI conversion (for pitch CV input)
-// Assumes CV input is calibrated for 1V/octave
-float cv_to_midi_note(float cv_voltage)
+float internal_beat_period_us()
 {
-    // CV range: -5V to +5V = 10 octaves = 120 semitones
-    // Center at C4 (MIDI 60)
-    return 60.0f + (cv_voltage * 12.0f);  // 12 semitones per volt
+    return 60000000.0f / (float)internal_bpm_setting.load(std::memory_order_relaxed);
 }
 
-// DAC callback for CV pitch output (only for Daisy Patch SM)
-// Full Daisy Patch doesn't have CV outputs - uses MIDI instead
-// Keeping this code commented for reference/future PatchSM port
-/*
-void CvCallback(uint16_t **output, size_t size)
+// Re-phase the grid on this beat, keeping the tracked period
+void tempo_resync(uint32_t beat_us)
 {
-    for(size_t i = 0; i < size; i++)
+    if(tempo.period_us <= 0.0f)
     {
-        // Convert current MIDI note to CV voltage (0-5V)
-        float cv_voltage = midi_note_to_cv(current_note);
-
-        // Convert to 12-bit DAC value (0-4095)
-        // DAC range: 0 = 0V, 4095 = ~5V
-        uint16_t dac_value = (uint16_t)(cv_voltage * 4095.0f / 5.0f);
-
-        // Output to both CV outputs
-        output[0][i] = dac_value;  // CV OUT 1
-        output[1][i] = dac_value;  // CV OUT 2
+        tempo_clock_edge(beat_us);
+        return;
     }
+    tempo.last_edge_us = beat_us;
+    tempo_lock(beat_us, tempo.period_us);
 }
-*/
 
-// Start learning from user input
-void start_learning()
+// Clock byte (gate capture ISR): true on a beat that fed the tracker
+bool midi_clock_tick(uint32_t now_us)
 {
-    learning_state = STATE_LEARNING;
-    note_buffer_count = 0;
-    last_note_time = System::GetNow();
-    log_debug(DBG_LEARNING_START);
+    MidiClockIn& in = midi_clock_in;
+    in.last_us = now_us;
+    in.seen = true;
+    bool beat = in.ticks == 0;
+    if(++in.ticks >= MIDI_CLOCK_PPQN)
+        in.ticks = 0;
+    if(midi_transport_running.load(std::memory_order_relaxed))
+        in.song_clocks++;
+    if(!beat || tempo_source_at(now_us) != TEMPO_SOURCE_MIDI)
+        return false;
+
+    if(in.resync)
+        tempo_resync(now_us);
+    else
+        tempo_clock_edge(now_us);
+    in.resync = false;
+    return true;
 }
 
-// Add note to learning buffer
-void add_note_to_buffer(uint8_t midi_note)
+// Start, Continue or Stop (gate capture ISR)
+void midi_transport(uint8_t status)
 {
-    if(learning_state == STATE_LEARNING && note_buffer_count < MAX_LEARN_NOTES)
+    MidiClockIn& in = midi_clock_in;
+    if(status == MIDI_START)
     {
-        note_buffer[note_buffer_count] = midi_note;
-        note_buffer_count++;
-        last_note_time = System::GetNow();
-        log_debug(DBG_NOTE_RECEIVED, midi_note, note_buffer_count);
-
-        // Visual feedback: blink LED
-        hw.seed.SetLed(true);
+        in.song_clocks = 0;
+        in.ticks = 0;  // The first clock after Start is the downbeat
     }
-}
-
-// Check if learning should stop (timeout or buffer full)
-void update_learning_state()
-{
-    if(learning_state == STATE_LEARNING)
+    else if(status == MIDI_CONTINUE)
     {
-        uint32_t current_time = System::GetNow();
-        uint32_t time_since_note = current_time - last_note_time;
-
-        // Calculate learning timeout from parameter (0.5s - 10s)
-        // Parameter 0.0 = 500ms, 0.158 ≈ 2000ms (default), 1.0 = 10000ms
-        float timeout_param = parameters_smoothed[PARAM_LEARN_TIMEOUT];
-        uint32_t learning_timeout_ms = 500 + (uint32_t)(timeout_param * 9500.0f);
-
-        // Stop learning if:
-        // 1. Buffer is full (16 notes), OR
-        // 2. Timeout (parameter-controlled) AND we have minimum notes (4)
-        if(note_buffer_count >= MAX_LEARN_NOTES ||
-           (time_since_note > learning_timeout_ms && note_buffer_count >= MIN_LEARN_NOTES))
-        {
-            learning_state = STATE_GENERATING;
-            log_debug(DBG_LEARNING_STOP, note_buffer_count,
-                     (time_since_note > learning_timeout_ms) ? 1 : 0);  // 1=timeout, 0=buffer full
-
-            // Analyze learned notes and extract tendencies
-            analyze_learned_notes();
-
-            // Initialize generation state from learned notes
-            // Start at the register center
-            current_note = (uint8_t)tendencies.register_center;
-            previous_note = current_note;
-            last_interval = 0;
-            last_direction_up = (tendencies.ascending_count >= tendencies.descending_count);
-
-            // Clear note history for memory bias system
-            note_history_count = 0;
-            note_history_index = 0;
-            for(int i = 0; i < NOTE_HISTORY_SIZE; i++)
-                note_history[i] = 0;
-
-            // Initialize phrase tracking
-            phrase_note_count = 0;
-            phrase_target_length = 12;  // Default medium length
-
-            // Seed RNG with current time for variety
-            rng_state = System::GetNow();
-        }
+        in.ticks = (uint8_t)(in.song_clocks % MIDI_CLOCK_PPQN);
     }
+    in.resync = status != MIDI_STOP;
+    midi_transport_running.store(status != MIDI_STOP, std::memory_order_relaxed);
+    if(clock_out_setting.load(std::memory_order_relaxed) == CLOCK_OUT_FOLLOW)
+        queue_midi_realtime(status);
 }
 
-void AudioCallback(AudioHandle::InputBuffer  in,
-                   AudioHandle::OutputBuffer out,
-                   size_t                    size)
+void midi_song_position(uint16_t sixteenths)
 {
-    // Simple passthrough for now
-    for(size_t i = 0; i < size; i++)
-    {
-        out[0][i] = in[0][i];
-        out[1][i] = in[1][i];
-        out[2][i] = in[2][i];
-        out[3][i] = in[3][i];
-    }
+    MidiClockIn& in = midi_clock_in;
+    in.song_clocks = (uint32_t)sixteenths * MIDI_CLOCKS_PER_SIXTEENTH;
+    in.ticks = (uint8_t)(in.song_clocks % MIDI_CLOCK_PPQN);
+    in.resync = true;
 }
 
-void UpdateDisplay()
+// Gate capture ISR tick: true (and the beat time) when an internal master
+// beat is due. Queues Start when the internal clock begins, Stop when it ends.
+bool internal_beat_due(uint32_t now_us, uint32_t& beat_us)
 {
-    hw.display.Fill(false);
-
-    // Page indicator dots (top right)
-    for(int i = 0; i < NUM_PAGES; i++)
+    if(clock_out_setting.load(std::memory_order_relaxed) != CLOCK_OUT_INTERNAL)
     {
-        int x = 110 + (i * 6);
-        int y = 2;
-        if(i == current_page)
-        {
-            // Filled circle for current page
-            hw.display.DrawCircle(x, y, 2, true);
-        }
-        else
-        {
-            // Empty circle for other pages
-            hw.display.DrawCircle(x, y, 2, false);
-        }
+        if(internal_clock_running)
+            queue_midi_realtime(MIDI_STOP);
+        internal_clock_running = false;
+        return false;
     }
-
-    // Clock pulse indicator (top left, next to page name)
-    if(clock_pulse_indicator > 0)
+    if(!internal_clock_running)
     {
-        hw.display.DrawCircle(60, 2, 2, true);
+        internal_clock_running = true;
+        internal_beat_due_us = now_us;
+        midi_transport_running.store(true, std::memory_order_relaxed);
+        queue_midi_realtime(MIDI_START);
     }
-    else
+    else if((int32_t)(now_us - internal_beat_due_us) < 0)
     {
-        hw.display.DrawCircle(60, 2, 2, false);
+        return false;
     }
+    beat_us = internal_beat_due_us;
+    internal_beat_due_us += (uint32_t)internal_beat_period_us();
+    return true;
+}
+
+// Internal beats are exact: they set the grid instead of being tracked
+void tempo_internal_beat(uint32_t beat_us)
+{
+    tempo.last_edge_us = beat_us;
+    tempo.edges = 2;
+    tempo_lock(beat_us, internal_beat_period_us());
+}
 
-    // Page name (top left)
-    hw.display.SetCursor(0, 0);
-    std::string page_title = "PAGE " + std::to_string(current_page + 1);
-    hw.display.WriteString((char*)page_title.c_str(), Font_6x8, true);
+// Time of clock `index` on the tracked grid
+uint32_t clock_out_time(uint32_t index)
+{
+    int32_t from_beat = (int32_t)(index - tempo.beat_index * MIDI_CLOCK_PPQN);
+    return tempo.beat_us
+           + (uint32_t)(int32_t)((float)from_beat * tempo.period_us / (float)MIDI_CLOCK_PPQN);
+}
 
-    // Draw line separator
-    for(int x = 0; x < 128; x++)
+// Gate capture ISR tick: true when a clock byte is due. Clocks stop with the
+// tracker; a phase jump skips the clocks it passed instead of bursting them.
+bool midi_clock_out_due(uint32_t now_us)
+{
+    if(clock_out_setting.load(std::memory_order_relaxed) == CLOCK_OUT_OFF
+       || tempo.period_us <= 0.0f)
     {
-        hw.display.DrawPixel(x, 12, true);
+        clock_out_running = false;
+        return false;
     }
-
-    // Parameter names and values (4 params per page)
-    for(int i = 0; i < PARAMS_PER_PAGE; i++)
+    if(!clock_out_running)
     {
-        int y = 16 + (i * 11);
-
-        // Parameter name from current page
-        hw.display.SetCursor(0, y);
-        hw.display.WriteString((char*)page_names[current_page][i], Font_6x8, true);
+        clock_out_running = true;
+        clock_out_index = tempo.beat_index * MIDI_CLOCK_PPQN;
+    }
+    int32_t late_us = (int32_t)(tempo.period_us * 0.5f / (float)MIDI_CLOCK_PPQN);
+    uint32_t due_us = clock_out_time(clock_out_index);
+    while((int32_t)(now_us - due_us) > late_us)
+        due_us = clock_out_time(++clock_out_index);
+    if((int32_t)(now_us - due_us) < 0)
+        return false;
+    clock_out_index++;
+    return true;
+}
+
+// ============================================================================
+// MIDI UART TRANSMIT (interrupt-driven, real-time bytes first)
+// ============================================================================
+// libDaisy's MIDI transport sends with a blocking HAL transmit that returns
+// only once the bytes are out (320us each at 31.25 kbaud), and its UART has
+// no DMA or TX interrupt hook. Nothing calls SendMessage(): the main loop
+// queues bytes in midi_tx_queue and the gate capture timer, which ticks more
+// often than a byte leaves the wire, writes the next one into the USART1
+// (MIDI out, PB6) data register whenever it is empty. The data register
+// sits in front of the shift register, so the link stays saturated and no
+// context ever waits for it.
+//
+// Clock and transport bytes are written by the same tick that times them,
+// ahead of the queue (real-time bytes may sit inside any message). For
+// MIDI_TX_HOLD_US before a clock byte is due no queued byte is started, so
+// the UART is idle when the clock comes due: the clock leaves within one
+// capture tick of its time whatever the main loop is doing.
+
+#define MIDI_TX_QUEUE_SIZE 64
+const uint32_t MIDI_TX_HOLD_US = 2 * 320;  // Data register + shift register
+
+SpscRing<uint8_t, MIDI_TX_QUEUE_SIZE> midi_tx_queue;  // Main loop -> gate capture ISR
+std::atomic<uint32_t> midi_tx_last_send_us{0};         // Latest byte queued or real-time byte sent
+uint32_t midi_tx_holds = 0;                            // Ticks a queued byte waited for a clock
+
+// Gate capture ISR, after the tick queued its real-time bytes: hand the
+// UART one byte if it can take one
+void midi_tx_drain(uint32_t now_us)
+{
+    if(!(USART1->ISR & USART_ISR_TXE_TXFNF))
+        return;
+    uint8_t byte;
+    if(midi_realtime_out_queue.Pop(byte))
+    {
+        USART1->TDR = byte;
+        midi_tx_last_send_us.store(now_us, std::memory_order_relaxed);
+        return;
+    }
+    if(clock_out_running
+       && (int32_t)(clock_out_time(clock_out_index) - now_us) < (int32_t)MIDI_TX_HOLD_US)
+    {
+        if(midi_tx_queue.Size() > 0)
+            midi_tx_holds++;
+        return;
+    }
+    if(midi_tx_queue.Pop(byte))
+        USART1->TDR = byte;
+}
+
+// Main loop: queue bytes, all or none; false if they do not fit
+bool midi_tx_queue_bytes(const uint8_t* bytes, int count)
+{
+    if(midi_tx_queue.Size() + (uint32_t)count > MIDI_TX_QUEUE_SIZE)
+        return false;
+    for(int i = 0; i < count; i++)
+        midi_tx_queue.Push(bytes[i]);
+    return true;
+}
+
+// ============================================================================
+// GATE EDGE CAPTURE (timer-driven, microsecond timestamps)
+// ============================================================================
+// The Patch gate inputs are plain GPIOs (no timer input-capture channel, and
+// libDaisy has no EXTI wrapper), so a dedicated hardware timer samples both
+// gates at GATE_CAPTURE_RATE_HZ and timestamps every edge with System::GetUs().
+// Edges reach the audio-rate scheduler through a lock-free SPSC ring, so BPM
+// and trigger timing no longer depend on main loop load or on UpdateDisplay().
+//
+// While nothing is timed (no gate edge for GATE_CAPTURE_IDLE_AFTER_US, no
+// clock tracked or sent, no self-clocked rhythm) the timer drops to
+// GATE_CAPTURE_IDLE_RATE_HZ so that the main loop sleeps longer: the edge
+// that wakes it up is stamped to 250us, the following ones to 21us again.
+// The idle rate still feeds the UART faster than a byte leaves the wire.
+
+struct GateEdge {
+    uint32_t time_us;  // System::GetUs() when the edge was sampled
+    uint32_t cycles;   // trace_now() at the same moment (latency tracing)
+    uint8_t gate;      // 0 = Gate 1 (note trigger), 1 = Gate 2 (clock), GATE_EDGE_CLOCK_TICK,
+                       // GATE_EDGE_RHYTHM or GATE_EDGE_BEAT
+    bool rising;       // true = low->high
+    uint8_t velocity;  // GATE_EDGE_RHYTHM only: the drawn note
+    uint16_t length_ms;
+};
+
+const uint8_t GATE_EDGE_CLOCK_TICK = 2;  // Grid trigger of the clock rate (always rising)
+const uint8_t GATE_EDGE_RHYTHM = 3;      // Self-clocked onset (always rising)
+const uint8_t GATE_EDGE_BEAT = 4;        // Beat of MIDI clock or the internal clock (always rising)
+
+const uint32_t GATE_CAPTURE_RATE_HZ = 48000;        // ~21us edge resolution
+const uint32_t GATE_CAPTURE_IDLE_RATE_HZ = 4000;    // 250us, MIDI byte = 320us
+const uint32_t GATE_CAPTURE_IDLE_AFTER_US = 2000000;
+#define GATE_EDGE_QUEUE_SIZE 32
+
+SpscRing<GateEdge, GATE_EDGE_QUEUE_SIZE> gate_edge_queue;
+TimerHandle gate_capture_timer;
+bool gate_capture_level[2] = {false, false};  // Last level seen by the ISR
+uint32_t gate_edge_overflows = 0;             // Edges dropped (queue full)
+uint32_t gate_capture_timer_hz = 0;           // Timer count rate
+bool     gate_capture_fast = true;            // Sampling at GATE_CAPTURE_RATE_HZ
+uint32_t gate_capture_active_us = 0;          // Latest tick that timed something
+
+void push_gate_edge(const GateEdge& edge)
+{
+    if(!gate_edge_queue.Push(edge))
+        gate_edge_overflows++;
+}
+
+// Drain the MIDI parser queue (see MIDI CLOCK AND TRANSPORT): real-time
+// messages and Song Position are handled here, at this tick's time; the
+// rest goes to service_midi_in(). The master ignores other clocks.
+void midi_receive(uint32_t now_us, uint32_t now_cycles)
+{
+    bool internal = clock_out_setting.load(std::memory_order_relaxed) == CLOCK_OUT_INTERNAL;
+    bool forwarded = false;
+    while(hw.midi.HasEvents())
+    {
+        MidiEvent event = hw.midi.PopEvent();
+        if(event.type == SystemRealTime)
+        {
+            if(internal)
+                continue;
+            if(event.srt_type == TimingClock)
+            {
+                if(midi_clock_tick(now_us))
+                    push_gate_edge({now_us, now_cycles, GATE_EDGE_BEAT, true});
+            }
+            else if(event.srt_type == Start)
+                midi_transport(MIDI_START);
+            else if(event.srt_type == Continue)
+                midi_transport(MIDI_CONTINUE);
+            else if(event.srt_type == Stop)
+                midi_transport(MIDI_STOP);
+        }
+        else if(event.type == SystemCommon && event.sc_type == SongPositionPointer)
+        {
+            if(!internal)
+                midi_song_position((uint16_t)(event.data[0] | (event.data[1] << 7)));
+        }
+        else
+        {
+            if(!midi_in_queue.Push(event))
+                midi_in_overflows++;
+            forwarded = true;
+        }
+    }
+    if(forwarded)
+        post_main_event(EVENT_MIDI_IN);
+}
+
+// Timer ISR: receive MIDI, sample both gates, push an entry for every level
+// change, feed clock edges to the tempo tracker, push due grid triggers and
+// onsets, time MIDI clock out, feed the UART and pick the sampling rate
+void GateCaptureCallback(void* data)
+{
+    uint32_t now_us = System::GetUs();
+    uint32_t now_cycles = trace_now();
+    bool timing = false;
+    midi_receive(now_us, now_cycles);
+    TempoSource source = tempo_source_at(now_us);
+    tempo_source.store((uint8_t)source, std::memory_order_relaxed);
+
+    for(uint8_t g = 0; g < 2; g++)
+    {
+        bool level = hw.gate_input[g].State();
+        if(level != gate_capture_level[g])
+        {
+            gate_capture_level[g] = level;
+            timing = true;
+            push_gate_edge({now_us, now_cycles, g, level});
+            if(g == 1 && level && source == TEMPO_SOURCE_GATE_2)
+                tempo_clock_edge(now_us);
+        }
+    }
+
+    // Internal master beat (see MIDI CLOCK AND TRANSPORT)
+    uint32_t tick_us;
+    if(internal_beat_due(now_us, tick_us))
+    {
+        tempo_internal_beat(tick_us);
+        push_gate_edge({tick_us, now_cycles, GATE_EDGE_BEAT, true});
+    }
+
+    // Grid triggers of the clock rate (see TEMPO TRACKING); positions pass
+    // silently while the MIDI transport is stopped
+    if(clock_tick_due(now_us, tick_us) && midi_transport_running.load(std::memory_order_relaxed))
+        push_gate_edge({tick_us, now_cycles, GATE_EDGE_CLOCK_TICK, true});
+
+    if(midi_clock_out_due(now_us))
+        queue_midi_realtime(MIDI_TIMING_CLOCK);
+
+    // Self-clocked onsets (see SELF-CLOCKED RHYTHM)
+    RhythmStep step;
+    if(rhythm_onset_due(now_us, tick_us, step))
+        push_gate_edge({tick_us, now_cycles, GATE_EDGE_RHYTHM, true, step.velocity, step.duration_ms});
+
+    midi_tx_drain(now_us);
+
+    // Fast sampling while anything is timed, idle rate otherwise
+    timing = timing || source != TEMPO_SOURCE_GATE_2 || tempo.period_us > 0.0f
+             || clock_out_running || rhythm_running;
+    if(timing)
+        gate_capture_active_us = now_us;
+    bool fast = now_us - gate_capture_active_us < GATE_CAPTURE_IDLE_AFTER_US;
+    if(fast != gate_capture_fast)
+    {
+        gate_capture_fast = fast;
+        gate_capture_timer.SetPeriod(gate_capture_timer_hz
+                                     / (fast ? GATE_CAPTURE_RATE_HZ : GATE_CAPTURE_IDLE_RATE_HZ));
+    }
+}
+
+// Configure TIM5 as the gate sampling clock (TIM2 is System's time base)
+void StartGateCapture()
+{
+    TimerHandle::Config tim_cfg;
+    tim_cfg.periph = TimerHandle::Config::Peripheral::TIM_5;
+    tim_cfg.dir = TimerHandle::Config::CounterDir::UP;
+    tim_cfg.period = 0xFFFFFFFF;
+    tim_cfg.enable_irq = true;
+    gate_capture_timer.Init(tim_cfg);
+    gate_capture_timer_hz = gate_capture_timer.GetFreq();
+    gate_capture_active_us = System::GetUs();
+    gate_capture_timer.SetPeriod(gate_capture_timer_hz / GATE_CAPTURE_RATE_HZ);
+    gate_capture_timer.SetCallback(GateCaptureCallback);
+    gate_capture_timer.Start();
+}
+
+// ============================================================================
+// MIDI OUTPUT
+// ============================================================================
+// Outgoing notes are queued and drained from the main loop into the UART
+// byte queue (see MIDI UART TRANSMIT) at the rate the 31.25 kbaud link can
+// carry (3.125 bytes/ms): at most MIDI_TX_AHEAD bytes wait for the wire, so
+// dense clocking never builds a backlog and a Note Off goes out close to its
+// time. Note Off is sent as Note On with velocity 0 so that running status
+// covers both, and every sounding note sits in an active-note table until its
+// scheduled Note Off.
+
+#define MIDI_OUT_QUEUE_SIZE 64
+#define MAX_ACTIVE_NOTES 32
+const int      MIDI_TX_AHEAD = 12;                 // Max bytes waiting for the wire (3.8ms)
+const int      MIDI_NOTE_ON_MAX_BYTES = 6;         // Retrigger Note Off + Note On
+const uint32_t MIDI_RUNNING_STATUS_REFRESH_US = 1000000;  // Resend status after idle
+
+struct MidiOutMessage {
+    uint32_t queued_us;    // When the note was handed to the output
+    uint32_t length_us;    // Time from Note On to scheduled Note Off
+    uint32_t edge_cycles;  // trace_now() of the triggering gate edge, 0 = untraced
+    uint8_t  note;
+    uint8_t  velocity;
+    uint8_t  channel;
+};
+SpscRing<MidiOutMessage, MIDI_OUT_QUEUE_SIZE> midi_out_queue;
+
+struct ActiveNote {
+    uint32_t off_us;       // Scheduled Note Off time
+    uint8_t  note;
+    uint8_t  channel;
+    bool     active;
+};
+ActiveNote active_notes[MAX_ACTIVE_NOTES];
+
+uint8_t  midi_running_status = 0;   // 0 = next message sends its status byte
+uint32_t midi_out_overflows = 0;    // Note Ons dropped: queue full
+uint32_t midi_out_stale = 0;        // Note Ons dropped: would already be over
+uint32_t midi_out_steals = 0;       // Active notes cut short: table full
+
+// Queue a note for MIDI output (main loop context)
+void send_midi_note(uint8_t note, uint8_t velocity, uint8_t channel = 0,
+                    float length_ms = 100.0f, uint32_t edge_cycles = 0)
+{
+    // Hard clamp MIDI note to valid range: 0-127 (C0 to G9)
+    if(note > 127) note = 127;
+    // note is uint8_t so it can't be < 0
+
+    MidiOutMessage message = {System::GetUs(), (uint32_t)(length_ms * 1000.0f), edge_cycles,
+                              note, velocity, (uint8_t)(channel & 0x0F)};
+    if(!midi_out_queue.Push(message))
+        midi_out_overflows++;
+}
+
+// Append a Note On (velocity 0 = Note Off) to the batch, omitting a repeated
+// status byte
+int midi_out_encode(uint8_t* batch, int n, uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    uint8_t status = 0x90 | channel;  // Note On (channel 0 = MIDI channel 1)
+    if(status != midi_running_status)
+    {
+        batch[n++] = status;
+        midi_running_status = status;
+    }
+    batch[n++] = note;
+    batch[n++] = velocity;
+    return n;
+}
+
+// Slot for a new sounding note: its own slot on retrigger, else a free one,
+// else the note due to end soonest. Sets *cut if a sounding note must end first.
+int active_note_slot(uint8_t channel, uint8_t note, uint32_t now_us, bool* cut)
+{
+    int free_slot = -1;
+    int soonest = 0;
+    for(int i = 0; i < MAX_ACTIVE_NOTES; i++)
+    {
+        if(!active_notes[i].active)
+        {
+            if(free_slot < 0)
+                free_slot = i;
+            continue;
+        }
+        if(active_notes[i].note == note && active_notes[i].channel == channel)
+        {
+            *cut = true;
+            return i;
+        }
+        if((int32_t)(active_notes[i].off_us - now_us)
+           < (int32_t)(active_notes[soonest].off_us - now_us)
+           || !active_notes[soonest].active)
+            soonest = i;
+    }
+    if(free_slot >= 0)
+    {
+        *cut = false;
+        return free_slot;
+    }
+    *cut = true;
+    midi_out_steals++;
+    return soonest;
+}
+
+// Drain a pending SysEx dump, else due Note Offs, then queued Note Ons, as
+// far as the UART queue allows (clock and transport bytes bypass it)
+void service_midi_out()
+{
+    uint32_t now_us = System::GetUs();
+
+    // Let receivers that missed the last status byte resynchronise
+    if(now_us - midi_tx_last_send_us.load(std::memory_order_relaxed) > MIDI_RUNNING_STATUS_REFRESH_US)
+        midi_running_status = 0;
+
+    uint8_t batch[MIDI_TX_AHEAD];
+    int n = 0;
+
+    int queued = (int)midi_tx_queue.Size();
+    int budget = queued < MIDI_TX_AHEAD ? MIDI_TX_AHEAD - queued : 0;
+
+    // A dump in progress owns the link until its last F7
+    if(sysex_tx_pending())
+    {
+        n = sysex_tx_length - sysex_tx_pos;
+        if(n > budget)
+            n = budget;
+        if(n > 0 && midi_tx_queue_bytes(&sysex_tx[sysex_tx_pos], n))
+        {
+            sysex_tx_pos += n;
+            midi_tx_last_send_us.store(now_us, std::memory_order_relaxed);
+        }
+        midi_running_status = 0;  // SysEx cancels running status
+        return;
+    }
+
+    // Trace stamps of the Note Ons in this batch
+    uint32_t traced[MIDI_TX_AHEAD / 3];
+    int traced_count = 0;
+
+    // Note Offs first: they free receiver voices
+    for(int i = 0; i < MAX_ACTIVE_NOTES; i++)
+    {
+        ActiveNote& a = active_notes[i];
+        if(!a.active || (int32_t)(now_us - a.off_us) < 0)
+            continue;
+        if(n + 3 > budget)
+            break;
+        n = midi_out_encode(batch, n, a.channel, a.note, 0);
+        a.active = false;
+    }
+
+    MidiOutMessage m;
+    while(n + MIDI_NOTE_ON_MAX_BYTES <= budget && midi_out_queue.Pop(m))
+    {
+        // A note that waited out its whole length in the queue is skipped
+        if(now_us - m.queued_us >= m.length_us)
+        {
+            midi_out_stale++;
+            continue;
+        }
+
+        bool cut;
+        int slot = active_note_slot(m.channel, m.note, now_us, &cut);
+        if(cut)
+            n = midi_out_encode(batch, n, active_notes[slot].channel, active_notes[slot].note, 0);
+        n = midi_out_encode(batch, n, m.channel, m.note, m.velocity);
+        if(m.edge_cycles != 0)
+            traced[traced_count++] = m.edge_cycles;
+
+        active_notes[slot].off_us = now_us + m.length_us;
+        active_notes[slot].note = m.note;
+        active_notes[slot].channel = m.channel;
+        active_notes[slot].active = true;
+    }
+
+    if(n > 0)
+    {
+        midi_tx_queue_bytes(batch, n);  // Fits: n <= budget
+        midi_tx_last_send_us.store(now_us, std::memory_order_relaxed);
+
+        uint32_t sent_cycles = trace_now();
+        for(int i = 0; i < traced_count; i++)
+            trace_record(TRACE_GATE_TO_MIDI, sent_cycles - traced[i]);
+    }
+}
+
+// ============================================================================
+// REPLAY LOG RECORDING (dumped over SysEx, rendered on the host)
+// ============================================================================
+// While recording, every input of the generator core goes into a replay log
+// (replay_log.h) in SDRAM: the seed, the active phrase slot, the parameter
+// moves, learning and phrase switches, and one record per note trigger. The
+// host renderer replays it through the same core note for note.
+// The log starts with the active slot's contents, so recording can start at
+// any time: before learning, while learning or while generating.
+//
+// Recording makes the session deterministic: the seed is fixed (and the
+// voices restarted from it when already generating), the lookahead queue is
+// off so the audio callback generates from the state it logs, and the
+// smoothed parameters are held on the log's 10-bit grid (the smoothing
+// settles within 0.3% of the pot, so noise does not fill the log).
+//
+// The main loop writes the log; a trigger is stamped in the audio callback
+// with the number of state events committed so far (replay_serial, counted
+// on from the previous recording so that stale stamps are told apart),
+// which orders it against the main loop changes it raced with. A change is
+// bracketed by replay_begin_change() and replay_commit(), recording or not:
+// a trigger that interrupts the main loop in between would read half-written
+// state (the direction counts of an injected note, a new phrase with the old
+// sampler), so it is held and generated at the next audio block, after the
+// commit. The callback itself always runs to completion before the main loop
+// resumes.
+//
+//   F0 7D 47 04 F7                Start recording (restarts a running log)
+//   F0 7D 47 05 F7                Stop recording
+//   F0 7D 47 06 <offset u32> F7   Read the log from offset: one REPLAY_REPLY
+//   F0 7D 47 16 <flags> <length u32> <offset u32> <data> F7
+//
+// flags: bit 0 recording, bit 1 full (recording stopped at the end of the
+// buffer). data carries up to REPLAY_CHUNK_SIZE bytes, 7 bytes per 8 (high
+// bits first); an empty reply means offset is at the end.
+
+#define REPLAY_LOG_SIZE (256 * 1024)
+const int REPLAY_CHUNK_SIZE = 448;   // 512 bytes on the wire
+
+uint8_t DSY_SDRAM_BSS replay_log_data[REPLAY_LOG_SIZE];
+ReplayWriter replay_log = {};
+bool     replay_recording = false;
+std::atomic<uint32_t> replay_serial{0};  // replay_serial_base + state events committed
+std::atomic<bool> replay_changing{false}; // Main loop is changing generator state
+uint32_t replay_serial_base = 1;         // Stamps below it predate the recording
+uint16_t replay_params_logged[TOTAL_PARAMS];
+int      replay_scale_logged = 0;
+uint8_t  replay_slots_logged = 0;        // Slots whose contents are in the log
+uint32_t replay_saved_seed = 0;
+bool     replay_saved_lookahead = false;
+
+void replay_stop()
+{
+    if(!replay_recording)
+        return;
+    replay_end(replay_log);
+    replay_recording = false;
+    replay_changing.store(false, std::memory_order_release);
+    rng_fixed_seed = replay_saved_seed;
+    lookahead_enabled = replay_saved_lookahead;
+}
+
+// Main loop, before changing anything the generator reads: triggers wait
+// for the replay_commit() that follows
+inline void replay_begin_change()
+{
+    replay_changing.store(true, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);  // No write of the change moves above
+}
+
+// End a change: publish the state events written so far to the trigger
+// stamps and release held triggers. Called once the change they describe has
+// been applied; a full log ends here.
+void replay_commit()
+{
+    if(!replay_recording)
+    {
+        replay_changing.store(false, std::memory_order_release);
+        return;
+    }
+    replay_serial.store(replay_serial_base + replay_log.events, std::memory_order_release);
+    replay_changing.store(false, std::memory_order_release);
+    if(replay_log.full)
+        replay_stop();
+}
+
+void replay_record_event(ReplayEventType type)
+{
+    if(replay_recording)
+        replay_put_event(replay_log, type);
+    replay_commit();
+}
+
+void replay_record_note_on(uint32_t time_ms, uint8_t note, uint8_t velocity)
+{
+    if(replay_recording)
+        replay_put_note_on(replay_log, time_ms, note, velocity);
+    replay_commit();
+}
+
+void replay_record_note_off(uint32_t time_ms, uint8_t note)
+{
+    if(replay_recording)
+        replay_put_note_off(replay_log, time_ms, note);
+    replay_commit();
+}
+
+// The slot just switched to; its contents go in the first time only, after
+// that the replay's own copy has followed every change
+void replay_record_phrase_slot()
+{
+    if(!replay_recording)
+    {
+        replay_commit();
+        return;
+    }
+    bool logged = replay_slots_logged & (1u << phrase_slot);
+    replay_put_phrase_slot(replay_log, phrase_slot, logged ? nullptr : phrase);
+    replay_slots_logged |= 1u << phrase_slot;
+    replay_commit();
+}
+
+// Control tick, before apply_parameters(): hold the smoothed parameters on
+// the 10-bit grid and log what moved. replay_commit() follows the apply.
+void replay_record_parameters()
+{
+    if(!replay_recording)
+        return;
+    replay_begin_change();
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+    {
+        uint16_t value = replay_quantize(parameters_smoothed[i]);
+        parameters_smoothed[i] = replay_parameter(value);
+        if(value != replay_params_logged[i])
+        {
+            replay_put_param(replay_log, i, value);
+            replay_params_logged[i] = value;
+        }
+    }
+    if(scale_select != replay_scale_logged)
+    {
+        replay_put_scale(replay_log, scale_select);
+        replay_scale_logged = scale_select;
+    }
+}
+
+// One record per trigger (serial stamped by the audio callback)
+void replay_record_trigger(uint32_t serial, uint32_t sample_time, uint8_t velocity,
+                           uint16_t length_ms)
+{
+    if(!replay_recording || serial < replay_serial_base)
+        return;  // Generated before the recording started
+    if(!replay_put_trigger(replay_log, serial - replay_serial_base, sample_time, velocity,
+                           length_ms))
+        replay_stop();
+}
+
+void replay_start(float sample_rate)
+{
+    replay_stop();
+    replay_changing.store(true, std::memory_order_relaxed);  // Until the commit below
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    // A fresh seed, fixed for the session
+    uint32_t seed = trace_now() ^ (System::GetNow() * 0x9E3779B9u);
+    replay_saved_seed = rng_fixed_seed;
+    replay_saved_lookahead = lookahead_enabled;
+    rng_fixed_seed = seed ? seed : 1;
+    lookahead_enabled = false;
+
+    ReplayHeader header;
+    header.seed = rng_fixed_seed;
+    header.sample_rate = (uint32_t)sample_rate;
+    header.tempo_period_us = tempo_period_us.load(std::memory_order_relaxed);
+    header.start_ms = System::GetNow();
+    header.scale_select = (uint8_t)scale_select;
+    header.candidate_mode = (uint8_t)candidate_mode;
+    header.phrase_slot = (uint8_t)phrase_slot;
+    header.learning_state = (uint8_t)learning_state;
+    header.phrase_injecting = phrase_injecting;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+    {
+        replay_params_logged[i] = replay_quantize(parameters_smoothed[i]);
+        parameters_smoothed[i] = replay_parameter(replay_params_logged[i]);
+        header.parameters[i] = replay_params_logged[i];
+    }
+    header.phrase_data = (const uint8_t*)phrase;
+    replay_scale_logged = scale_select;
+    replay_begin(replay_log, replay_log_data, REPLAY_LOG_SIZE, header);
+    replay_serial_base = replay_serial.load(std::memory_order_relaxed) + 1;
+    replay_slots_logged = 1u << phrase_slot;
+
+    // Generation restarts from the seed
+    apply_parameters();
+    if(learning_state == STATE_GENERATING)
+    {
+        replay_put_event(replay_log, REPLAY_GENERATE);
+        begin_generating(rng_fixed_seed);
+    }
+    for(int v = 0; v < MAX_VOICES; v++)
+        lookahead_clear(v);
+    replay_recording = true;
+    replay_commit();
+}
+
+// 7 bytes in 8: a byte of high bits (first byte's in bit 6), then the low 7 bits
+int sysex_put_packed(uint8_t* buf, int n, const uint8_t* data, int count)
+{
+    for(int i = 0; i < count; i += 7)
+    {
+        int group = (count - i < 7) ? count - i : 7;
+        uint8_t high = 0;
+        for(int j = 0; j < group; j++)
+            high |= (data[i + j] >> 7) << (6 - j);
+        buf[n++] = high;
+        for(int j = 0; j < group; j++)
+            buf[n++] = data[i + j] & 0x7F;
+    }
+    return n;
+}
+
+int build_replay_chunk(uint8_t* buf, uint32_t offset)
+{
+    int n = sysex_begin(buf, 0, SYSEX_REPLAY_REPLY);
+    buf[n++] = (replay_recording ? 1 : 0) | (replay_log.full ? 2 : 0);
+    n = sysex_put_u32(buf, n, replay_log.length);
+    n = sysex_put_u32(buf, n, offset);
+    if(offset < replay_log.length)
+    {
+        uint32_t count = replay_log.length - offset;
+        if(count > (uint32_t)REPLAY_CHUNK_SIZE)
+            count = REPLAY_CHUNK_SIZE;
+        n = sysex_put_packed(buf, n, replay_log_data + offset, (int)count);
+    }
+    buf[n++] = 0xF7;
+    return n;
+}
+
+static_assert(4 + 1 + 5 + 5 + REPLAY_CHUNK_SIZE / 7 * 8 + 1 <= SYSEX_TX_SIZE,
+              "Replay chunk does not fit the SysEx buffer");
+
+// Main loop, after the MIDI input drain: act on a replay SysEx command
+void service_replay_request(float sample_rate)
+{
+    uint8_t request = sysex_replay_request;
+    sysex_replay_request = 0;
+    switch(request)
+    {
+        case SYSEX_REPLAY_START: replay_start(sample_rate); break;
+        case SYSEX_REPLAY_STOP: replay_stop(); break;
+        case SYSEX_REPLAY_QUERY:
+            if(sysex_tx_pending())
+            {
+                sysex_tx_busy++;
+                break;
+            }
+            sysex_tx_length = build_replay_chunk(sysex_tx, sysex_replay_offset);
+            sysex_tx_pos = 0;
+            break;
+        default: break;
+    }
+}
+
+// MIDI to CV conversion for pitch output (1V/octave)
+// Maps MIDI note to 0-5V DAC range
+// C1 (MIDI 36) = 0V, C2 (48) = 1V, C3 (60) = 2V, C4 (72) = 3V, C5 (84) = 4V, C6 (96) = 5V
+float midi_note_to_cv(uint8_t midi_note)
+{
+    // 1V/octave standard: each octave (12 semitones) = 1 volt
+    // Reference: MIDI 36 (C1) = 0V
+    float cv = (float)(midi_note - 36) / 12.0f;
+
+    // Clamp to DAC range (0-5V)
+    if(cv < 0.0f) cv = 0.0f;
+    if(cv > 5.0f) cv = 5.0f;
+
+    return cv;
+}
+
+// CV to MIDI conversion (for pitch CV input)
+// Assumes CV input is calibrated for 1V/octave
+float cv_to_midi_note(float cv_voltage)
+{
+    // CV range: -5V to +5V = 10 octaves = 120 semitones
+    // Center at C4 (MIDI 60)
+    return 60.0f + (cv_voltage * 12.0f);  // 12 semitones per volt
+}
+
+// Learning input detection
+uint8_t last_note_in = 0;          // Last received note
+bool note_in_active = false;       // True when a note is being held
+uint32_t last_note_time = 0;       // Time of last note input (ms)
+const uint32_t DEFAULT_LEARNING_TIMEOUT = 2000;  // Default: 2s (adjustable via parameter)
+
+// Start learning from user input (nothing learned yet: generation waits)
+void start_learning()
+{
+    replay_begin_change();
+    learning_state = STATE_LEARNING;
+    reset_corpus();
+    replay_record_event(REPLAY_LEARN_START);
+    last_note_time = System::GetNow();
+    log_debug(DBG_LEARNING_START);
+}
+
+// Live phrase injection: learn a new phrase while generation continues,
+// blending it into the (fading) corpus tendencies
+void start_injection()
+{
+    replay_begin_change();
+    begin_injection();
+    replay_record_event(REPLAY_INJECT_START);
+    last_note_time = System::GetNow();
+    log_debug(DBG_LEARNING_START);
+}
+
+// Add note to learning buffer and fold it (pitch and rhythm) into the tendencies
+void add_note_to_buffer(uint8_t midi_note, uint8_t velocity)
+{
+    if((learning_state == STATE_LEARNING || phrase_injecting)
+       && phrase->note_buffer_count < MAX_LEARN_NOTES)
+    {
+        uint32_t start = trace_now();
+        replay_begin_change();
+        corpus_add_note(midi_note);
+        trace_record(TRACE_LEARN_ANALYSIS, trace_now() - start);
+        persist_serial++;
+        last_note_time = System::GetNow();
+        rhythm_learn_onset(last_note_time, midi_note, velocity);
+        replay_record_note_on(last_note_time, midi_note, velocity);
+        log_debug(DBG_NOTE_RECEIVED, midi_note, phrase->note_buffer_count);
+
+        // Visual feedback: blink LED
+        hw.seed.SetLed(true);
+    }
+}
+
+// Check if learning should stop (timeout or buffer full)
+// The audio-rate scheduler generates whenever learning_state is GENERATING,
+// so the state flips only after analysis and generation state are ready
+void update_learning_state()
+{
+    if(learning_state == STATE_LEARNING || phrase_injecting)
+    {
+        uint32_t current_time = System::GetNow();
+        uint32_t time_since_note = current_time - last_note_time;
+
+        // Calculate learning timeout from parameter (0.5s - 10s)
+        // Parameter 0.0 = 500ms, 0.158 ≈ 2000ms (default), 1.0 = 10000ms
+        float timeout_param = parameters_smoothed[PARAM_LEARN_TIMEOUT];
+        uint32_t learning_timeout_ms = 500 + (uint32_t)(timeout_param * 9500.0f);
+        bool timed_out = time_since_note > learning_timeout_ms;
+
+        // An injected phrase is already live in the tendencies; it only ends
+        if(phrase_injecting)
+        {
+            if(phrase->note_buffer_count >= MAX_LEARN_NOTES || timed_out)
+            {
+                log_debug(DBG_LEARNING_STOP, phrase->note_buffer_count, timed_out ? 1 : 0);
+                replay_begin_change();
+                phrase_injecting = false;
+                replay_record_event(REPLAY_INJECT_END);
+            }
+            return;
+        }
+
+        // Stop learning if:
+        // 1. Buffer is full (16 notes), OR
+        // 2. Timeout (parameter-controlled) AND we have minimum notes (4)
+        if(phrase->note_buffer_count >= MAX_LEARN_NOTES ||
+           (timed_out && phrase->note_buffer_count >= MIN_LEARN_NOTES))
+        {
+            log_debug(DBG_LEARNING_STOP, phrase->note_buffer_count,
+                     timed_out ? 1 : 0);  // 1=timeout, 0=buffer full
+
+            // Seed RNGs with current time for variety (fixed in deterministic mode)
+            replay_begin_change();
+            begin_generating(rng_session_seed());
+            replay_record_event(REPLAY_GENERATE);
+            persist_serial++;
+        }
+    }
+}
+
+// Note Off: ends the learned note's duration
+void release_learned_note(uint8_t midi_note)
+{
+    note_in_active = false;
+    uint32_t now = System::GetNow();
+    replay_begin_change();
+    rhythm_learn_release(now, midi_note);
+    replay_record_note_off(now, midi_note);
+}
+
+// ============================================================================
+// PHRASE BANK SWITCHING
+// ============================================================================
+// A slot is requested by turning the encoder while it is held, by MIDI
+// Program Change (program % PHRASE_SLOTS) or by PHRASE_SLOT_CC. The switch is
+// committed at the next clock edge on Gate 2, or at the next note trigger
+// when no clock is running: the audio scheduler marks the edge and the main
+// loop moves the phrase pointer between two notes, publishes the slot's own
+// interval sampler and regenerates the lookahead queue. Nothing is
+// re-analyzed. Requests wait while a phrase is being learned.
+
+const uint8_t  PHRASE_SLOT_CC = 85;               // Undefined CC: 0-127 spread over the slots
+const uint32_t PHRASE_CLOCK_TIMEOUT_US = 2000000; // No clock edge for 2s = clock stopped
+const uint32_t PHRASE_IDLE_SWITCH_US = 2000000;   // No clock or trigger: switch right away
+
+std::atomic<int>  phrase_slot_requested{0};
+std::atomic<bool> phrase_switch_edge{false};      // Set by the scheduler at the commit edge
+uint32_t last_trigger_us = 0;                     // Last note trigger (scheduler)
+
+void select_phrase_slot(int slot)
+{
+    if(slot < 0 || slot >= PHRASE_SLOTS)
+        slot = 0;
+    phrase_slot = slot;
+    phrase = &phrase_bank[slot];
+    phrase_slot_requested.store(slot, std::memory_order_relaxed);
+}
+
+void request_phrase_slot(int slot)
+{
+    phrase_slot_requested.store(((slot % PHRASE_SLOTS) + PHRASE_SLOTS) % PHRASE_SLOTS,
+                                std::memory_order_relaxed);
+}
+
+inline bool phrase_switch_pending()
+{
+    return phrase_slot_requested.load(std::memory_order_relaxed) != phrase_slot;
+}
+
+// Main loop: commit a requested switch once its edge has passed
+void service_phrase_switch()
+{
+    if(!phrase_switch_pending() || learning_state == STATE_LEARNING || phrase_injecting)
+        return;
+
+    uint32_t now_us = System::GetUs();
+    bool idle = (now_us - last_trigger_us > PHRASE_IDLE_SWITCH_US)
+                && (last_clock_time_us == 0 || now_us - last_clock_time_us > PHRASE_IDLE_SWITCH_US);
+    if(!phrase_switch_edge.exchange(false) && !idle)
+        return;
+
+    replay_begin_change();
+    select_phrase_slot(phrase_slot_requested.load(std::memory_order_relaxed));
+    install_phrase_sampler();
+    learning_state = phrase->tendencies_ready ? STATE_GENERATING : STATE_IDLE;
+
+    // Notes queued from the old phrase are dropped and regenerated
+    for(int v = 0; v < MAX_VOICES; v++)
+        lookahead_retract(v, 0);
+    lookahead_sampler = interval_sampler_active.load(std::memory_order_relaxed);
+    replay_record_phrase_slot();
+    persist_serial++;
+}
+
+// ============================================================================
+// CV OUTPUTS (pitch and envelopes on the DC-coupled audio outputs)
+// ============================================================================
+// The Patch has no DAC CV jacks, but its four audio outputs are DC-coupled.
+// In a CV mode AudioCallback renders 1V/octave pitch (midi_note_to_cv()) and
+// gate envelopes there at the sample rate, each note starting at its trigger's
+// sample offset, so analog voices follow without the MIDI serial bottleneck.
+//
+// Every channel is a one-pole slew toward its target: glide on pitch,
+// attack/release on envelopes. Blocks are rendered in segments between the
+// block's events, and the state is stored channel-interleaved so each sample
+// is the same independent multiply-add for all four channels: host compilers
+// vectorize it, and on the M7 (single-precision FPU, no float SIMD) the four
+// chains pipeline without stalls. Mode and glide changes from the main loop
+// are picked up at the next block.
+
+enum CvMode {
+    CV_MODE_OFF = 0,      // Audio passthrough
+    CV_MODE_PAIRS = 1,    // Out 1/2 = voice 1 pitch/envelope, Out 3/4 = voice 2
+    CV_MODE_PITCH4 = 2,   // Out 1-4 = pitch of voices 1-4 (gate on Gate Out)
+    CV_MODE_COUNT
+};
+
+#define CV_CHANNELS 4
+#define CV_EVENTS_PER_BLOCK 16
+const float CV_VOLTS_PER_UNIT = 5.0f;    // Output volts at sample value 1.0 (calibration)
+const float CV_ENVELOPE_VOLTS = 5.0f;    // Envelope level at velocity 127
+const float CV_ATTACK_MS = 1.0f;
+const float CV_RELEASE_MS = 30.0f;
+const float CV_GLIDE_MAX_MS = 500.0f;
+
+struct CvChannelMap {
+    int8_t voice;    // -1 = unused (held at 0V)
+    bool   envelope; // false = pitch
+};
+
+const CvChannelMap cv_layout[CV_MODE_COUNT][CV_CHANNELS] = {
+    {{-1, false}, {-1, false}, {-1, false}, {-1, false}},
+    {{0, false}, {0, true}, {1, false}, {1, true}},
+    {{0, false}, {1, false}, {2, false}, {3, false}}
+};
+
+// Settings (main loop -> audio callback)
+std::atomic<uint8_t> cv_mode_setting{CV_MODE_OFF};
+std::atomic<float>   cv_glide_ms_setting{0.0f};
+
+// Target change at a sample offset of the current block
+struct CvEvent {
+    uint8_t offset;
+    uint8_t channel;
+    float   target;   // Volts
+};
+
+// Audio callback state
+struct alignas(16) CvChannels {
+    float value[CV_CHANNELS];    // Current level (volts)
+    float target[CV_CHANNELS];
+    float rise[CV_CHANNELS];     // Slew coefficient per sample, target above value
+    float fall[CV_CHANNELS];     // ... target below value
+};
+CvChannels cv;
+uint32_t cv_gate_off_sample[CV_CHANNELS];  // Envelope release time (absolute sample)
+bool     cv_gate_open[CV_CHANNELS] = {};
+uint8_t  cv_mode = CV_MODE_OFF;
+float    cv_glide_ms = -1.0f;              // Coefficients were computed for this glide
+uint32_t cv_block_start = 0;
+uint32_t cv_block_size = 0;
+CvEvent  cv_events[CV_EVENTS_PER_BLOCK];
+int      cv_event_count = 0;
+uint32_t cv_event_overflows = 0;           // Events dropped (block full)
+
+// One-pole coefficient reaching ~63% of a step after ms
+float cv_slew_coefficient(float ms, float sample_rate)
+{
+    return (ms > 0.0f) ? 1.0f - expf(-1000.0f / (ms * sample_rate)) : 1.0f;
+}
+
+void cv_push_event(uint32_t offset, int channel, float target)
+{
+    if(cv_event_count >= CV_EVENTS_PER_BLOCK)
+    {
+        cv_event_overflows++;
+        return;
+    }
+    cv_events[cv_event_count++] = {(uint8_t)offset, (uint8_t)channel, target};
+}
+
+// Start of every audio block: apply settings, queue due envelope releases
+void cv_begin_block(uint32_t block_start, size_t size, float sample_rate)
+{
+    cv_block_start = block_start;
+    cv_block_size = (uint32_t)size;
+    cv_event_count = 0;
+
+    uint8_t mode = cv_mode_setting.load(std::memory_order_relaxed);
+    float glide_ms = cv_glide_ms_setting.load(std::memory_order_relaxed);
+    if(mode != cv_mode)
+    {
+        cv_mode = mode;
+        memset(&cv, 0, sizeof(cv));
+        for(int c = 0; c < CV_CHANNELS; c++)
+            cv_gate_open[c] = false;
+        cv_glide_ms = -1.0f;
+    }
+    if(glide_ms != cv_glide_ms)
+    {
+        cv_glide_ms = glide_ms;
+        float glide = cv_slew_coefficient(glide_ms, sample_rate);
+        float attack = cv_slew_coefficient(CV_ATTACK_MS, sample_rate);
+        float release = cv_slew_coefficient(CV_RELEASE_MS, sample_rate);
+        for(int c = 0; c < CV_CHANNELS; c++)
+        {
+            bool envelope = cv_layout[cv_mode][c].envelope;
+            cv.rise[c] = envelope ? attack : glide;
+            cv.fall[c] = envelope ? release : glide;
+        }
+    }
+
+    uint32_t block_end = block_start + (uint32_t)size;
+    for(int c = 0; c < CV_CHANNELS; c++)
+    {
+        if(!cv_gate_open[c] || (int32_t)(cv_gate_off_sample[c] - block_end) >= 0)
+            continue;
+        int32_t offset = (int32_t)(cv_gate_off_sample[c] - block_start);
+        cv_push_event(offset > 0 ? (uint32_t)offset : 0, c, 0.0f);
+        cv_gate_open[c] = false;
+    }
+}
+
+// Scheduler: voice v plays note at sample_time (current block) for length_samples
+void cv_note_on(int v, uint32_t sample_time, uint32_t length_samples, uint8_t note,
+                uint8_t velocity)
+{
+    uint32_t offset = sample_time - cv_block_start;
+    if(cv_mode == CV_MODE_OFF || offset >= cv_block_size)
+        return;
+    for(int c = 0; c < CV_CHANNELS; c++)
+    {
+        const CvChannelMap& map = cv_layout[cv_mode][c];
+        if(map.voice != v)
+            continue;
+        if(map.envelope)
+        {
+            cv_push_event(offset, c, CV_ENVELOPE_VOLTS * (float)velocity / 127.0f);
+            cv_gate_open[c] = true;
+            cv_gate_off_sample[c] = sample_time + length_samples;
+        }
+        else
+        {
+            cv_push_event(offset, c, midi_note_to_cv(note));
+        }
+    }
+}
+
+// Slew every channel toward its target over samples [from, to)
+void cv_render_segment(AudioHandle::OutputBuffer out, size_t from, size_t to)
+{
+    const float scale = 1.0f / CV_VOLTS_PER_UNIT;
+    for(size_t i = from; i < to; i++)
+    {
+        float level[CV_CHANNELS];
+        for(int c = 0; c < CV_CHANNELS; c++)
+        {
+            float delta = cv.target[c] - cv.value[c];
+            float k = (delta > 0.0f) ? cv.rise[c] : cv.fall[c];
+            cv.value[c] += delta * k;
+            level[c] = cv.value[c] * scale;
+        }
+        for(int c = 0; c < CV_CHANNELS; c++)
+            out[c][i] = level[c];
+    }
+}
+
+// Render the block; returns false in CV_MODE_OFF (outputs untouched)
+bool cv_render(AudioHandle::OutputBuffer out, size_t size)
+{
+    if(cv_mode == CV_MODE_OFF)
+        return false;
+
+    // Few events per block: insertion sort by offset (stable)
+    for(int i = 1; i < cv_event_count; i++)
+    {
+        CvEvent e = cv_events[i];
+        int j = i;
+        for(; j > 0 && cv_events[j - 1].offset > e.offset; j--)
+            cv_events[j] = cv_events[j - 1];
+        cv_events[j] = e;
+    }
+
+    size_t pos = 0;
+    for(int i = 0; i < cv_event_count; i++)
+    {
+        size_t offset = cv_events[i].offset;
+        if(offset > pos)
+        {
+            cv_render_segment(out, pos, offset);
+            pos = offset;
+        }
+        cv.target[cv_events[i].channel] = cv_events[i].target;
+    }
+    cv_render_segment(out, pos, size);
+    return true;
+}
+
+// ============================================================================
+// AUDIO-RATE GENERATION SCHEDULER
+// ============================================================================
+// Runs inside AudioCallback. Once per block it drains the captured gate edges
+// (or scans audio input 4 when used as a trigger), maps each edge to a sample
+// offset in the block, runs the generator and stamps the outgoing note with
+// its absolute sample time. Edge-to-note latency is a fixed one block and no
+// longer depends on main loop load. The main loop only forwards the queued
+// note events to MIDI (UART sends must not run in the audio interrupt).
+
+const size_t AUDIO_BLOCK_SIZE = 8;    // 8 samples @ 48kHz = 167us per block
+float    audio_sample_rate = 48000.0f;
+uint32_t audio_sample_clock = 0;      // Absolute sample time at start of block
+uint32_t audio_prev_block_us = 0;     // GetUs() at start of previous block
+
+// Trigger source for note generation
+enum TriggerSource {
+    TRIGGER_GATE_1 = 0,      // Gate Input 1 (timer-captured edges)
+    TRIGGER_AUDIO_IN_4 = 1,  // Audio Input 4 used as a clock (sample-accurate)
+    TRIGGER_CLOCK_GRID = 2,  // Grid of the tracked clock (set by the clock rate)
+    TRIGGER_LEARNED_RHYTHM = 3  // Self-clocked onsets (set by the rhythm mode)
+};
+TriggerSource trigger_source = TRIGGER_GATE_1;
+
+// Audio clock detection (Schmitt trigger on audio input 4)
+const float AUDIO_CLOCK_THRESHOLD_HIGH = 0.4f;
+const float AUDIO_CLOCK_THRESHOLD_LOW = 0.2f;
+bool audio_clock_level = false;
+
+// Generated note events (audio callback -> main loop)
+struct NoteEvent {
+    uint32_t sample_time;  // Absolute sample time of the trigger
+    uint32_t edge_cycles;  // trace_now() of the triggering edge
+    uint8_t note;
+    uint8_t velocity;
+    uint8_t channel;       // MIDI channel 0-15 (voice routing)
+    uint16_t length_ms;    // Note length (Note Off scheduling)
+    uint8_t voice;
+    uint32_t replay_serial; // State events logged before the trigger (see REPLAY LOG)
+};
+#define NOTE_EVENT_QUEUE_SIZE 32  // Room for several edges of all voices
+SpscRing<NoteEvent, NOTE_EVENT_QUEUE_SIZE> note_event_queue;
+uint32_t note_event_overflows = 0;
+
+// Echo gate request (main loop -> audio callback)
+std::atomic<bool> echo_gate_request{false};
+
+uint32_t ms_to_samples(float ms)
+{
+    return (uint32_t)(ms * audio_sample_rate * 0.001f);
+}
+
+// Raise the gate output at sample_time for length_samples
+void start_gate(uint32_t sample_time, uint32_t length_samples)
+{
+    gate_length_samples = length_samples;
+    gate_off_sample = sample_time + length_samples;
+    gate_out_state = true;
+    dsy_gpio_write(&hw.gate_output, 1);  // Set gate HIGH
+}
+
+// Step every active voice and queue its note (GENERATING with a learned
+// phrase only). edge_cycles stamps the trigger for gate-edge -> MIDI-out
+// tracing; length_ms 0 = derived from the clock
+void generate_trigger(uint32_t sample_time, uint32_t edge_cycles, uint8_t velocity,
+                      uint16_t length_ms)
+{
+    if(learning_state == STATE_GENERATING && phrase->tendencies_ready)
+    {
+        // Gate length is the learned note length, else 50% of the grid step
+        // (or 50ms if no clock yet)
+        gate_length_ms = 50.0f;
+        float step_us = clock_step_us();
+        if(length_ms > 0)
+        {
+            gate_length_ms = (float)length_ms;
+        }
+        else if(step_us > 0.0f)
+        {
+            gate_length_ms = step_us * 0.0005f;
+            if(gate_length_ms < 20.0f) gate_length_ms = 20.0f;    // Min 20ms
+            if(gate_length_ms > 500.0f) gate_length_ms = 500.0f;  // Max 500ms
+        }
+
+        uint32_t serial = replay_serial.load(std::memory_order_acquire);
+        int voice_count = control_snapshot().active_voice_count;
+        for(int v = 0; v < voice_count; v++)
+        {
+            uint8_t note;
+            if(lookahead_enabled)
+            {
+                // Pre-generated by the main loop; repeat the last note on underrun
+                if(!lookahead_pop(v, note))
+                {
+                    note = voices.output_note[v];
+                    lookahead_underruns++;
+                }
+            }
+            else
+            {
+                note = generate_next_note(v);
+                voices.current_note[v] = note;
+            }
+            voices.output_note[v] = note;
+            cv_note_on(v, sample_time, ms_to_samples(gate_length_ms), note, velocity);
+
+            NoteEvent event = {sample_time, edge_cycles, note, velocity,
+                               voices.midi_channel[v], (uint16_t)gate_length_ms,
+                               (uint8_t)v, serial};
+            if(!note_event_queue.Push(event))
+                note_event_overflows++;
+        }
+        post_main_event(EVENT_NOTE_OUT);
+
+        start_gate(sample_time, ms_to_samples(gate_length_ms));
+    }
+}
+
+// Triggers held while the main loop is inside a change (see REPLAY LOG
+// RECORDING)
+#define DEFERRED_TRIGGER_SLOTS 8
+struct DeferredTrigger {
+    uint32_t sample_time;
+    uint32_t edge_cycles;
+    uint8_t  velocity;
+    uint16_t length_ms;
+};
+DeferredTrigger deferred_triggers[DEFERRED_TRIGGER_SLOTS];
+int      deferred_trigger_count = 0;
+uint32_t deferred_trigger_total = 0;    // Triggers held for a block (inspectable via debugger)
+uint32_t deferred_trigger_dropped = 0;  // Held triggers lost: slots full
+
+// Audio callback, at the start of a block: generate the held triggers once
+// the change they waited for is committed
+void flush_deferred_triggers()
+{
+    if(deferred_trigger_count == 0 || replay_changing.load(std::memory_order_acquire))
+        return;
+    for(int i = 0; i < deferred_trigger_count; i++)
+    {
+        const DeferredTrigger& t = deferred_triggers[i];
+        generate_trigger(t.sample_time, t.edge_cycles, t.velocity, t.length_ms);
+    }
+    deferred_trigger_count = 0;
+}
+
+// Note trigger from the scheduler: generated at once, or held while the main
+// loop is inside a change (and behind triggers held earlier)
+void on_note_trigger(uint32_t sample_time, uint32_t edge_cycles, uint8_t velocity = 100,
+                     uint16_t length_ms = 0)
+{
+    note_triggered = true;
+    last_trigger_us = System::GetUs();
+
+    // Without a running clock, a pending phrase switch commits on the trigger
+    if(phrase_switch_pending()
+       && (last_clock_time_us == 0 || last_trigger_us - last_clock_time_us > PHRASE_CLOCK_TIMEOUT_US))
+        phrase_switch_edge.store(true);
+
+    // Held behind a change in progress (or behind earlier held triggers)
+    if(replay_changing.load(std::memory_order_acquire) || deferred_trigger_count > 0)
+    {
+        if(deferred_trigger_count < DEFERRED_TRIGGER_SLOTS)
+            deferred_triggers[deferred_trigger_count++] = {sample_time, edge_cycles, velocity, length_ms};
+        else
+            deferred_trigger_dropped++;
+        deferred_trigger_total++;
+        return;
+    }
+    generate_trigger(sample_time, edge_cycles, velocity, length_ms);
+}
+
+// Clock beat (Gate 2 rising edge, MIDI clock or the internal clock): the tempo
+// tracker already folded it in (capture ISR)
+void on_clock_edge(uint32_t edge_us)
+{
+    clock_pulse_indicator = 5;  // Show pulse for 5 frames (~150ms at 30fps)
+
+    // A pending phrase switch commits on the clock edge
+    if(phrase_switch_pending())
+        phrase_switch_edge.store(true);
+
+    // BPM from the tracked period (assuming quarter notes), range-limited
+    // by the tracker to 20-300 BPM
+    clock_interval_us = tempo_period_us.load(std::memory_order_relaxed);
+    if(clock_interval_us > 0)
+        clock_bpm = 60000000.0f / (float)clock_interval_us;
+    last_clock_time_us = edge_us;
+}
+
+// Map a captured edge to a sample offset in the current block
+// Edges captured during the previous block period are played one block later
+size_t edge_to_block_offset(uint32_t edge_us, size_t size)
+{
+    int32_t since_us = (int32_t)(edge_us - audio_prev_block_us);
+    if(since_us <= 0)
+        return 0;
+    size_t offset = (size_t)((float)since_us * audio_sample_rate * 0.000001f);
+    return (offset < size) ? offset : size - 1;
+}
+
+void RunScheduler(AudioHandle::InputBuffer in, size_t size)
+{
+    uint32_t block_us = System::GetUs();
+    uint32_t block_cycles = trace_now();
+    flush_deferred_triggers();
+
+    TriggerSource source = trigger_source;
+    if(rhythm_mode_setting.load(std::memory_order_relaxed) == RHYTHM_MODE_LEARNED)
+        source = TRIGGER_LEARNED_RHYTHM;
+    else if(clock_rate_setting.load(std::memory_order_relaxed) != CLOCK_RATE_OFF)
+        source = TRIGGER_CLOCK_GRID;
+
+    // Gate edges captured by the timer ISR since the last block
+    GateEdge edge;
+    while(gate_edge_queue.Pop(edge))
+    {
+        uint32_t sample_time = audio_sample_clock + edge_to_block_offset(edge.time_us, size);
+        if(edge.gate == GATE_EDGE_RHYTHM)
+        {
+            // Self-clocked onset: velocity and length come with it
+            if(source == TRIGGER_LEARNED_RHYTHM)
+                on_note_trigger(sample_time, edge.cycles, edge.velocity, edge.length_ms);
+        }
+        else if(edge.gate == GATE_EDGE_CLOCK_TICK)
+        {
+            // Grid trigger of the clock rate (replaces Gate 1 while a rate is set)
+            if(source == TRIGGER_CLOCK_GRID)
+                on_note_trigger(sample_time, edge.cycles);
+        }
+        else if(edge.gate == GATE_EDGE_BEAT)
+        {
+            on_clock_edge(edge.time_us);
+        }
+        else if(edge.gate == 0)
+        {
+            // Gate Input 1 (Note Trigger)
+            gate1_prev = gate1_state;
+            gate1_state = edge.rising;
+            if(edge.rising && source == TRIGGER_GATE_1)
+                on_note_trigger(sample_time, edge.cycles);
+        }
+        else
+        {
+            // Gate Input 2 (Clock/BPM Detection)
+            gate2_prev = gate2_state;
+            gate2_state = edge.rising;
+            if(edge.rising && tempo_source.load(std::memory_order_relaxed) == TEMPO_SOURCE_GATE_2)
+                on_clock_edge(edge.time_us);
+        }
+    }
+
+    // Audio input 4 as a trigger: per-sample edge detection
+    if(source == TRIGGER_AUDIO_IN_4)
+    {
+        for(size_t i = 0; i < size; i++)
+        {
+            float sample = in[3][i];
+            if(!audio_clock_level && sample > AUDIO_CLOCK_THRESHOLD_HIGH)
+            {
+                audio_clock_level = true;
+                on_note_trigger(audio_sample_clock + i, block_cycles);
+            }
+            else if(audio_clock_level && sample < AUDIO_CLOCK_THRESHOLD_LOW)
+            {
+                audio_clock_level = false;
+            }
+        }
+    }
+
+    // Echo gate requested by the MIDI input path (short 100ms gate)
+    if(echo_gate_request.exchange(false))
+        start_gate(audio_sample_clock, ms_to_samples(100.0f));
+
+    // Gate output timing, counted in samples
+    uint32_t block_end = audio_sample_clock + size;
+    if(gate_out_state && (int32_t)(block_end - gate_off_sample) >= 0)
+    {
+        gate_out_state = false;
+        dsy_gpio_write(&hw.gate_output, 0);  // Set gate LOW
+    }
+
+    audio_prev_block_us = block_us;
+    audio_sample_clock = block_end;
+}
+
+// Forward generated notes to MIDI out (main loop context)
+void service_note_events()
+{
+    NoteEvent event;
+    while(note_event_queue.Pop(event))
+    {
+        if(event.voice == 0)
+            replay_record_trigger(event.replay_serial, event.sample_time, event.velocity,
+                                  event.length_ms);
+        send_midi_note(event.note, event.velocity, event.channel, event.length_ms,
+                       event.edge_cycles);
+        log_debug(DBG_CLOCK_PULSE, event.note);
+    }
+}
+
+void AudioCallback(AudioHandle::InputBuffer  in,
+                   AudioHandle::OutputBuffer out,
+                   size_t                    size)
+{
+    cv_begin_block(audio_sample_clock, size, audio_sample_rate);
+    RunScheduler(in, size);
+
+    // CV mode renders pitch/envelopes, otherwise audio passes through
+    if(cv_render(out, size))
+        return;
+    for(size_t i = 0; i < size; i++)
+    {
+        out[0][i] = in[0][i];
+        out[1][i] = in[1][i];
+        out[2][i] = in[2][i];
+        out[3][i] = in[3][i];
+    }
+}
+
+// ============================================================================
+// TEXT FORMATTING (fixed buffers, no heap)
+// ============================================================================
+
+// Fixed-capacity string builder living on the stack; truncates when full
+template <size_t CAPACITY>
+struct TextBuffer
+{
+    char   text[CAPACITY];
+    size_t length;
+
+    TextBuffer() : length(0) { text[0] = '\0'; }
+
+    TextBuffer& Append(const char* str)
+    {
+        while(*str != '\0' && length < CAPACITY - 1)
+            text[length++] = *str++;
+        text[length] = '\0';
+        return *this;
+    }
+
+    TextBuffer& AppendUint(uint32_t value)
+    {
+        char digits[10];
+        int  count = 0;
+        do
+        {
+            digits[count++] = (char)('0' + (value % 10));
+            value /= 10;
+        } while(value > 0);
+        while(count > 0 && length < CAPACITY - 1)
+            text[length++] = digits[--count];
+        text[length] = '\0';
+        return *this;
+    }
+
+    const char* c_str() const { return text; }
+};
 
-        // Get smoothed parameter value for this page/slot
+// Static labels, built once at compile time
+const char* const page_titles[NUM_PAGES] = {"PAGE 1", "PAGE 2", "PAGE 3", "PAGE 4"};
+const char* const page_overlay_names[NUM_PAGES] = {
+    "PERFORMANCE", "MACRO", "STRUCTURAL", "STRUCTURAL"
+};
+
+// ============================================================================
+// DISPLAY RENDERER (dirty widgets, bounded work per main loop iteration)
+// ============================================================================
+// The screen is split into widgets. ScanDisplayState() runs at ~30Hz, captures
+// what each widget shows and marks only the widgets whose content changed.
+// UpdateDisplay() is called every loop iteration and does at most ONE unit of
+// work: redraw a single dirty widget, or flush the framebuffer once all dirty
+// widgets are drawn. Nothing changed = no redraw and no flush.
+//
+// The Patch OLED driver only exposes a full-frame blocking Update() (8 pages
+// over blocking SPI), so the flush cannot be split into DMA chunks from here;
+// instead it is skipped entirely on unchanged frames, and every step is timed
+// so the worst-case stall is visible in display_step_us_max/flush_us_max.
+
+enum DisplayWidget {
+    WIDGET_TITLE = 0,    // "PAGE n" (top left)
+    WIDGET_CLOCK,        // Clock pulse dot
+    WIDGET_PAGE_DOTS,    // Page indicator dots (top right)
+    WIDGET_SCALE,        // Quantization scale, e.g. "A MIN" (top, blank when chromatic)
+    WIDGET_ROW_0,        // Parameter name + bar, rows 0-3
+    WIDGET_ROW_1,
+    WIDGET_ROW_2,
+    WIDGET_ROW_3,
+    WIDGET_STATUS,       // Learning state (bottom left)
+    WIDGET_BPM,          // BPM readout
+    WIDGET_GATE,         // Clock gate box (bottom right)
+    WIDGET_PITCH,        // Pitch bar (right edge, overlaps bar ends)
+    WIDGET_OVERLAY,      // Page change overlay (drawn last)
+    WIDGET_COUNT
+};
+
+// Widgets that must be redrawn after a widget, because its clear region
+// overlaps them. Dependencies only point to later widgets, so a frame
+// always converges.
+const uint32_t ROW_REDRAW_AFTER = (1u << WIDGET_PITCH) | (1u << WIDGET_OVERLAY);
+const uint32_t ROW_3_REDRAW_AFTER = (1u << WIDGET_PITCH) | (1u << WIDGET_STATUS) |
+                                    (1u << WIDGET_BPM) | (1u << WIDGET_GATE);
+const uint32_t ALL_WIDGETS = (1u << WIDGET_COUNT) - 1;
+
+// Everything the renderer draws, quantized to what is visible on screen
+struct DisplayState {
+    int8_t  page;
+    bool    clock_on;
+    uint8_t bar_width[PARAMS_PER_PAGE];  // Filled bar width (pixels)
+    bool    bar_active[PARAMS_PER_PAGE]; // Pickup state (solid/dashed border)
+    int8_t  pot_x[PARAMS_PER_PAGE];      // Pot marker x (-1 = not shown)
+    uint8_t learn_state;
+    uint8_t learn_count;
+    int16_t bpm;                         // -1 = no clock locked
+    int8_t  clock_rate;                  // ClockRate (grid triggers when not OFF)
+    bool    self_clocked;                // RHYTHM_MODE_LEARNED
+    bool    transport_stopped;           // MIDI Stop received
+    int8_t  tempo_source;                // TempoSource (clock indicator letter)
+    int8_t  phrase_slot;                 // Active phrase slot
+    int8_t  phrase_next;                 // Requested slot (== phrase_slot when none)
+    int16_t scale_key;                   // 0 = chromatic, see scale_key_for()
+    bool    gate_high;
+    int8_t  note_y;                      // -1 = pitch bar hidden
+    int8_t  center_y;                    // -1 = no center tick
+    bool    overlay;
+};
+
+DisplayState display_state;
+bool     display_full_redraw = true;   // Clear screen and draw every widget
+uint32_t display_dirty = 0;            // Bitmask of widgets waiting to be drawn
+bool     display_flush_pending = false;
+
+// Render timing (inspectable via debugger)
+uint32_t display_step_us_max = 0;      // Worst single widget redraw
+uint32_t display_flush_us_last = 0;
+uint32_t display_flush_us_max = 0;     // Worst framebuffer flush
+uint32_t display_flush_count = 0;
+
+void clear_region(int x1, int y1, int x2, int y2)
+{
+    hw.display.DrawRect(x1, y1, x2, y2, false, true);
+}
+
+// Draw the parameter bar for one row, clipped to columns [x_min, x_max]
+// (the pitch widget redraws just the bar ends it overlaps)
+void draw_param_bar(int row, int x_min, int x_max)
+{
+    const DisplayState& ds = display_state;
+    int y = 16 + (row * 11);
+    int x_lo = x_min > 56 ? x_min : 56;
+    int x_hi = x_max < 126 ? x_max : 126;
+    if(x_lo > x_hi)
+        return;
+
+    // Filled bar at stored value
+    int fill_end = 56 + ds.bar_width[row] - 1;
+    if(fill_end > x_hi) fill_end = x_hi;
+    for(int x = x_lo; x <= fill_end; x++)
+    {
+        hw.display.DrawLine(x, y, x, y + 6, true);
+    }
+
+    if(ds.bar_active[row])
+    {
+        // Active: solid border
+        hw.display.DrawLine(x_lo, y, x_hi, y, true);
+        hw.display.DrawLine(x_lo, y + 7, x_hi, y + 7, true);
+    }
+    else
+    {
+        // Dashed border to show waiting for pickup
+        for(int x = 56; x < 126; x += 4)
+        {
+            if(x < x_lo || x > x_hi)
+                continue;
+            hw.display.DrawPixel(x, y, true);
+            hw.display.DrawPixel(x, y + 7, true);
+        }
+
+        // Show current pot position as hollow rectangle (3 pixels wide)
+        int pot_x = ds.pot_x[row];
+        if(pot_x > 56 && pot_x < 126 && pot_x + 1 >= x_lo && pot_x - 1 <= x_hi)
+        {
+            hw.display.DrawRect(pot_x - 1, y + 1, pot_x + 1, y + 5, true, false);
+        }
+    }
+    if(x_lo == 56)
+        hw.display.DrawLine(56, y, 56, y + 7, true);
+    if(x_hi == 126)
+        hw.display.DrawLine(126, y, 126, y + 7, true);
+}
+
+// Capture the visible state and mark changed widgets dirty (~30Hz)
+void ScanDisplayState()
+{
+    DisplayState next;
+    next.page = current_page;
+    next.clock_on = clock_pulse_indicator > 0;
+    for(int i = 0; i < PARAMS_PER_PAGE; i++)
+    {
         int param_index = (current_page * PARAMS_PER_PAGE) + i;
-        float param_value = parameters_smoothed[param_index];
-        bool is_active = param_pickup_active[param_index];
+        next.bar_width[i] = (uint8_t)(parameters_smoothed[param_index] * 70.0f);
+        next.bar_active[i] = param_pickup_active[param_index];
+        next.pot_x[i] = next.bar_active[i] ? -1 : (int8_t)(56 + (int)(pot_values[i] * 70.0f));
+    }
+    next.learn_state = (uint8_t)learning_state;
+    next.learn_count = (uint8_t)phrase->note_buffer_count;
+    next.bpm = (tempo_period_us.load(std::memory_order_relaxed) > 0) ? (int16_t)clock_bpm : -1;
+    next.clock_rate = (int8_t)clock_rate_setting.load(std::memory_order_relaxed);
+    next.self_clocked = rhythm_mode_setting.load(std::memory_order_relaxed) == RHYTHM_MODE_LEARNED;
+    next.transport_stopped = !midi_transport_running.load(std::memory_order_relaxed);
+    next.tempo_source = (int8_t)tempo_source.load(std::memory_order_relaxed);
+    next.phrase_slot = (int8_t)phrase_slot;
+    next.phrase_next = (int8_t)phrase_slot_requested.load(std::memory_order_relaxed);
+    next.scale_key = (int16_t)active_interval_sampler().scale_key;
+    next.gate_high = (next.tempo_source == TEMPO_SOURCE_GATE_2) ? gate2_state : next.clock_on;
+    next.note_y = -1;
+    next.center_y = -1;
+    if(learning_state == STATE_GENERATING)
+    {
+        // Map MIDI note (0-127) to vertical position (12-55)
+        next.note_y = 55 - (int)(((float)voices.output_note[0] / 127.0f) * 43.0f);
+        if(phrase->tendencies_ready)
+            next.center_y = 55 - (int)((phrase->tendencies.register_center / 127.0f) * 43.0f);
+    }
+    next.overlay = page_change_timer > 0;
+
+    const DisplayState& prev = display_state;
+    uint32_t dirty = 0;
+    if(next.page != prev.page)
+        dirty |= (1u << WIDGET_TITLE) | (1u << WIDGET_PAGE_DOTS);
+    if(next.clock_on != prev.clock_on)
+        dirty |= (1u << WIDGET_CLOCK);
+    for(int i = 0; i < PARAMS_PER_PAGE; i++)
+    {
+        if(next.page != prev.page || next.bar_width[i] != prev.bar_width[i] ||
+           next.bar_active[i] != prev.bar_active[i] || next.pot_x[i] != prev.pot_x[i])
+            dirty |= (1u << (WIDGET_ROW_0 + i));
+    }
+    if(next.learn_state != prev.learn_state || next.learn_count != prev.learn_count)
+        dirty |= (1u << WIDGET_STATUS);
+    if(next.bpm != prev.bpm || next.clock_rate != prev.clock_rate
+       || next.self_clocked != prev.self_clocked
+       || next.transport_stopped != prev.transport_stopped
+       || next.phrase_slot != prev.phrase_slot
+       || next.phrase_next != prev.phrase_next)
+        dirty |= (1u << WIDGET_BPM);
+    if(next.scale_key != prev.scale_key)
+        dirty |= (1u << WIDGET_SCALE);
+    if(next.gate_high != prev.gate_high || next.tempo_source != prev.tempo_source)
+        dirty |= (1u << WIDGET_GATE);
+    if(next.note_y != prev.note_y || next.center_y != prev.center_y)
+        dirty |= (1u << WIDGET_PITCH);
+    if(next.overlay != prev.overlay || (next.overlay && next.page != prev.page))
+    {
+        dirty |= (1u << WIDGET_OVERLAY);
+        // Overlay removed: rows underneath must be redrawn
+        if(!next.overlay)
+            dirty |= (1u << WIDGET_ROW_0) | (1u << WIDGET_ROW_1) | (1u << WIDGET_ROW_2);
+    }
+
+    display_state = next;
+    display_dirty |= dirty;
+}
+
+// Redraw one widget (clear its region, draw it, mark overlapping widgets)
+void render_widget(int widget)
+{
+    const DisplayState& ds = display_state;
+    switch(widget)
+    {
+        case WIDGET_TITLE:
+        {
+            clear_region(0, 0, 47, 7);
+            hw.display.SetCursor(0, 0);
+            hw.display.WriteString((char*)page_titles[ds.page], Font_6x8, true);
+            break;
+        }
+        case WIDGET_CLOCK:
+            // Clock pulse indicator (top left, next to page name)
+            clear_region(57, 0, 63, 4);
+            hw.display.DrawCircle(60, 2, 2, ds.clock_on);
+            break;
+        case WIDGET_PAGE_DOTS:
+            clear_region(107, 0, 127, 4);
+            for(int i = 0; i < NUM_PAGES; i++)
+            {
+                // Filled circle for current page, empty for others
+                hw.display.DrawCircle(110 + (i * 6), 2, 2, i == ds.page);
+            }
+            break;
+        case WIDGET_SCALE:
+            clear_region(66, 0, 105, 7);
+            if(ds.scale_key > 0)
+            {
+                hw.display.SetCursor(66, 0);
+                TextBuffer<8> scale_str;
+                scale_str.Append(pitch_class_names[(ds.scale_key - 1) % PITCH_CLASSES]);
+                if(scale_str.length < 2)
+                    scale_str.Append(" ");
+                scale_str.Append(scale_template_names[(ds.scale_key - 1) / PITCH_CLASSES]);
+                hw.display.WriteString((char*)scale_str.c_str(), Font_6x8, true);
+            }
+            break;
+        case WIDGET_ROW_0:
+        case WIDGET_ROW_1:
+        case WIDGET_ROW_2:
+        case WIDGET_ROW_3:
+        {
+            int row = widget - WIDGET_ROW_0;
+            int y_top = 14 + (row * 11);
+            clear_region(0, y_top, 127, (row == 3) ? 56 : y_top + 10);
+
+            // Parameter name from current page
+            hw.display.SetCursor(0, 16 + (row * 11));
+            hw.display.WriteString((char*)page_names[ds.page][row], Font_6x8, true);
+            draw_param_bar(row, 0, 127);
+
+            display_dirty |= (row == 3) ? ROW_3_REDRAW_AFTER : ROW_REDRAW_AFTER;
+            break;
+        }
+        case WIDGET_STATUS:
+            // Learning state indicator (bottom left) - always show state
+            clear_region(0, 56, 29, 63);
+            hw.display.SetCursor(0, 56);
+            if(ds.learn_state == STATE_LEARNING)
+            {
+                // Show "L:" and note count
+                TextBuffer<8> learn_str;
+                learn_str.Append("L:").AppendUint(ds.learn_count);
+                hw.display.WriteString((char*)learn_str.c_str(), Font_6x8, true);
+            }
+            else if(ds.learn_state == STATE_GENERATING)
+            {
+                // Show "G:" and buffer size
+                TextBuffer<8> gen_str;
+                gen_str.Append("G:").AppendUint(ds.learn_count);
+                hw.display.WriteString((char*)gen_str.c_str(), Font_6x8, true);
+            }
+            else
+            {
+                // IDLE: show dash
+                hw.display.WriteString((char*)"-", Font_6x8, true);
+            }
+            break;
+        case WIDGET_BPM:
+            // BPM display (bottom center-left) - always show if clock locked
+            // ("120 x2" with a clock rate, "RHY" when self-clocked, "STOP"
+            // while the MIDI transport is stopped), followed by the phrase
+            // slot ("P1", or "P1>3" while a switch is pending)
+            clear_region(30, 56, 99, 63);
+            {
+                hw.display.SetCursor(30, 56);
+                TextBuffer<16> bpm_str;
+                if(ds.self_clocked)
+                    bpm_str.Append("RHY ");
+                else if(ds.transport_stopped)
+                    bpm_str.Append("STOP ");
+                else if(ds.bpm >= 0 && ds.clock_rate != CLOCK_RATE_OFF)
+                    bpm_str.AppendUint(ds.bpm).Append(" ").Append(clock_rates[ds.clock_rate].name).Append(" ");
+                else if(ds.bpm >= 0)
+                    bpm_str.AppendUint(ds.bpm).Append("bpm ");
+                bpm_str.Append("P").AppendUint(ds.phrase_slot + 1);
+                if(ds.phrase_next != ds.phrase_slot)
+                    bpm_str.Append(">").AppendUint(ds.phrase_next + 1);
+                hw.display.WriteString((char*)bpm_str.c_str(), Font_6x8, true);
+            }
+            break;
+        case WIDGET_GATE:
+            // Clock/Gate indicator (bottom right), filled box when gate is high
+            // (or on a beat): "C" Gate 2, "M" MIDI clock, "I" internal clock
+            clear_region(100, 56, 112, 63);
+            hw.display.DrawRect(100, 56, 112, 63, true, ds.gate_high);
+            hw.display.SetCursor(102, 56);
+            hw.display.WriteString((char*)(ds.tempo_source == TEMPO_SOURCE_MIDI       ? "M"
+                                           : ds.tempo_source == TEMPO_SOURCE_INTERNAL ? "I"
+                                                                                      : "C"),
+                                   Font_6x8, !ds.gate_high);
+            break;
+        case WIDGET_PITCH:
+            // Pitch column overlaps the separator and the bar ends
+            clear_region(122, 10, 127, 57);
+            hw.display.DrawLine(122, 12, 127, 12, true);
+            for(int row = 0; row < PARAMS_PER_PAGE; row++)
+                draw_param_bar(row, 122, 127);
+            if(ds.note_y >= 0)
+            {
+                // Vertical pitch reference bar with current note as a dot
+                hw.display.DrawLine(126, 12, 126, 55, true);
+                hw.display.DrawCircle(126, ds.note_y, 2, true);
+
+                // Register center as a small horizontal tick
+                if(ds.center_y >= 0)
+                    hw.display.DrawLine(123, ds.center_y, 125, ds.center_y, true);
+            }
+            break;
+        case WIDGET_OVERLAY:
+            // Page change overlay box with page name in center
+            if(ds.overlay)
+            {
+                hw.display.DrawRect(10, 22, 118, 42, true, true);
+                hw.display.DrawRect(11, 23, 117, 41, false, false);
+                hw.display.SetCursor(30, 28);
+                hw.display.WriteString((char*)page_overlay_names[ds.page], Font_7x10, false);
+            }
+            break;
+        default: break;
+    }
+}
+
+// Widgets, a full redraw or a flush still to do
+inline bool display_busy()
+{
+    return display_full_redraw || display_dirty != 0 || display_flush_pending;
+}
+
+// One bounded unit of display work per call (call every loop iteration)
+void UpdateDisplay()
+{
+    uint32_t start_us = System::GetUs();
+
+    if(display_full_redraw)
+    {
+        hw.display.Fill(false);
+
+        // Draw line separator (static)
+        hw.display.DrawLine(0, 12, 127, 12, true);
+
+        display_full_redraw = false;
+        display_dirty = ALL_WIDGETS;
+    }
+    else if(display_dirty != 0)
+    {
+        // Lowest bit first: overlapping widgets are always later in the order
+        int widget = __builtin_ctz(display_dirty);
+        display_dirty &= ~(1u << widget);
+
+        // Keep the overlay on top of anything drawn underneath it
+        if(display_state.overlay && widget >= WIDGET_ROW_0 && widget <= WIDGET_ROW_2)
+            display_dirty |= (1u << WIDGET_OVERLAY);
+
+        render_widget(widget);
+        display_flush_pending = true;
+    }
+    else if(display_flush_pending)
+    {
+        uint32_t flush_start = trace_now();
+        hw.display.Update();
+        trace_record(TRACE_DISPLAY_FLUSH, trace_now() - flush_start);
+        display_flush_pending = false;
+
+        display_flush_us_last = System::GetUs() - start_us;
+        if(display_flush_us_last > display_flush_us_max)
+            display_flush_us_max = display_flush_us_last;
+        display_flush_count++;
+        return;
+    }
+    else
+    {
+        return;  // Nothing changed
+    }
+
+    uint32_t step_us = System::GetUs() - start_us;
+    if(step_us > display_step_us_max)
+        display_step_us_max = step_us;
+}
+
+bool encoder_turned_while_held = false;  // Press-and-turn selected a phrase slot
+
+// ============================================================================
+// MIDI CC DISPATCH
+// ============================================================================
+// CC number -> parameter index in one lookup; remappable at runtime. A burst
+// of CCs is coalesced so each parameter takes only the last value of a batch.
+
+const int8_t CC_UNMAPPED = -1;
+int8_t   cc_param_map[128];
+uint8_t  cc_pending_value[TOTAL_PARAMS];
+uint32_t cc_pending_mask = 0;           // Bit per parameter with a new value
+uint32_t cc_events_coalesced = 0;       // CCs superseded within a batch
+
+// Scale quantization (generator_core.h): 0-127 spread over chromatic, auto
+// (fitted to the learned phrase) and the fixed scale templates
+const uint8_t SCALE_CC = 86;
+
+void select_scale(int select)
+{
+    if(select < 0 || select >= SCALE_SELECT_COUNT || select == scale_select)
+        return;
+    scale_select = select;  // The next control tick rebuilds the sampler
+    persist_serial++;
+}
+
+// CV outputs (see CV OUTPUTS): mode spread over 0-127, glide 0-CV_GLIDE_MAX_MS
+const uint8_t CV_MODE_CC = 87;
+const uint8_t CV_GLIDE_CC = 88;
+
+void set_cv_mode(int mode)
+{
+    if(mode < 0 || mode >= CV_MODE_COUNT || mode == cv_mode_setting.load())
+        return;
+    cv_mode_setting.store((uint8_t)mode);
+    persist_serial++;
+}
+
+void set_cv_glide(float ms)
+{
+    if(ms == cv_glide_ms_setting.load())
+        return;
+    cv_glide_ms_setting.store(ms);
+    persist_serial++;
+}
+
+// Clock rate and swing (see TEMPO TRACKING): rate spread over 0-127, swing
+// 0-CLOCK_SWING_MAX of a grid step
+const uint8_t CLOCK_RATE_CC = 89;
+const uint8_t CLOCK_SWING_CC = 90;
+
+void set_clock_rate(int rate)
+{
+    if(rate < 0 || rate >= CLOCK_RATE_COUNT || rate == clock_rate_setting.load())
+        return;
+    clock_rate_setting.store((uint8_t)rate);
+    persist_serial++;
+}
+
+void set_clock_swing(float swing)
+{
+    if(swing == clock_swing_setting.load())
+        return;
+    clock_swing_setting.store(swing);
+    persist_serial++;
+}
 
-        // Get current pot position for this parameter
-        float pot_position = pot_values[i];
-        int pot_x = 56 + (int)(pot_position * 70.0f);
+// Self-clocked rhythm (see SELF-CLOCKED RHYTHM): 0-63 off, 64-127 learned
+const uint8_t RHYTHM_CC = 102;
 
-        // Border (solid if active, dashed if waiting for pickup)
-        if(is_active)
-        {
-            // Active: show filled bar at stored value
-            int bar_width = (int)(param_value * 70.0f);
-            for(int x = 0; x < bar_width; x++)
-            {
-                hw.display.DrawLine(56 + x, y, 56 + x, y + 6, true);
-            }
-            hw.display.DrawRect(56, y, 126, y + 7, true, false);
-        }
-        else
-        {
-            // Not active: show stored value as filled bar, pot position as hollow indicator
-            int bar_width = (int)(param_value * 70.0f);
-            for(int x = 0; x < bar_width; x++)
-            {
-                hw.display.DrawLine(56 + x, y, 56 + x, y + 6, true);
-            }
+void set_rhythm_mode(int mode)
+{
+    if(mode < 0 || mode >= RHYTHM_MODE_COUNT || mode == rhythm_mode_setting.load())
+        return;
+    rhythm_mode_setting.store((uint8_t)mode);
+    persist_serial++;
+}
 
-            // Dashed border to show waiting for pickup
-            for(int x = 56; x < 126; x += 4)
-            {
-                hw.display.DrawPixel(x, y, true);
-                hw.display.DrawPixel(x, y + 7, true);
-            }
-            hw.display.DrawLine(56, y, 56, y + 7, true);
-            hw.display.DrawLine(126, y, 126, y + 7, true);
+// MIDI clock out (see MIDI CLOCK AND TRANSPORT): mode spread over 0-127,
+// internal tempo INTERNAL_TEMPO_MIN_BPM + value
+const uint8_t CLOCK_OUT_CC = 103;
+const uint8_t INTERNAL_TEMPO_CC = 104;
 
-            // Show current pot position as hollow rectangle (3 pixels wide)
-            if(pot_x > 56 && pot_x < 126)
-            {
-                hw.display.DrawRect(pot_x - 1, y + 1, pot_x + 1, y + 5, true, false);
-            }
-        }
-    }
+void set_clock_out(int mode)
+{
+    if(mode < 0 || mode >= CLOCK_OUT_COUNT || mode == clock_out_setting.load())
+        return;
+    clock_out_setting.store((uint8_t)mode);
+    persist_serial++;
+}
 
-    // Learning state indicator (bottom left) - always show state
-    hw.display.SetCursor(0, 56);
-    if(learning_state == STATE_LEARNING)
-    {
-        // Show "L:" and note count
-        std::string learn_str = "L:" + std::to_string(note_buffer_count);
-        hw.display.WriteString((char*)learn_str.c_str(), Font_6x8, true);
-    }
-    else if(learning_state == STATE_GENERATING)
-    {
-        // Show "G:" and buffer size
-        std::string gen_str = "G:" + std::to_string(note_buffer_count);
-        hw.display.WriteString((char*)gen_str.c_str(), Font_6x8, true);
-    }
-    else
-    {
-        // IDLE: show dash
-        hw.display.WriteString((char*)"-", Font_6x8, true);
-    }
+void set_internal_tempo(int bpm)
+{
+    if(bpm < INTERNAL_TEMPO_MIN_BPM || bpm > INTERNAL_TEMPO_MAX_BPM
+       || bpm == internal_bpm_setting.load())
+        return;
+    internal_bpm_setting.store((uint8_t)bpm);
+    persist_serial++;
+}
 
-    // BPM display (bottom center-left) - always show if clock detected
-    if(last_clock_time > 0)
+// Map cc_number to param_index (CC_UNMAPPED to ignore that CC)
+void remap_cc(uint8_t cc_number, int8_t param_index)
+{
+    if(cc_number < 128 && param_index < TOTAL_PARAMS)
     {
-        hw.display.SetCursor(30, 56);
-        std::string bpm_str = std::to_string((int)clock_bpm) + "bpm";
-        hw.display.WriteString((char*)bpm_str.c_str(), Font_6x8, true);
+        cc_param_map[cc_number] = param_index;
+        persist_serial++;
     }
+}
 
-    // Clock/Gate indicator (bottom right)
-    // Show filled box when gate is high
-    if(gate2_state)
-    {
-        hw.display.DrawRect(100, 56, 112, 63, true, true);
-    }
-    else
-    {
-        hw.display.DrawRect(100, 56, 112, 63, true, false);
-    }
+void init_cc_map()
+{
+    for(int cc = 0; cc < 128; cc++)
+        cc_param_map[cc] = CC_UNMAPPED;
+    for(int i = 0; i < MIDI_CC_COUNT; i++)
+        remap_cc(midi_cc_numbers[i], (int8_t)i);
+}
 
-    // Show "CLK" label
-    hw.display.SetCursor(102, 56);
-    hw.display.WriteString((char*)"C", Font_6x8, !gate2_state);
+// Record a CC for this batch (latest value per parameter wins)
+void queue_cc(uint8_t cc_number, uint8_t cc_value)
+{
+    int8_t param_index = cc_param_map[cc_number & 0x7F];
+    if(param_index == CC_UNMAPPED)
+        return;
+    if(cc_pending_mask & (1u << param_index))
+        cc_events_coalesced++;
+    cc_pending_value[param_index] = cc_value;
+    cc_pending_mask |= 1u << param_index;
+}
 
-    // Pitch visualization (right side, vertical bar showing current note)
-    if(learning_state == STATE_GENERATING)
+// Apply the coalesced CC values of a batch
+void apply_pending_cc()
+{
+    while(cc_pending_mask)
     {
-        // Map MIDI note (0-127) to vertical position (12-55)
-        // Higher notes = higher on screen (lower y value)
-        // Display area: y=12 (top) to y=55 (bottom) = 43 pixels
-        float note_normalized = (float)current_note / 127.0f;  // 0.0 to 1.0
-        int note_y = 55 - (int)(note_normalized * 43.0f);       // 55 (low) to 12 (high)
-
-        // Draw vertical pitch reference bar (right edge)
-        hw.display.DrawLine(126, 12, 126, 55, true);
+        int i = __builtin_ctz(cc_pending_mask);
+        cc_pending_mask &= cc_pending_mask - 1;
 
-        // Draw current note position as filled circle/dot
-        hw.display.DrawCircle(126, note_y, 2, true);
+        // Convert CC value (0-127) to parameter value (0.0-1.0)
+        float param_value = (float)cc_pending_value[i] / 127.0f;
 
-        // Optional: show register center as reference line
-        if(note_buffer_count >= MIN_LEARN_NOTES)
-        {
-            float center_normalized = tendencies.register_center / 127.0f;
-            int center_y = 55 - (int)(center_normalized * 43.0f);
-            // Draw small horizontal tick at center
-            hw.display.DrawLine(123, center_y, 125, center_y, true);
-        }
-    }
+        // Update parameter directly
+        parameters[i] = param_value;
+        parameters_smoothed[i] = param_value;  // Set smoothed to match immediately
 
-    // Page change overlay (shows for 2 seconds after page change)
-    if(page_change_timer > 0)
-    {
-        // Semi-transparent overlay box (just draw a box, can't do true transparency)
-        hw.display.DrawRect(10, 22, 118, 42, true, true);
-        hw.display.DrawRect(11, 23, 117, 41, false, false);
-
-        // Show page name in center
-        hw.display.SetCursor(30, 28);
-        std::string overlay_text;
-        if(current_page == 0)
-            overlay_text = "PERFORMANCE";
-        else if(current_page == 1)
-            overlay_text = "MACRO";
-        else
-            overlay_text = "STRUCTURAL";
-        hw.display.WriteString((char*)overlay_text.c_str(), Font_7x10, false);
+        // Deactivate pickup for this parameter so pot must catch up
+        // This prevents pot from immediately overriding MIDI control
+        param_pickup_active[i] = false;
     }
-
-    hw.display.Update();
 }
 
-void UpdateControls()
+// Every wake: drain the MIDI input for note learning, CCs and SysEx
+// Bytes are parsed into the event queue by the UART receive callback
+// (StartReceive) and moved to midi_in_queue by the gate capture ISR, which
+// keeps the real-time messages; Listen() only restarts reception after a
+// UART error
+void service_midi_in()
 {
-    hw.ProcessAnalogControls();
-    hw.ProcessDigitalControls();
-
-    // Process MIDI input for note learning
+    uint32_t drain_start = trace_now();
+    int drained = 0;
     hw.midi.Listen();
-    while(hw.midi.HasEvents())
+    MidiEvent midi_event;
+    while(midi_in_queue.Pop(midi_event))
     {
-        MidiEvent midi_event = hw.midi.PopEvent();
+        drained++;
 
         // Only process Note On messages (and Note On with velocity 0 = Note Off)
         if(midi_event.type == NoteOn)
@@ -1006,73 +3086,102 @@ void UpdateControls()
 
             if(velocity > 0)
             {
-                // Note On: start learning if idle/generating, or add to buffer if learning
-                if(learning_state == STATE_IDLE || learning_state == STATE_GENERATING)
+                // Note On: start learning if idle, inject if generating,
+                // or add to buffer if already learning/injecting
+                if(learning_state == STATE_IDLE)
                 {
                     // Start fresh learning (resets buffer)
-                    // This allows live phrase injection while generating
                     start_learning();
                 }
-                add_note_to_buffer(note);
+                else if(learning_state == STATE_GENERATING && !phrase_injecting)
+                {
+                    // Live phrase injection: generation keeps running
+                    start_injection();
+                }
+                add_note_to_buffer(note, velocity);
                 note_in_active = true;
                 last_note_in = note;
 
                 // Echo notes during learning if ECHO parameter enabled (> 0.5)
-                if(learning_state == STATE_LEARNING && parameters_smoothed[PARAM_ECHO_NOTES] > 0.5f)
+                if((learning_state == STATE_LEARNING || phrase_injecting)
+                   && parameters_smoothed[PARAM_ECHO_NOTES] > 0.5f)
                 {
-                    send_midi_note(note, velocity);
+                    send_midi_note(note, velocity, 0, 100.0f);
 
                     // Also trigger gate output for immediate feedback
-                    gate_out_state = true;
-                    gate_out_start_time = System::GetNow();
-                    dsy_gpio_write(&hw.gate_output, 1);
-                    gate_length_ms = 100.0f;  // Short 100ms gate for echo
+                    // (short 100ms gate, raised by the audio-rate scheduler)
+                    echo_gate_request.store(true);
                 }
             }
             else
             {
                 // Note Off (velocity 0)
-                note_in_active = false;
+                release_learned_note(note);
             }
         }
         else if(midi_event.type == NoteOff)
         {
-            note_in_active = false;
+            release_learned_note(midi_event.data[0]);
         }
         else if(midi_event.type == ControlChange)
         {
-            // Handle MIDI CC for parameter control
-            uint8_t cc_number = midi_event.data[0];
-            uint8_t cc_value = midi_event.data[1];  // 0-127
-
-            // Check if this CC number matches one of our defined parameters
-            for(int i = 0; i < MIDI_CC_COUNT; i++)
-            {
-                if(cc_number == midi_cc_numbers[i])
-                {
-                    // Convert CC value (0-127) to parameter value (0.0-1.0)
-                    float param_value = (float)cc_value / 127.0f;
-
-                    // Update parameter directly
-                    parameters[i] = param_value;
-                    parameters_smoothed[i] = param_value;  // Set smoothed to match immediately
-
-                    // Deactivate pickup for this parameter so pot must catch up
-                    // This prevents pot from immediately overriding MIDI control
-                    param_pickup_active[i] = false;
-
-                    break;  // Found matching CC, stop searching
-                }
-            }
+            // Phrase slot select, else MIDI CC for parameter control (applied after the batch)
+            if(midi_event.data[0] == PHRASE_SLOT_CC)
+                request_phrase_slot((midi_event.data[1] * PHRASE_SLOTS) >> 7);
+            else if(midi_event.data[0] == SCALE_CC)
+                select_scale((midi_event.data[1] * SCALE_SELECT_COUNT) >> 7);
+            else if(midi_event.data[0] == CV_MODE_CC)
+                set_cv_mode((midi_event.data[1] * CV_MODE_COUNT) >> 7);
+            else if(midi_event.data[0] == CV_GLIDE_CC)
+                set_cv_glide(CV_GLIDE_MAX_MS * (float)midi_event.data[1] / 127.0f);
+            else if(midi_event.data[0] == CLOCK_RATE_CC)
+                set_clock_rate((midi_event.data[1] * CLOCK_RATE_COUNT) >> 7);
+            else if(midi_event.data[0] == CLOCK_SWING_CC)
+                set_clock_swing(CLOCK_SWING_MAX * (float)midi_event.data[1] / 127.0f);
+            else if(midi_event.data[0] == RHYTHM_CC)
+                set_rhythm_mode((midi_event.data[1] * RHYTHM_MODE_COUNT) >> 7);
+            else if(midi_event.data[0] == CLOCK_OUT_CC)
+                set_clock_out((midi_event.data[1] * CLOCK_OUT_COUNT) >> 7);
+            else if(midi_event.data[0] == INTERNAL_TEMPO_CC)
+                set_internal_tempo(INTERNAL_TEMPO_MIN_BPM + midi_event.data[1]);
+            else
+                queue_cc(midi_event.data[0], midi_event.data[1]);
+        }
+        else if(midi_event.type == ProgramChange)
+        {
+            request_phrase_slot(midi_event.data[0]);
+        }
+        else if(midi_event.type == SystemCommon && midi_event.sc_type == SystemExclusive)
+        {
+            // Trace / debug log queries
+            handle_sysex(midi_event.sysex_data, midi_event.sysex_message_len);
         }
     }
+    apply_pending_cc();
+    if(drained > 0)
+        trace_record(TRACE_MIDI_IN_DRAIN, trace_now() - drain_start);
+    service_replay_request(audio_sample_rate);
+}
+
+// Control task (EVENT_CONTROL_TICK, CONTROL_RATE_HZ): pots, encoder,
+// smoothing, the core's control tick, learning timeout and LED
+void UpdateControls()
+{
+    hw.ProcessAnalogControls();
+    hw.ProcessDigitalControls();
 
     // Update learning state (check for timeout)
     update_learning_state();
 
     // Read encoder for page navigation (do this first to detect page changes)
+    // Turning while held selects a phrase slot instead
     int encoder_change = hw.encoder.Increment();
-    if(encoder_change != 0)
+    if(encoder_change != 0 && hw.encoder.Pressed())
+    {
+        request_phrase_slot(phrase_slot_requested.load(std::memory_order_relaxed) + encoder_change);
+        encoder_turned_while_held = true;
+    }
+    else if(encoder_change != 0)
     {
         current_page += encoder_change;
 
@@ -1153,14 +3262,29 @@ void UpdateControls()
         parameters_smoothed[i] += SMOOTHING_COEFF * (parameters[i] - parameters_smoothed[i]);
     }
 
+    // Voice count, engines, derived values, snapshot and sampler shape
+    // (the replay log sees the values the core is given)
+    replay_record_parameters();
+    apply_parameters();
+    replay_commit();
+
     // Encoder click behavior depends on learning state
+    // (acts on release, and not after a press-and-turn phrase selection)
     if(hw.encoder.RisingEdge())
+        encoder_turned_while_held = false;
+    if(hw.encoder.FallingEdge() && !encoder_turned_while_held)
     {
         if(learning_state == STATE_GENERATING)
         {
             // Reset learning: go back to IDLE, clear buffer
+            replay_begin_change();
             learning_state = STATE_IDLE;
-            note_buffer_count = 0;
+            phrase->note_buffer_count = 0;
+            phrase->note_buffer_written = 0;
+            phrase_injecting = false;
+            phrase->tendencies_ready = false;
+            replay_record_event(REPLAY_PHRASE_CLEAR);
+            persist_serial++;
             page_change_timer = 30;  // Brief flash
         }
         else
@@ -1177,120 +3301,592 @@ void UpdateControls()
         page_change_timer--;
     }
 
-    // Read Gate Input 1 (Note Trigger)
-    // Used to trigger note generation during GENERATING state
-    gate1_prev = gate1_state;
-    gate1_state = hw.gate_input[0].State();
-
-    // Detect rising edge on Gate 1 (note trigger)
+    // Commit a requested phrase slot once its clock edge has passed
+    service_phrase_switch();
     note_triggered = false;
-    if(gate1_state && !gate1_prev)
+
+    // Decrement pulse indicator
+    if(clock_pulse_indicator > 0)
     {
-        note_triggered = true;
-        log_debug(DBG_CLOCK_PULSE);
+        clock_pulse_indicator--;
+    }
 
-        // Generate new note if in generating mode
-        if(learning_state == STATE_GENERATING && note_buffer_count >= MIN_LEARN_NOTES)
-        {
-            current_note = generate_next_note();
-            send_midi_note(current_note, 100);  // Velocity 100
+    // LED indicates learning state
+    if(learning_state == STATE_LEARNING)
+    {
+        // Blink LED while learning (on when note active)
+        hw.seed.SetLed(note_in_active);
+    }
+    else if(learning_state == STATE_GENERATING)
+    {
+        // Pulse LED with clock when generating
+        hw.seed.SetLed(clock_pulse_indicator > 0);
+    }
+    else
+    {
+        // IDLE: show gate input (clock on Gate 2)
+        hw.seed.SetLed(gate2_state);
+    }
+}
 
-            // Trigger gate output
-            gate_out_state = true;
-            gate_out_start_time = System::GetNow();
-            dsy_gpio_write(&hw.gate_output, 1);  // Set gate HIGH
+// ============================================================================
+// PERSISTENCE (QSPI flash)
+// ============================================================================
+// Parameters, the CC map, the scale, CV, clock, clock out and rhythm
+// settings and the phrase bank (every slot's corpus and its analysis:
+// tendency and rhythm accumulators and Markov table) are saved as one
+// versioned binary record and restored in a single bulk copy at boot, so a
+// learned module comes back up already GENERATING. The interval sampler is
+// rebuilt from the restored tendencies (microseconds) instead of being stored.
+//
+// Wear leveling: records go round-robin into PERSIST_SLOTS slots, so each
+// sector is erased once per PERSIST_SLOTS saves; boot picks the valid record
+// with the highest sequence number. Saves are debounced until nothing has
+// changed for PERSIST_QUIET_MS, then written from the control tick in small
+// steps (one sector erase or one 256-byte page per step) with the header page
+// programmed last, so an interrupted save never replaces the previous record.
+// The record's CRC is folded in page by page as the body is programmed.
+//
+// libDaisy's QSPIHandle::EraseSector() and Write() wait until the flash is
+// done (tens to hundreds of ms per sector erase), so the steps drive the
+// QUADSPI peripheral through HAL instead: a step only sends its command, and
+// the next one starts once a status read finds the flash idle (WIP clear),
+// one read per control tick. The peripheral leaves memory-mapped mode at the
+// first save and stays in indirect mode: records are only read through the
+// memory map at boot (persist_load()), and libDaisy maps it again on reset.
+
+const uint32_t PERSIST_MAGIC = 0x47454E31;       // "GEN1"
+const uint16_t PERSIST_VERSION = 6;
+const uint32_t PERSIST_QSPI_OFFSET = 0x7C0000;   // Last 256 KB of the 8 MB QSPI
+const uint32_t PERSIST_SECTOR_SIZE = 4096;
+const uint32_t PERSIST_PAGE_SIZE = 256;
+const uint32_t PERSIST_SLOT_SIZE = 32768;        // Whole phrase bank per record
+const int      PERSIST_SLOTS = 8;                // 256 KB total
+const uint32_t PERSIST_QUIET_MS = 5000;          // Debounce after the last change
+const uint32_t PERSIST_CHECK_MS = 500;           // How often changes are looked for
+
+struct PersistHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t size;           // sizeof(PersistRecord)
+    uint32_t sequence;       // Increments per save; highest valid wins
+    uint32_t crc;            // CRC-32 of everything after the header
+};
 
-            // Calculate gate length as 50% of clock interval (or 50ms minimum)
-            if(clock_interval > 0)
-            {
-                gate_length_ms = (float)clock_interval * 0.5f;
-                if(gate_length_ms < 20.0f) gate_length_ms = 20.0f;    // Min 20ms
-                if(gate_length_ms > 500.0f) gate_length_ms = 500.0f;  // Max 500ms
-            }
-            else
-            {
-                gate_length_ms = 50.0f;  // Default 50ms if no clock yet
-            }
-        }
+struct PersistRecord {
+    PersistHeader header;
+    float    parameters[TOTAL_PARAMS];
+    int8_t   cc_param_map[128];
+    int32_t  phrase_slot;
+    int32_t  scale_select;
+    int32_t  cv_mode;
+    float    cv_glide_ms;
+    int32_t  clock_rate;
+    float    clock_swing;
+    int32_t  rhythm_mode;
+    int32_t  clock_out;
+    int32_t  internal_bpm;
+    PhraseSlot phrase_bank[PHRASE_SLOTS];
+};
+static_assert(sizeof(PersistRecord) <= PERSIST_SLOT_SIZE, "PersistRecord must fit one slot");
+static_assert(PERSIST_SLOT_SIZE % PERSIST_SECTOR_SIZE == 0, "Slots must be whole sectors");
+
+enum PersistStep {
+    PERSIST_IDLE,
+    PERSIST_ERASE,           // Erasing the slot, one sector per step
+    PERSIST_PROGRAM,         // Programming body pages, one per step
+    PERSIST_COMMIT           // Programming the header page
+};
+
+PersistRecord persist_record;              // Staging copy being written
+PersistStep persist_step = PERSIST_IDLE;
+uint32_t persist_step_offset = 0;          // Progress within the slot
+int      persist_slot = -1;                // Slot of the newest valid record
+uint32_t persist_sequence = 0;
+uint32_t persist_seen_serial = 0;          // persist_serial at the last check
+uint8_t  persist_seen_params[TOTAL_PARAMS];   // Parameters at the last check (CC resolution)
+bool     persist_dirty = false;            // Changed since the last save
+uint32_t persist_last_change_ms = 0;
+uint32_t persist_last_check_ms = 0;
+uint32_t persist_save_count = 0;
+uint32_t persist_errors = 0;                   // Saves abandoned on a flash error
+uint32_t persist_crc = 0;                  // Running CRC of the pages programmed so far
+
+// Flash commands (IS25LP064A, standard SPI instructions on one line)
+const uint8_t  QSPI_WRITE_ENABLE = 0x06;
+const uint8_t  QSPI_READ_STATUS = 0x05;
+const uint8_t  QSPI_SECTOR_ERASE = 0x20;      // 4 KB
+const uint8_t  QSPI_PAGE_PROGRAM = 0x02;
+const uint8_t  QSPI_STATUS_WIP = 0x01;        // Erase or program in progress
+const uint32_t QSPI_COMMAND_TIMEOUT_MS = 2;   // Command transfer only, never the erase
+
+QSPI_HandleTypeDef persist_qspi;              // Indirect-mode handle on libDaisy's QUADSPI setup
+bool persist_qspi_indirect = false;
+
+uint32_t persist_slot_offset(int slot)
+{
+    return PERSIST_QSPI_OFFSET + (uint32_t)slot * PERSIST_SLOT_SIZE;
+}
+
+// CRC-32 (reflected, polynomial 0xEDB88320), bitwise, in pieces: start
+// from 0xFFFFFFFF and invert the result. A save folds in one page per step.
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t size)
+{
+    for(uint32_t i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0u - (crc & 1)));
+    }
+    return crc;
+}
+
+// Whole body at once (boot)
+uint32_t persist_body_crc(const PersistRecord& record)
+{
+    const uint8_t* bytes = (const uint8_t*)&record;
+    return ~crc32_update(0xFFFFFFFF, bytes + sizeof(PersistHeader),
+                         sizeof(PersistRecord) - sizeof(PersistHeader));
+}
+
+bool persist_record_valid(const PersistRecord& record)
+{
+    return record.header.magic == PERSIST_MAGIC
+           && record.header.version == PERSIST_VERSION
+           && record.header.size == sizeof(PersistRecord)
+           && record.header.crc == persist_body_crc(record);
+}
+
+// Parameter at CC resolution (what counts as a change worth saving)
+inline uint8_t persist_quantize(float value)
+{
+    return (uint8_t)(clamp01(value) * 127.0f + 0.5f);
+}
+
+// Boot: find the newest valid record and restore it in one bulk copy.
+// Returns false (defaults stay) if no valid record exists.
+bool persist_load()
+{
+    int newest = -1;
+    for(int slot = 0; slot < PERSIST_SLOTS; slot++)
+    {
+        const PersistRecord* stored =
+            (const PersistRecord*)hw.seed.qspi.GetData(persist_slot_offset(slot));
+        if(stored->header.magic != PERSIST_MAGIC)
+            continue;
+        const PersistRecord* best =
+            (newest < 0) ? nullptr
+                         : (const PersistRecord*)hw.seed.qspi.GetData(persist_slot_offset(newest));
+        if(best && (int32_t)(stored->header.sequence - best->header.sequence) <= 0)
+            continue;
+        if(persist_record_valid(*stored))
+            newest = slot;
     }
+    if(newest < 0)
+        return false;
 
-    // Read Gate Input 2 (Clock/BPM Detection)
-    // Used to measure tempo continuously
-    gate2_prev = gate2_state;
-    gate2_state = hw.gate_input[1].State();
+    memcpy(&persist_record, hw.seed.qspi.GetData(persist_slot_offset(newest)), sizeof(PersistRecord));
+    const PersistRecord& r = persist_record;
 
-    // Detect rising edge on Gate 2 (BPM clock)
-    if(gate2_state && !gate2_prev)
+    for(int i = 0; i < TOTAL_PARAMS; i++)
     {
-        clock_pulse_indicator = 5;  // Show pulse for 5 frames (~150ms at 30fps)
+        parameters[i] = r.parameters[i];
+        parameters_smoothed[i] = r.parameters[i];
+        param_pickup_active[i] = false;  // Pots must catch up to the restored values
+        persist_seen_params[i] = persist_quantize(r.parameters[i]);
+    }
+    memcpy(cc_param_map, r.cc_param_map, sizeof(cc_param_map));
+    memcpy(phrase_bank, r.phrase_bank, sizeof(phrase_bank));
+    select_phrase_slot(r.phrase_slot);
+    if(r.scale_select >= 0 && r.scale_select < SCALE_SELECT_COUNT)
+        scale_select = r.scale_select;
+    if(r.cv_mode >= 0 && r.cv_mode < CV_MODE_COUNT)
+        cv_mode_setting.store((uint8_t)r.cv_mode);
+    if(r.cv_glide_ms >= 0.0f && r.cv_glide_ms <= CV_GLIDE_MAX_MS)
+        cv_glide_ms_setting.store(r.cv_glide_ms);
+    if(r.clock_rate >= 0 && r.clock_rate < CLOCK_RATE_COUNT)
+        clock_rate_setting.store((uint8_t)r.clock_rate);
+    if(r.clock_swing >= 0.0f && r.clock_swing <= CLOCK_SWING_MAX)
+        clock_swing_setting.store(r.clock_swing);
+    if(r.rhythm_mode >= 0 && r.rhythm_mode < RHYTHM_MODE_COUNT)
+        rhythm_mode_setting.store((uint8_t)r.rhythm_mode);
+    if(r.clock_out >= 0 && r.clock_out < CLOCK_OUT_COUNT)
+        clock_out_setting.store((uint8_t)r.clock_out);
+    if(r.internal_bpm >= INTERNAL_TEMPO_MIN_BPM && r.internal_bpm <= INTERNAL_TEMPO_MAX_BPM)
+        internal_bpm_setting.store((uint8_t)r.internal_bpm);
+
+    persist_slot = newest;
+    persist_sequence = r.header.sequence;
+    persist_seen_serial = persist_serial;
+    return true;
+}
 
-        // Measure time since last clock pulse
-        uint32_t current_time = System::GetNow();
-        if(last_clock_time > 0)
+// Snapshot the current state into the staging record
+void persist_capture()
+{
+    PersistRecord& r = persist_record;
+    memset(&r, 0, sizeof(r));
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        r.parameters[i] = parameters[i];
+    memcpy(r.cc_param_map, cc_param_map, sizeof(cc_param_map));
+    r.phrase_slot = phrase_slot;
+    r.scale_select = scale_select;
+    r.cv_mode = cv_mode_setting.load();
+    r.cv_glide_ms = cv_glide_ms_setting.load();
+    r.clock_rate = clock_rate_setting.load();
+    r.clock_swing = clock_swing_setting.load();
+    r.rhythm_mode = rhythm_mode_setting.load();
+    r.clock_out = clock_out_setting.load();
+    r.internal_bpm = internal_bpm_setting.load();
+    memcpy(r.phrase_bank, phrase_bank, sizeof(phrase_bank));
+
+    r.header.magic = PERSIST_MAGIC;
+    r.header.version = PERSIST_VERSION;
+    r.header.size = sizeof(PersistRecord);
+    r.header.sequence = persist_sequence + 1;
+
+    // The rest of the header page; the body pages follow as they are
+    // programmed, and the header goes last with the result
+    const uint8_t* bytes = (const uint8_t*)&r;
+    persist_crc = crc32_update(0xFFFFFFFF, bytes + sizeof(PersistHeader),
+                               PERSIST_PAGE_SIZE - sizeof(PersistHeader));
+}
+
+// Leave memory-mapped mode (once): abort the mapped read and take the
+// peripheral with a handle of our own. libDaisy's configuration (clock,
+// flash size) stays as it set it up.
+void qspi_enter_indirect()
+{
+    if(persist_qspi_indirect)
+        return;
+    QUADSPI->CR |= QUADSPI_CR_ABORT;
+    while(QUADSPI->CR & QUADSPI_CR_ABORT)
+        ;
+    while(QUADSPI->SR & QUADSPI_SR_BUSY)
+        ;
+    persist_qspi = QSPI_HandleTypeDef();
+    persist_qspi.Instance = QUADSPI;
+    persist_qspi.State = HAL_QSPI_STATE_READY;
+    persist_qspi.Timeout = QSPI_COMMAND_TIMEOUT_MS;
+    persist_qspi_indirect = true;
+}
+
+// One instruction with an optional 24-bit address and data phase of size bytes
+bool qspi_command(uint8_t instruction, bool has_address, uint32_t address, uint32_t size)
+{
+    QSPI_CommandTypeDef cmd = {};
+    cmd.Instruction = instruction;
+    cmd.InstructionMode = QSPI_INSTRUCTION_1_LINE;
+    cmd.Address = address;
+    cmd.AddressMode = has_address ? QSPI_ADDRESS_1_LINE : QSPI_ADDRESS_NONE;
+    cmd.AddressSize = QSPI_ADDRESS_24_BITS;
+    cmd.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+    cmd.DataMode = size > 0 ? QSPI_DATA_1_LINE : QSPI_DATA_NONE;
+    cmd.NbData = size;
+    cmd.DummyCycles = 0;
+    cmd.DdrMode = QSPI_DDR_MODE_DISABLE;
+    cmd.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+    cmd.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+    return HAL_QSPI_Command(&persist_qspi, &cmd, QSPI_COMMAND_TIMEOUT_MS) == HAL_OK;
+}
+
+// True while an erase or program is still running (one status read)
+bool qspi_busy()
+{
+    uint8_t status = QSPI_STATUS_WIP;
+    if(!qspi_command(QSPI_READ_STATUS, false, 0, 1)
+       || HAL_QSPI_Receive(&persist_qspi, &status, QSPI_COMMAND_TIMEOUT_MS) != HAL_OK)
+        return true;
+    return (status & QSPI_STATUS_WIP) != 0;
+}
+
+// Start a 4 KB sector erase; returns once the command is sent
+bool qspi_start_erase(uint32_t address)
+{
+    return qspi_command(QSPI_WRITE_ENABLE, false, 0, 0)
+           && qspi_command(QSPI_SECTOR_ERASE, true, address, 0);
+}
+
+// Start programming up to one page; returns once the data is sent
+bool qspi_start_program(uint32_t address, const uint8_t* data, uint32_t size)
+{
+    return qspi_command(QSPI_WRITE_ENABLE, false, 0, 0)
+           && qspi_command(QSPI_PAGE_PROGRAM, true, address, size)
+           && HAL_QSPI_Transmit(&persist_qspi, (uint8_t*)data, QSPI_COMMAND_TIMEOUT_MS) == HAL_OK;
+}
+
+// Control tick: notice changes, debounce, and advance a save by one small step
+void service_persistence()
+{
+    uint32_t now = System::GetNow();
+
+    if(persist_step == PERSIST_IDLE)
+    {
+        if(now - persist_last_check_ms < PERSIST_CHECK_MS)
+            return;
+        persist_last_check_ms = now;
+
+        // Any change restarts the quiet period
+        bool changed = (persist_serial != persist_seen_serial);
+        for(int i = 0; i < TOTAL_PARAMS; i++)
         {
-            clock_interval = current_time - last_clock_time;
+            uint8_t value = persist_quantize(parameters[i]);
+            changed = changed || (value != persist_seen_params[i]);
+            persist_seen_params[i] = value;
+        }
+        persist_seen_serial = persist_serial;
+        if(changed)
+        {
+            persist_dirty = true;
+            persist_last_change_ms = now;
+        }
+
+        // Never save a half-learned phrase
+        if(!persist_dirty || now - persist_last_change_ms < PERSIST_QUIET_MS
+           || learning_state == STATE_LEARNING || phrase_injecting)
+            return;
+
+        persist_capture();
+        persist_dirty = false;
+        persist_slot = (persist_slot + 1) % PERSIST_SLOTS;
+        persist_step = PERSIST_ERASE;
+        persist_step_offset = 0;
+        qspi_enter_indirect();
+        return;
+    }
+
+    // The previous step's erase or program must have finished
+    if(qspi_busy())
+        return;
+
+    uint32_t base = persist_slot_offset(persist_slot);
+    uint8_t* bytes = (uint8_t*)&persist_record;
+    bool sent = true;
+    switch(persist_step)
+    {
+        case PERSIST_ERASE:
+            sent = qspi_start_erase(base + persist_step_offset);
+            persist_step_offset += PERSIST_SECTOR_SIZE;
+            if(persist_step_offset >= PERSIST_SLOT_SIZE)
+            {
+                persist_step = PERSIST_PROGRAM;
+                persist_step_offset = PERSIST_PAGE_SIZE;  // Header page goes last
+            }
+            break;
 
-            // Calculate BPM (assuming quarter notes)
-            // BPM = 60000 / interval_ms
-            if(clock_interval > 0)
+        case PERSIST_PROGRAM:
+        {
+            uint32_t remaining = sizeof(PersistRecord) - persist_step_offset;
+            uint32_t size = (remaining < PERSIST_PAGE_SIZE) ? remaining : PERSIST_PAGE_SIZE;
+            if(size > 0)
             {
-                clock_bpm = 60000.0f / (float)clock_interval;
-                // Clamp to reasonable range
-                if(clock_bpm < 20.0f) clock_bpm = 20.0f;
-                if(clock_bpm > 300.0f) clock_bpm = 300.0f;
+                persist_crc = crc32_update(persist_crc, bytes + persist_step_offset, size);
+                sent = qspi_start_program(base + persist_step_offset, bytes + persist_step_offset, size);
             }
+            persist_step_offset += PERSIST_PAGE_SIZE;
+            if(persist_step_offset >= sizeof(PersistRecord))
+                persist_step = PERSIST_COMMIT;
+            break;
         }
-        last_clock_time = current_time;
+
+        case PERSIST_COMMIT:
+            persist_record.header.crc = ~persist_crc;
+            sent = qspi_start_program(base, bytes, PERSIST_PAGE_SIZE);
+            persist_sequence = persist_record.header.sequence;
+            persist_save_count++;
+            persist_step = PERSIST_IDLE;
+            break;
+
+        default:
+            persist_step = PERSIST_IDLE;
+            break;
     }
 
-    // Decrement pulse indicator
-    if(clock_pulse_indicator > 0)
+    // Flash error: drop the save (the previous record stays valid), retry
+    // after the next quiet period
+    if(!sent)
     {
-        clock_pulse_indicator--;
+        persist_errors++;
+        persist_step = PERSIST_IDLE;
+        persist_dirty = true;
+        persist_last_change_ms = now;
     }
+}
+
+// One main loop pass for the events the wait returned
+void main_loop_pass(uint32_t events)
+{
+    // MIDI input first (note learning, echo), then the fixed-rate control task
+    service_midi_in();
+    if(events & EVENT_CONTROL_TICK)
+        UpdateControls();
 
-    // Update gate output timing
-    if(gate_out_state)
+    // Forward notes generated by the audio-rate scheduler to MIDI out,
+    // and due Note Offs / queued bytes on every control tick
+    service_note_events();
+    service_midi_out();
+
+    // Top up the pre-generated note queues and drawn rhythm steps
+    service_lookahead();
+    service_rhythm();
+
+    if(events & EVENT_CONTROL_TICK)
     {
-        uint32_t current_time = System::GetNow();
-        uint32_t gate_elapsed = current_time - gate_out_start_time;
+        // Debounced background save, one flash step per tick at most
+        service_persistence();
 
-        // Check if gate should go low
-        if(gate_elapsed >= (uint32_t)gate_length_ms)
+        // Scan display state at ~30Hz (every 34 ticks)
+        if(frame_counter++ > 33)
         {
-            gate_out_state = false;
-            dsy_gpio_write(&hw.gate_output, 0);  // Set gate LOW
+            ScanDisplayState();
+            frame_counter = 0;
         }
     }
 
-    // LED indicates learning state
-    if(learning_state == STATE_LEARNING)
+    // Lowest priority: render/flush at most one widget per pass
+    UpdateDisplay();
+}
+
+#ifdef GG_BENCHMARK
+// ============================================================================
+// BENCHMARK BUILD (make BENCHMARK=1)
+// ============================================================================
+// Runs once after init: the core benchmarks (benchmark.cpp), then what only
+// the hardware can measure, main loop iterations and full OLED frames, all
+// timed with the DWT cycle counter. Results go to the USB serial log; save
+// two captures and compare them with host/build/gg_bench --compare. Last,
+// the sleep residency of the real event loop, idle and as clock master.
+
+#include "benchmark.h"
+
+const uint32_t BENCH_NOTES_PER_CASE = 4000;
+const uint32_t BENCH_LOOP_ITERATIONS = 5000;  // ~5 s of main loop
+const int      BENCH_FRAMES = 32;
+const uint32_t BENCH_SLEEP_MS = 5000;
+
+BenchReport bench_report;
+
+uint32_t platform_cycles()
+{
+    return trace_now();
+}
+
+uint32_t platform_cycles_per_second()
+{
+    return SystemCoreClock;
+}
+
+// Run the event loop for ms and report the share of the time spent in WFI
+void bench_sleep_residency(const char* name, uint32_t ms)
+{
+    uint64_t slept_us = main_loop_sleep_us;
+    uint32_t wakes = main_loop_wakes;
+    uint32_t start_us = System::GetUs();
+    while(System::GetUs() - start_us < ms * 1000)
+        main_loop_pass(wait_for_main_events(display_busy()));
+    uint32_t elapsed_ms = (System::GetUs() - start_us) / 1000;
+    uint32_t permille = (uint32_t)((main_loop_sleep_us - slept_us) / elapsed_ms);
+    hw.seed.PrintLine("# sleep %-8s %3lu.%lu%% of %lu ms, %lu passes/s, capture %lu Hz", name,
+                      permille / 10, permille % 10, elapsed_ms,
+                      (main_loop_wakes - wakes) * 1000 / elapsed_ms,
+                      gate_capture_fast ? GATE_CAPTURE_RATE_HZ : GATE_CAPTURE_IDLE_RATE_HZ);
+}
+
+void run_firmware_benchmarks()
+{
+    hw.seed.StartLog(true);  // Wait for the serial monitor
+    hw.seed.PrintLine("GenerativeGenerator benchmark");
+
+    run_core_benchmarks(bench_report, BENCH_NOTES_PER_CASE);
+
+    // Main loop pass on a control tick as it runs on stage (without the
+    // sleep); max = worst-case control loop time
+    BenchTimer controls;
+    BenchTimer iteration;
+    controls.Reset();
+    iteration.Reset();
+    for(uint32_t i = 0; i < BENCH_LOOP_ITERATIONS; i++)
     {
-        // Blink LED while learning (on when note active)
-        hw.seed.SetLed(note_in_active);
+        iteration.Start();
+        service_midi_in();
+        controls.Start();
+        UpdateControls();
+        controls.Stop();
+        service_note_events();
+        service_midi_out();
+        service_lookahead();
+        service_rhythm();
+        service_persistence();
+        if(frame_counter++ > 33)
+        {
+            ScanDisplayState();
+            frame_counter = 0;
+        }
+        UpdateDisplay();
+        iteration.Stop();
+        System::Delay(1);
     }
-    else if(learning_state == STATE_GENERATING)
+    bench_add(bench_report, "loop.controls", controls);
+    bench_add(bench_report, "loop.iteration", iteration);
+
+    // Full OLED frame: every widget redrawn, then the blocking flush
+    BenchTimer frame;
+    BenchTimer flush;
+    frame.Reset();
+    flush.Reset();
+    for(int i = 0; i < BENCH_FRAMES; i++)
     {
-        // Pulse LED with clock when generating
-        hw.seed.SetLed(clock_pulse_indicator > 0);
+        ScanDisplayState();
+        display_full_redraw = true;
+        frame.Start();
+        do
+            UpdateDisplay();
+        while(display_busy());
+        frame.Stop();
+
+        flush.Start();
+        hw.display.Update();
+        flush.Stop();
     }
-    else
+    bench_add(bench_report, "display.frame", frame);
+    bench_add(bench_report, "display.flush", flush);
+
+    char line[BENCH_LINE_SIZE];
+    hw.seed.PrintLine("# name                      count avg_cycles max_cycles     avg_ns");
+    for(int i = 0; i < bench_report.count; i++)
     {
-        // IDLE: show gate input (clock on Gate 2)
-        hw.seed.SetLed(gate2_state);
+        bench_format(bench_report.results[i], line, sizeof(line));
+        hw.seed.PrintLine("%s", line);
     }
+
+    // Nothing patched and nothing playing (the capture timer is idle by
+    // now), then as clock master: fast capture, clock bytes out
+    bench_sleep_residency("idle", BENCH_SLEEP_MS);
+    uint8_t clock_out = clock_out_setting.load();
+    clock_out_setting.store(CLOCK_OUT_INTERNAL);
+    bench_sleep_residency("clock", BENCH_SLEEP_MS);
+    clock_out_setting.store(clock_out);
+
+    trace_reset();  // Start the field statistics clean
 }
+#endif
 
 int main(void)
 {
     // Initialize hardware
     hw.Init();
+    trace_init();  // DWT cycle counter for the hot-path trace points
     log_debug(DBG_STARTUP);
 
     // Start ADC for CV inputs (need this before reading pots)
     hw.StartAdc();
     System::Delay(100);  // Give ADC time to stabilize
 
+    // MIDI input: CC dispatch table, then interrupt-driven UART reception
+    init_cc_map();
+    hw.midi.StartReceive();
+
     // Read actual pot positions before initializing parameters
     hw.ProcessAnalogControls();
     for(int i = 0; i < PARAMS_PER_PAGE; i++)
@@ -1330,33 +3926,62 @@ int main(void)
     parameters[PARAM_ECHO_NOTES] = 0.0f;
     parameters_smoothed[PARAM_ECHO_NOTES] = 0.0f;
 
-    // Start audio
-    hw.StartAudio(AudioCallback);
+    // VOICE_COUNT: default to a single voice (0.0)
+    parameters[PARAM_VOICE_COUNT] = 0.0f;
+    parameters_smoothed[PARAM_VOICE_COUNT] = 0.0f;
+
+    // ENGINE: default to learned tendencies on every voice (0.0)
+    parameters[PARAM_ENGINE] = 0.0f;
+    parameters_smoothed[PARAM_ENGINE] = 0.0f;
+
+    // Restore the last saved session; a learned phrase resumes generating
+    if(persist_load())
+    {
+        if(phrase->tendencies_ready)
+        {
+            derive_parameters();
+            refresh_interval_sampler(true);
+            uint32_t seed = rng_session_seed();
+            for(int v = 0; v < MAX_VOICES; v++)
+                reset_voice(v, seed);
+            learning_state = STATE_GENERATING;
+        }
+    }
+
+    derive_parameters();
+    publish_control_snapshot(active_voice_count);
 
-    // Note: Full Daisy Patch doesn't have CV DAC outputs
-    // CV output is only available on Daisy Patch SM
-    // This module uses MIDI output instead (already implemented)
+    // Start timer-driven gate capture (edges are drained by the audio-rate
+    // scheduler) and the control tick
+    StartGateCapture();
+    StartControlTick();
+
+    // Start audio with a short block so scheduler latency stays small
+    hw.SetAudioBlockSize(AUDIO_BLOCK_SIZE);
+    audio_sample_rate = hw.AudioSampleRate();
+    audio_prev_block_us = System::GetUs();
+    hw.StartAudio(AudioCallback);
 
     // Display startup message
     hw.display.Fill(false);
     hw.display.SetCursor(20, 28);
-    std::string msg = "GENERATIVE";
-    hw.display.WriteString((char*)msg.c_str(), Font_7x10, true);
+    hw.display.WriteString((char*)"GENERATIVE", Font_7x10, true);
     hw.display.Update();
     System::Delay(1000);
 
-    // Main loop
-    while(1)
-    {
-        UpdateControls();
+    // Init is complete: no heap allocation is expected from here on
+    heap_alloc_count_at_init = heap_alloc_count;
 
-        // Update display at ~30Hz (every 33ms)
-        if(frame_counter++ > 33)
-        {
-            UpdateDisplay();
-            frame_counter = 0;
-        }
+    // Capture initial display state (first UpdateDisplay() does a full redraw)
+    ScanDisplayState();
 
-        System::Delay(1);
-    }
+#ifdef GG_BENCHMARK
+    run_firmware_benchmarks();
+#endif
+
+    // Main loop: sleep until an interrupt posts an event (see MAIN LOOP
+    // EVENTS), handle it, then the idle work; stays awake while the display
+    // has work left
+    while(1)
+        main_loop_pass(wait_for_main_events(display_busy()));
 }
@@ -0,0 +1,289 @@
+/**
+ * Generative Generator - benchmark suite
+ *
+ * Hardware-independent part of the benchmarks. See benchmark.h.
+ */
+
+#include "benchmark.h"
+#include "generator_core.h"
+#include <cstdio>
+
+// ============================================================================
+// RESULTS
+// ============================================================================
+
+void bench_add(BenchReport& report, const char* name, const BenchTimer& timer)
+{
+    if(report.count >= BENCH_MAX_RESULTS)
+        return;
+    BenchResult& result = report.results[report.count++];
+    result.name = name;
+    result.count = timer.count;
+    result.avg_cycles = timer.count ? (uint32_t)(timer.total / timer.count) : 0;
+    result.max_cycles = timer.max;
+}
+
+int bench_format(const BenchResult& result, char* line, size_t size)
+{
+    uint32_t rate = platform_cycles_per_second();
+    unsigned long avg_ns =
+        rate ? (unsigned long)((uint64_t)result.avg_cycles * 1000000000u / rate) : 0;
+    return snprintf(line, size, "%-24s %8lu %10lu %10lu %10lu", result.name,
+                    (unsigned long)result.count, (unsigned long)result.avg_cycles,
+                    (unsigned long)result.max_cycles, avg_ns);
+}
+
+// ============================================================================
+// CORE BENCHMARKS
+// ============================================================================
+
+const uint32_t BENCH_SEED = 0x5EED;
+
+// Built-in phrase (same as host/phrase.txt): rising and falling C major
+const uint8_t bench_phrase[] = {60, 64, 67, 69, 67, 64, 62, 60,
+                                62, 65, 69, 72, 71, 67, 64, 62};
+const int BENCH_PHRASE_LENGTH = sizeof(bench_phrase);
+
+// Inter-onset intervals (ms) played with it for the rhythm benchmarks
+const uint16_t bench_rhythm[] = {250, 250, 500, 125, 125, 250, 750, 250};
+const int BENCH_RHYTHM_LENGTH = sizeof(bench_rhythm) / sizeof(bench_rhythm[0]);
+
+// Parameter sweep: generate_next_note() under each setting
+struct BenchSetting {
+    ParamIndex param;
+    float      value;
+};
+
+struct BenchCase {
+    const char*   name;
+    CandidateMode mode;
+    int           setting_count;
+    BenchSetting  settings[3];
+    int           scale = SCALE_SELECT_CHROMATIC;
+    bool          fixed_point = false;  // FixedMath instead of the build's path
+};
+
+const BenchCase bench_cases[] = {
+    {"gen.default",          CANDIDATE_WEIGHTED, 0, {}},
+    {"gen.memory_0",         CANDIDATE_WEIGHTED, 1, {{PARAM_MEMORY, 0.0f}}},
+    {"gen.memory_1",         CANDIDATE_WEIGHTED, 1, {{PARAM_MEMORY, 1.0f}}},
+    {"gen.energy_0",         CANDIDATE_WEIGHTED, 1, {{PARAM_ENERGY, 0.0f}}},
+    {"gen.energy_1",         CANDIDATE_WEIGHTED, 1, {{PARAM_ENERGY, 1.0f}}},
+    {"gen.range_max",        CANDIDATE_WEIGHTED, 1, {{PARAM_RANGE_WIDTH, 1.0f}}},
+    {"gen.worst",            CANDIDATE_WEIGHTED, 3,
+     {{PARAM_MEMORY, 0.0f}, {PARAM_ENERGY, 1.0f}, {PARAM_RANGE_WIDTH, 1.0f}}},
+    {"gen.rejection",        CANDIDATE_REJECTION, 0, {}},
+    {"gen.rejection_memory_0", CANDIDATE_REJECTION, 1, {{PARAM_MEMORY, 0.0f}}},
+    {"gen.markov1",          CANDIDATE_WEIGHTED, 1, {{PARAM_ENGINE, 0.3f}}},
+    {"gen.markov3",          CANDIDATE_WEIGHTED, 1, {{PARAM_ENGINE, 0.7f}}},
+    {"gen.scale_auto",       CANDIDATE_WEIGHTED, 0, {}, SCALE_SELECT_AUTO},
+    {"gen.scale_rejection",  CANDIDATE_REJECTION, 0, {}, SCALE_SELECT_AUTO},
+    {"gen.scale_markov3",    CANDIDATE_WEIGHTED, 1, {{PARAM_ENGINE, 0.7f}}, SCALE_SELECT_AUTO},
+    {"gen.fixed",            CANDIDATE_WEIGHTED, 0, {}, SCALE_SELECT_CHROMATIC, true},
+    {"gen.fixed_worst",      CANDIDATE_WEIGHTED, 3,
+     {{PARAM_MEMORY, 0.0f}, {PARAM_ENERGY, 1.0f}, {PARAM_RANGE_WIDTH, 1.0f}}, SCALE_SELECT_CHROMATIC, true},
+    {"gen.fixed_rejection",  CANDIDATE_REJECTION, 0, {}, SCALE_SELECT_CHROMATIC, true},
+    {"gen.fixed_markov3",    CANDIDATE_WEIGHTED, 1, {{PARAM_ENGINE, 0.7f}}, SCALE_SELECT_CHROMATIC, true},
+    {"gen.fixed_scale_auto", CANDIDATE_WEIGHTED, 0, {}, SCALE_SELECT_AUTO, true},
+};
+const int BENCH_CASE_COUNT = sizeof(bench_cases) / sizeof(bench_cases[0]);
+
+// State put back after the run (the slot is copied whole: 4 KB)
+PhraseSlot bench_saved_phrase;
+float bench_saved_parameters[TOTAL_PARAMS];
+
+// Learn the built-in phrase into the active slot and start generating
+void bench_learn_phrase()
+{
+    learning_state = STATE_LEARNING;
+    phrase_injecting = false;
+    reset_corpus();
+    for(int i = 0; i < BENCH_PHRASE_LENGTH; i++)
+        corpus_add_note(bench_phrase[i]);
+    begin_generating(BENCH_SEED);
+}
+
+void bench_generator(BenchReport& report, const BenchCase& bench, uint32_t notes)
+{
+    default_parameters();
+    for(int i = 0; i < bench.setting_count; i++)
+        parameters_smoothed[bench.settings[i].param] = bench.settings[i].value;
+    candidate_mode = bench.mode;
+    scale_select = bench.scale;
+    apply_parameters();
+    begin_generating(BENCH_SEED);
+
+    BenchTimer timer;
+    timer.Reset();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        int v = (int)(i & 3);
+        timer.Start();
+        uint8_t note = bench.fixed_point ? generate_next_note_with<FixedMath>(v)
+                                         : generate_next_note(v);
+        timer.Stop();
+        voices.current_note[v] = note;
+    }
+    bench_add(report, bench.name, timer);
+}
+
+void bench_learning(BenchReport& report, uint32_t notes)
+{
+    BenchTimer timer;
+
+    // Learning a phrase note by note (analysis + Markov update)
+    timer.Reset();
+    learning_state = STATE_LEARNING;
+    reset_corpus();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        timer.Start();
+        corpus_add_note(bench_phrase[i % BENCH_PHRASE_LENGTH]);
+        timer.Stop();
+    }
+    bench_add(report, "learn.note", timer);
+
+    // Injected notes also rebuild the sampler
+    timer.Reset();
+    learning_state = STATE_GENERATING;
+    begin_injection();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        timer.Start();
+        corpus_add_note(bench_phrase[i % BENCH_PHRASE_LENGTH]);
+        timer.Stop();
+    }
+    phrase_injecting = false;
+    bench_add(report, "learn.inject_note", timer);
+
+    timer.Reset();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        timer.Start();
+        analyze_learned_notes();
+        timer.Stop();
+    }
+    bench_add(report, "analyze.publish", timer);
+
+    timer.Reset();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        timer.Start();
+        refresh_interval_sampler(true);
+        timer.Stop();
+    }
+    bench_add(report, "sampler.rebuild", timer);
+
+    // Rhythm learned alongside the notes (onset + release), then drawn
+    timer.Reset();
+    uint32_t time_ms = 0;
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        uint8_t note = bench_phrase[i % BENCH_PHRASE_LENGTH];
+        uint16_t ioi = bench_rhythm[i % BENCH_RHYTHM_LENGTH];
+        timer.Start();
+        rhythm_learn_onset(time_ms, note, (uint8_t)(64 + (i & 63)));
+        rhythm_learn_release(time_ms + ioi / 2, note);
+        timer.Stop();
+        time_ms += ioi;
+    }
+    bench_add(report, "learn.rhythm", timer);
+
+    timer.Reset();
+    for(uint32_t i = 0; i < notes; i++)
+    {
+        timer.Start();
+        RhythmStep step = draw_rhythm_step();
+        timer.Stop();
+        (void)step;
+    }
+    bench_add(report, "rhythm.draw", timer);
+}
+
+void bench_control(BenchReport& report, uint32_t iterations)
+{
+    BenchTimer timer;
+    default_parameters();
+    bench_learn_phrase();
+
+    // Steady control tick: nothing moved
+    timer.Reset();
+    for(uint32_t i = 0; i < iterations; i++)
+    {
+        timer.Start();
+        apply_parameters();
+        timer.Stop();
+    }
+    bench_add(report, "control.apply", timer);
+
+    // MOTION moving every tick: the sampler is reshaped each time
+    timer.Reset();
+    for(uint32_t i = 0; i < iterations; i++)
+    {
+        parameters_smoothed[PARAM_MOTION] = (i & 1) ? 0.2f : 0.8f;
+        timer.Start();
+        apply_parameters();
+        timer.Stop();
+    }
+    bench_add(report, "control.apply_reshape", timer);
+
+    // Worst-case lookahead work: every queue of 8 voices regenerated
+    bool lookahead_was_enabled = lookahead_enabled;
+    lookahead_enabled = true;
+    default_parameters();
+    parameters_smoothed[PARAM_VOICE_COUNT] = 1.0f;
+    apply_parameters();
+    begin_generating(BENCH_SEED);
+    timer.Reset();
+    for(uint32_t i = 0; i < iterations; i++)
+    {
+        for(int v = 0; v < MAX_VOICES; v++)
+            lookahead_retract(v, 0);
+        timer.Start();
+        service_lookahead();
+        timer.Stop();
+    }
+    bench_add(report, "lookahead.refill_8v", timer);
+    lookahead_enabled = lookahead_was_enabled;
+}
+
+void run_core_benchmarks(BenchReport& report, uint32_t notes_per_case)
+{
+    // Save what the run overwrites
+    bench_saved_phrase = *phrase;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        bench_saved_parameters[i] = parameters_smoothed[i];
+    LearningState saved_state = learning_state;
+    CandidateMode saved_mode = candidate_mode;
+    int saved_scale = scale_select;
+    uint32_t saved_seed = rng_fixed_seed;
+    rng_fixed_seed = BENCH_SEED;  // Identical note sequence every run
+
+    report.count = 0;
+    bench_learning(report, notes_per_case / 4);
+    bench_learn_phrase();
+    for(int i = 0; i < BENCH_CASE_COUNT; i++)
+        bench_generator(report, bench_cases[i], notes_per_case);
+    scale_select = SCALE_SELECT_CHROMATIC;
+    bench_control(report, notes_per_case / 16);
+
+    // Restore
+    *phrase = bench_saved_phrase;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        parameters_smoothed[i] = bench_saved_parameters[i];
+    candidate_mode = saved_mode;
+    scale_select = saved_scale;
+    rng_fixed_seed = saved_seed;
+    apply_parameters();
+    refresh_interval_sampler(true);  // Back to the restored phrase's shape
+    if(phrase->tendencies_ready && saved_state == STATE_GENERATING)
+    {
+        begin_generating(rng_session_seed());
+    }
+    else
+    {
+        for(int v = 0; v < MAX_VOICES; v++)
+            lookahead_clear(v);
+        learning_state = saved_state;
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * Generative Generator - benchmark suite
+ *
+ * Cycle counts for the generator core, shared by the on-target benchmark
+ * build (make BENCHMARK=1, DWT cycle counter, results on the USB serial log)
+ * and the host benchmark (host/build/gg_bench). Every result is one line
+ *
+ *   <name> <count> <avg_cycles> <max_cycles> <avg_ns>
+ *
+ * so two runs of the same platform can be compared line by line
+ * (gg_bench --compare old.txt new.txt).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// ============================================================================
+// PLATFORM HOOKS
+// ============================================================================
+
+// Free-running cycle counter (DWT->CYCCNT on the Daisy, TSC on the host) and
+// its rate; deltas are taken modulo 2^32
+uint32_t platform_cycles();
+uint32_t platform_cycles_per_second();
+
+// ============================================================================
+// RESULTS
+// ============================================================================
+
+#define BENCH_MAX_RESULTS 32
+#define BENCH_LINE_SIZE 80
+
+struct BenchResult {
+    const char* name;
+    uint32_t count;        // Operations measured
+    uint32_t avg_cycles;
+    uint32_t max_cycles;
+};
+
+struct BenchReport {
+    BenchResult results[BENCH_MAX_RESULTS];
+    int count;
+};
+
+// Accumulates one operation type; time each call between Start() and Stop()
+struct BenchTimer {
+    uint64_t total;
+    uint32_t max;
+    uint32_t count;
+    uint32_t start;
+
+    void Reset() { total = 0; max = 0; count = 0; }
+    void Start() { start = platform_cycles(); }
+    void Stop()
+    {
+        uint32_t cycles = platform_cycles() - start;
+        total += cycles;
+        if(cycles > max)
+            max = cycles;
+        count++;
+    }
+};
+
+void bench_add(BenchReport& report, const char* name, const BenchTimer& timer);
+
+// Result as one report line (no newline); returns its length
+int bench_format(const BenchResult& result, char* line, size_t size);
+
+// ============================================================================
+// CORE BENCHMARKS
+// ============================================================================
+
+// Learns the built-in phrase, then times generate_next_note() across the
+// parameter sweeps, learning/analysis, sampler rebuilds, lookahead refills
+// and the core part of the control tick. Parameters, the active phrase slot
+// and the generation state are restored afterwards.
+void run_core_benchmarks(BenchReport& report, uint32_t notes_per_case);
@@ -0,0 +1,1767 @@
+/**
+ * Generative Generator - generator core
+ *
+ * Hardware-independent learning, analysis and generation. See generator_core.h.
+ */
+
+#include "generator_core.h"
+
+// ============================================================================
+// GENERATOR INPUTS
+// ============================================================================
+
+float parameters_smoothed[TOTAL_PARAMS];
+
+// Firmware defaults with every pot centered (host builds and benchmarks;
+// the firmware starts page 0 from the actual pot positions instead)
+void default_parameters()
+{
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        parameters_smoothed[i] = 0.5f;
+    parameters_smoothed[PARAM_LEARN_TIMEOUT] = 0.158f;  // 2 s
+    parameters_smoothed[PARAM_ECHO_NOTES] = 0.0f;
+    parameters_smoothed[PARAM_VOICE_COUNT] = 0.0f;      // One voice
+    parameters_smoothed[PARAM_ENGINE] = 0.0f;           // Tendency engine
+}
+
+// ============================================================================
+// NOTE LEARNING SYSTEM
+// ============================================================================
+
+LearningState learning_state = STATE_IDLE;
+bool phrase_injecting = false;     // New phrase arriving while GENERATING
+
+// ============================================================================
+// TENDENCY ANALYSIS (extracted from learned notes)
+// ============================================================================
+// Statistics are accumulated online as each note arrives (O(1) per note), as
+// exponentially decayed counts: before a note is added every weight is scaled
+// by a per-note decay set by FORGETFULNESS. A phrase injected while
+// generating therefore blends into the fading corpus instead of replacing it,
+// and the cost stays constant however long the corpus grows.
+
+// Phrase bank: every learned phrase keeps its own corpus and its complete
+// analysis (tendency accumulators, published tendencies, Markov table), so
+// switching phrases only moves the `phrase` pointer. Learning, analysis and
+// generation always work on the active slot.
+PhraseSlot phrase_bank[PHRASE_SLOTS];
+PhraseSlot* phrase = &phrase_bank[0];            // Active slot
+int phrase_slot = 0;
+
+// Notes currently held in the corpus
+int corpus_count()
+{
+    return (phrase->note_buffer_written < LEARN_CORPUS_SIZE) ? (int)phrase->note_buffer_written
+                                                            : LEARN_CORPUS_SIZE;
+}
+
+// Corpus note by age (0 = most recent)
+uint8_t corpus_note(int age)
+{
+    return phrase->note_buffer[(phrase->note_buffer_written - 1 - age) & (LEARN_CORPUS_SIZE - 1)];
+}
+
+// Forget everything learned
+void reset_tendency_analysis()
+{
+    phrase->tendency_acc = TendencyAccumulator();
+    phrase->tendencies = LearnedTendencies();
+    phrase->rhythm = RhythmAccumulator();
+}
+
+// Start analyzing a new phrase: its first note is not an interval from the
+// previous phrase, its register extent starts fresh and its first onset
+// has no interval
+void begin_phrase_analysis()
+{
+    phrase->tendency_acc.phrase_notes = 0;
+    phrase->rhythm.onset_valid = false;
+    phrase->rhythm.note_held = false;
+}
+
+// Weight kept by every earlier note each time a new one arrives
+float forget_decay_per_note()
+{
+    const float max_octaves = log2f((float)LEARN_CORPUS_SIZE / FORGET_HALF_LIFE_MIN);
+    float half_life = (float)LEARN_CORPUS_SIZE
+                      * exp2f(-parameters_smoothed[PARAM_FORGETFULNESS] * max_octaves);
+    return exp2f(-1.0f / half_life);
+}
+
+// Fade everything learned so far by one note's worth of forgetting
+void decay_tendency_analysis(float decay)
+{
+    for(int i = 0; i < INTERVAL_HISTOGRAM_SIZE; i++)
+        phrase->tendency_acc.interval_weight[i] *= decay;
+    phrase->tendency_acc.ascending *= decay;
+    phrase->tendency_acc.descending *= decay;
+    phrase->tendency_acc.repeat *= decay;
+    for(int i = 0; i < PITCH_CLASSES; i++)
+        phrase->tendency_acc.pitch_class_weight[i] *= decay;
+    phrase->tendency_acc.note_sum *= decay;
+    phrase->tendency_acc.note_weight *= decay;
+}
+
+// Publish tendencies from the accumulator (fixed cost, independent of phrase length)
+void analyze_learned_notes()
+{
+    const TendencyAccumulator& acc = phrase->tendency_acc;
+
+    phrase->tendencies.total_intervals = 0.0f;
+    for(int i = 0; i < INTERVAL_HISTOGRAM_SIZE; i++)
+    {
+        phrase->tendencies.interval_counts[i] = acc.interval_weight[i];
+        phrase->tendencies.total_intervals += acc.interval_weight[i];
+    }
+    phrase->tendencies.ascending_count = acc.ascending;
+    phrase->tendencies.descending_count = acc.descending;
+    phrase->tendencies.repeat_count = acc.repeat;
+
+    if(acc.note_weight > 0.0f)
+        phrase->tendencies.register_center = acc.note_sum / acc.note_weight;
+    if(acc.phrase_notes > 0)
+    {
+        phrase->tendencies.register_min = acc.phrase_min;
+        phrase->tendencies.register_max = acc.phrase_max;
+        phrase->tendencies.register_range = acc.phrase_max - acc.phrase_min;
+    }
+
+    // Find most common intervals
+    float max_count = 0.0f;
+    float second_max_count = 0.0f;
+    phrase->tendencies.most_common_interval = 0;
+    phrase->tendencies.second_common_interval = 0;
+
+    for(int i = 0; i <= MAX_INTERVAL; i++)
+    {
+        if(phrase->tendencies.interval_counts[i] > max_count)
+        {
+            second_max_count = max_count;
+            phrase->tendencies.second_common_interval = phrase->tendencies.most_common_interval;
+            max_count = phrase->tendencies.interval_counts[i];
+            phrase->tendencies.most_common_interval = i;
+        }
+        else if(phrase->tendencies.interval_counts[i] > second_max_count)
+        {
+            second_max_count = phrase->tendencies.interval_counts[i];
+            phrase->tendencies.second_common_interval = i;
+        }
+    }
+    phrase->tendencies.scale_fitted = false;
+}
+
+// Fold one incoming note into the statistics and republish them
+void analyze_note(uint8_t note)
+{
+    TendencyAccumulator& acc = phrase->tendency_acc;
+
+    decay_tendency_analysis(forget_decay_per_note());
+
+    if(acc.phrase_notes > 0)
+    {
+        int interval = note - acc.previous_note;
+
+        // Count direction
+        if(interval > 0)
+            acc.ascending += 1.0f;
+        else if(interval < 0)
+            acc.descending += 1.0f;
+        else
+            acc.repeat += 1.0f;
+
+        // Count interval size (use absolute value, cap at histogram range)
+        int interval_size = abs(interval);
+        if(interval_size > MAX_INTERVAL) interval_size = MAX_INTERVAL;
+        acc.interval_weight[interval_size] += 1.0f;
+
+        if(note < acc.phrase_min) acc.phrase_min = note;
+        if(note > acc.phrase_max) acc.phrase_max = note;
+    }
+    else
+    {
+        acc.phrase_min = note;
+        acc.phrase_max = note;
+    }
+
+    acc.pitch_class_weight[note % PITCH_CLASSES] += 1.0f;
+    acc.note_sum += note;
+    acc.note_weight += 1.0f;
+    acc.previous_note = note;
+    acc.phrase_notes++;
+
+    analyze_learned_notes();
+}
+
+// Scale intervals above the root, as pitch class bits
+const uint16_t scale_template_mask[SCALE_TEMPLATE_COUNT] = {
+    0xAB5,  // Major: 0 2 4 5 7 9 11
+    0x5AD,  // Natural minor: 0 2 3 5 7 8 10
+    0x9AD,  // Harmonic minor: 0 2 3 5 7 8 11
+    0x6AD,  // Dorian: 0 2 3 5 7 9 10
+    0x295,  // Major pentatonic: 0 2 4 7 9
+    0x4A9   // Minor pentatonic: 0 3 5 7 10
+};
+
+const char* const scale_template_names[SCALE_TEMPLATE_COUNT] = {
+    "MAJ", "MIN", "HMIN", "DOR", "PENT", "MPNT"
+};
+
+const char* const pitch_class_names[PITCH_CLASSES] = {
+    "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+};
+
+// Fit weights: the share of learned weight inside the scale, less a small
+// cost per scale note (a pentatonic phrase is not called major) plus a bonus
+// for weight on the root and its fifth (C major and A minor hold the same
+// notes, the tonic triad tells them apart)
+const float SCALE_FIT_NOTE_COST = 0.02f;
+const float SCALE_FIT_ROOT_BONUS = 0.05f;
+
+inline uint16_t rotate_pitch_classes(uint16_t mask, int root)
+{
+    return (uint16_t)(((mask << root) | (mask >> (PITCH_CLASSES - root))) & 0xFFF);
+}
+
+// Best root per template, and the best template overall. Run on demand by
+// scale_key_for() after the tendencies changed, not per analyzed note:
+// chromatic generation never pays for it.
+void fit_scale(LearnedTendencies& tendencies, const TendencyAccumulator& acc)
+{
+    tendencies.scale_fitted = true;
+    float total = 0.0f;
+    for(int pc = 0; pc < PITCH_CLASSES; pc++)
+        total += acc.pitch_class_weight[pc];
+    float norm = (total > 0.0f) ? 1.0f / total : 0.0f;
+
+    float best_score = -1.0f;
+    tendencies.scale_template = SCALE_MAJOR;
+    tendencies.scale_root = 0;
+    for(int t = 0; t < SCALE_TEMPLATE_COUNT; t++)
+    {
+        float size_cost = SCALE_FIT_NOTE_COST * (float)__builtin_popcount(scale_template_mask[t]);
+        float template_best = -1.0f;
+        tendencies.template_root[t] = 0;
+        for(int root = 0; root < PITCH_CLASSES; root++)
+        {
+            uint16_t mask = rotate_pitch_classes(scale_template_mask[t], root);
+            float inside = 0.0f;
+            for(uint32_t m = mask; m != 0; m &= m - 1)
+                inside += acc.pitch_class_weight[__builtin_ctz(m)];
+            float tonic = acc.pitch_class_weight[root]
+                          + acc.pitch_class_weight[(root + 7) % PITCH_CLASSES];
+            float score = (inside + SCALE_FIT_ROOT_BONUS * tonic) * norm;
+            if(score > template_best)
+            {
+                template_best = score;
+                tendencies.template_root[t] = (uint8_t)root;
+            }
+        }
+        if(template_best - size_cost > best_score)
+        {
+            best_score = template_best - size_cost;
+            tendencies.scale_template = (uint8_t)t;
+            tendencies.scale_root = tendencies.template_root[t];
+        }
+    }
+}
+
+// ============================================================================
+// DERIVED PARAMETERS (computed once per control tick)
+// ============================================================================
+// ENERGY is a macro that pushes several parameters at once. Instead of every
+// generator helper re-deriving its own energy offset and clamp per note, the
+// control loop computes all effective values once per tick after smoothing,
+// from a single coupling table, into one cache-line sized block.
+
+const EnergyCoupling energy_couplings[DERIVED_COUNT] = {
+    {PARAM_MOTION, 0.3f},       // Energy adds up to ±0.3
+    {PARAM_MEMORY, -0.3f},      // Energy biases toward novelty
+    {PARAM_REGISTER, -0.3f},    // Energy reduces gravity
+    {PARAM_RANGE_WIDTH, 0.3f},  // Energy adds up to ±0.3
+    {PARAM_PHRASE, 0.2f}        // Energy adds up to ±0.2
+};
+
+DerivedParams derived;
+
+// Recompute the derived block from parameters_smoothed (control loop context)
+void derive_parameters()
+{
+    // Energy centered at 0.5 = neutral, deviations scale effects
+    float energy_deviation = (parameters_smoothed[PARAM_ENERGY] - 0.5f) * 2.0f;  // -1.0 to +1.0
+
+    for(int i = 0; i < DERIVED_COUNT; i++)
+    {
+        const EnergyCoupling& coupling = energy_couplings[i];
+        derived.value[i] = clamp01(parameters_smoothed[coupling.source] +
+                                   energy_deviation * coupling.energy_scale);
+    }
+
+    // Direction: 0.0 = all down, 0.5 = neutral, 1.0 = all up
+    float direction_bias = parameters_smoothed[PARAM_DIRECTION];
+    derived.direction_blend = fabsf(direction_bias - 0.5f) * 2.0f;
+    derived.direction_target = (direction_bias > 0.5f) ? 1.0f : 0.0f;
+
+    derived.phrase_target_length =
+        (int32_t)(4.0f + derived.value[DERIVED_PHRASE] * 28.0f);  // 4 to 32 range
+}
+
+// Slope of the memory weight per repeat, as FloatMath::memory_weight()
+// applies it: -1.0 (avoid) below MEMORY 0.4, 0 up to 0.6, +1.0 (favor) above
+float memory_bias_for(float memory_param)
+{
+    if(memory_param < 0.4f)
+        return -(0.4f - memory_param) / 0.4f;
+    if(memory_param > 0.6f)
+        return (memory_param - 0.6f) / 0.4f;
+    return 0.0f;
+}
+
+// ============================================================================
+// CONTROL SNAPSHOT (control context -> generator / audio callback)
+// ============================================================================
+// parameters[], parameters_smoothed[] and derived are rewritten piecemeal by
+// the pot and CC paths during a control tick. Everything the generator reads
+// is published once per tick as one double-buffered snapshot: the control
+// loop fills the inactive copy, then flips the active index (release). A
+// reader takes the active copy (acquire) and sees one whole tick. Readers in
+// the audio interrupt cannot be preempted by the control loop, so the copy
+// they hold is never the one being rewritten; no locks, no interrupt masking.
+
+ControlSnapshot control_snapshots[2];
+std::atomic<int> control_snapshot_active{0};
+
+// Control context: publish this tick's values
+void publish_control_snapshot(int voice_count)
+{
+    int next = 1 - control_snapshot_active.load(std::memory_order_relaxed);
+    ControlSnapshot& snapshot = control_snapshots[next];
+    snapshot.derived = derived;
+    for(int i = 0; i < DERIVED_COUNT; i++)
+        snapshot.fixed.value[i] = q16_from_float(derived.value[i]);
+    snapshot.fixed.direction_blend = q16_from_float(derived.direction_blend);
+    snapshot.fixed.direction_target = q16_from_float(derived.direction_target);
+    snapshot.fixed.memory_bias = q16_from_float(memory_bias_for(derived.value[DERIVED_MEMORY]));
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        snapshot.smoothed[i] = parameters_smoothed[i];
+    snapshot.active_voice_count = voice_count;
+    control_snapshot_active.store(next, std::memory_order_release);
+}
+
+// ============================================================================
+// NOTE GENERATION SYSTEM
+// ============================================================================
+
+// ============================================================================
+// GENERATOR VOICES (struct-of-arrays)
+// ============================================================================
+// Every voice runs the same pipeline over the shared LearnedTendencies,
+// interval sampler and derived parameters, with its own RNG stream, note
+// history and phrase counters. State is kept as parallel arrays indexed by
+// voice, so stepping all voices on one clock edge stays cheap. Voice v
+// plays on MIDI channel v+1; voice 0 also drives the pitch display.
+
+GeneratorVoices voices;
+int active_voice_count = 1;  // Voices stepped per trigger (VOICES parameter)
+
+// ============================================================================
+// RANDOM NUMBER GENERATION
+// ============================================================================
+// Every voice owns a xoshiro128++ stream. Values are not drawn one at a time:
+// rng_fill() steps the RNG_LANES lanes together and writes RNG_POOL_SIZE
+// values into the voice's pool, and draws just read the next pool entry. The
+// lane loop has no carried dependency, so host builds vectorize it and the M7
+// keeps both issue slots busy. The pool is a pure function of rng_pool_base,
+// so a lookahead undo only needs (base, index) to rewind a voice exactly.
+//
+// Deterministic seed mode: with rng_fixed_seed != 0 (build with
+// -DRNG_FIXED_SEED=n, or set it before seeding) every voice reset uses that
+// seed and phrase-boundary reseeds stop mixing in the clock, so a run with the
+// same input replays note for note.
+
+uint32_t rng_fixed_seed = RNG_FIXED_SEED;
+
+inline uint32_t rotl32(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+// SplitMix32: expands one seed word into well-mixed state words
+inline uint32_t splitmix32(uint32_t& x)
+{
+    uint32_t z = (x += 0x9E3779B9u);
+    z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+    z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+    return z ^ (z >> 16);
+}
+
+// Block fill: refill voice v's pool from its stream
+void rng_fill(int v)
+{
+    RngStream& s = voices.rng_stream[v];
+    uint32_t* out = voices.rng_pool[v];
+    voices.rng_pool_base[v] = s;
+
+    for(int i = 0; i < RNG_POOL_SIZE; i += RNG_LANES)
+    {
+        for(int l = 0; l < RNG_LANES; l++)
+        {
+            uint32_t result = rotl32(s.s0[l] + s.s3[l], 7) + s.s0[l];
+            uint32_t t = s.s1[l] << 9;
+            s.s2[l] ^= s.s0[l];
+            s.s3[l] ^= s.s1[l];
+            s.s1[l] ^= s.s2[l];
+            s.s0[l] ^= s.s3[l];
+            s.s2[l] ^= t;
+            s.s3[l] = rotl32(s.s3[l], 11);
+            out[i + l] = result;
+        }
+    }
+    voices.rng_pool_index[v] = 0;
+}
+
+// Seed a voice's stream (a xoshiro lane must never be all zero)
+void seed_voice_rng(int v, uint32_t seed)
+{
+    seed ^= (uint32_t)(v + 1) * 0x9E3779B9u;  // Decorrelate voices
+    RngStream& s = voices.rng_stream[v];
+    for(int l = 0; l < RNG_LANES; l++)
+    {
+        s.s0[l] = splitmix32(seed);
+        s.s1[l] = splitmix32(seed);
+        s.s2[l] = splitmix32(seed);
+        s.s3[l] = splitmix32(seed);
+        if((s.s0[l] | s.s1[l] | s.s2[l] | s.s3[l]) == 0)
+            s.s0[l] = 0x9E3779B9u;
+    }
+    rng_fill(v);
+}
+
+// Add note to history buffer (circular buffer)
+// Keeps the per-pitch counters in step: the evicted note is decremented
+void add_note_to_history(int v, uint8_t note)
+{
+    note &= 0x7F;
+    if(voices.history_count[v] == NOTE_HISTORY_SIZE)
+        voices.history_pitch_count[v][voices.history[v][voices.history_index[v]]]--;
+    else
+        voices.history_count[v]++;
+
+    voices.history[v][voices.history_index[v]] = note;
+    voices.history_pitch_count[v][note]++;
+    voices.history_index[v] = (voices.history_index[v] + 1) % NOTE_HISTORY_SIZE;
+}
+
+// Empty the history (and its counters)
+void clear_note_history(int v)
+{
+    voices.history_count[v] = 0;
+    voices.history_index[v] = 0;
+    for(int i = 0; i < NOTE_HISTORY_SIZE; i++)
+        voices.history[v][i] = 0;
+    for(int i = 0; i < 128; i++)
+        voices.history_pitch_count[v][i] = 0;
+}
+
+// Check if note appears in recent history
+// Returns count of how many times it appears (0-NOTE_HISTORY_SIZE), O(1)
+int count_in_history(int v, uint8_t note)
+{
+    return voices.history_pitch_count[v][note & 0x7F];
+}
+
+// Memory weight of a note that appears history_count times in recent history
+// 1.0 = neutral, below 1.0 = avoid repeats, above 1.0 = favor repeats
+float FloatMath::memory_weight(const DerivedParams& params, int history_count)
+{
+    // MEMORY with energy applied (0.0 = avoid repeats, 0.5 = neutral, 1.0 = favor repeats)
+    // High energy = seek more novelty (reduce memory toward 0.0)
+    float memory_param = params.value[DERIVED_MEMORY];
+    float weight = 1.0f;
+
+    if(memory_param < 0.4f)
+    {
+        // Low memory: Avoid repeats (seek novelty)
+        // The more the note appears in history, the lower the weight
+        float avoidance = (0.4f - memory_param) / 0.4f;  // 0.0 to 1.0
+        weight = 1.0f - (avoidance * history_count / NOTE_HISTORY_SIZE);
+    }
+    else if(memory_param > 0.6f)
+    {
+        // High memory: Favor repeats
+        // The more the note appears in history, the higher the weight
+        float favoritism = (memory_param - 0.6f) / 0.4f;  // 0.0 to 1.0
+        weight = 1.0f + (favoritism * history_count / NOTE_HISTORY_SIZE);
+    }
+    // else: neutral range (0.4-0.6), weight = 1.0 (ignore history)
+
+    return weight > 0.0f ? weight : 0.0f;
+}
+
+// Apply memory bias to note acceptance (rejection mode)
+// Returns true if note should be accepted, false if it should be rejected
+template <class M>
+bool apply_memory_bias(int v, uint8_t candidate_note)
+{
+    // Check if note is in recent history
+    int history_count = count_in_history(v, candidate_note);
+
+    // If note not in history, always accept
+    if(history_count == 0)
+        return true;
+
+    // Acceptance probability is the memory weight, clamped to 1.0
+    // (so favoring repeats can only stop rejecting them, not boost them)
+    typename M::value_t acceptance_probability =
+        M::memory_weight(M::params(control_snapshot()), history_count);
+    if(acceptance_probability > M::k(1.0f)) acceptance_probability = M::k(1.0f);
+
+    // Accept or reject based on probability
+    return M::random(v) < acceptance_probability;
+}
+
+// ============================================================================
+// RHYTHM ANALYSIS (learned timing, sampled by the self-clocked mode)
+// ============================================================================
+// Learning records each note's inter-onset interval (IOI: time since the
+// previous onset of the same phrase), its duration (onset to release, or to
+// the next onset when notes overlap) and its velocity into the slot's
+// histograms. Times are binned on a log scale (constant relative resolution
+// at any tempo) and every bin also sums its times, so a drawn time is the
+// bin's mean: a learned 250 ms comes back as 250 ms, not as a bin center.
+// Histograms are decayed with the same per-note forgetting as the pitch
+// tendencies.
+//
+// A draw picks each of the three independently in proportion to its
+// weights (a scan of at most RHYTHM_TIME_BINS bins) from its own stream, so
+// sampling rhythm never moves a voice's pitch stream or its lookahead.
+
+const float RHYTHM_DEFAULT_IOI_MS = 500.0f;   // Before any interval is learned
+const uint8_t RHYTHM_DEFAULT_VELOCITY = 100;
+
+uint32_t rhythm_rng = 1;
+
+// Bin of a time in ms (clamped to the histogram)
+int rhythm_time_bin(float ms)
+{
+    if(ms <= RHYTHM_MIN_MS)
+        return 0;
+    int bin = (int)(log2f(ms / RHYTHM_MIN_MS) * (float)RHYTHM_BINS_PER_OCTAVE + 0.5f);
+    return bin < RHYTHM_TIME_BINS ? bin : RHYTHM_TIME_BINS - 1;
+}
+
+// Center time of a bin in ms
+float rhythm_bin_ms(int bin)
+{
+    return RHYTHM_MIN_MS * exp2f((float)bin / (float)RHYTHM_BINS_PER_OCTAVE);
+}
+
+// Mean time of a drawn bin (its center if the weight has decayed away)
+inline float rhythm_mean_ms(const float* weight, const float* ms_sum, int bin)
+{
+    return (weight[bin] > 1e-6f) ? ms_sum[bin] / weight[bin] : rhythm_bin_ms(bin);
+}
+
+void rhythm_learn_onset(uint32_t time_ms, uint8_t note, uint8_t velocity)
+{
+    RhythmAccumulator& acc = phrase->rhythm;
+
+    float decay = forget_decay_per_note();
+    for(int i = 0; i < RHYTHM_TIME_BINS; i++)
+    {
+        acc.ioi_weight[i] *= decay;
+        acc.ioi_ms_sum[i] *= decay;
+        acc.duration_weight[i] *= decay;
+        acc.duration_ms_sum[i] *= decay;
+    }
+    for(int i = 0; i < RHYTHM_VELOCITY_BINS; i++)
+        acc.velocity_weight[i] *= decay;
+
+    if(acc.onset_valid)
+    {
+        float ioi_ms = (float)(time_ms - acc.last_onset_ms);
+        int ioi_bin = rhythm_time_bin(ioi_ms);
+        acc.ioi_weight[ioi_bin] += 1.0f;
+        acc.ioi_ms_sum[ioi_bin] += ioi_ms;
+        if(acc.note_held)
+        {
+            // Legato: the previous note lasted until this one
+            acc.duration_weight[ioi_bin] += 1.0f;
+            acc.duration_ms_sum[ioi_bin] += ioi_ms;
+        }
+    }
+    acc.velocity_weight[(velocity & 0x7F) * RHYTHM_VELOCITY_BINS / 128] += 1.0f;
+
+    acc.last_onset_ms = time_ms;
+    acc.held_note = note;
+    acc.onset_valid = true;
+    acc.note_held = true;
+}
+
+void rhythm_learn_release(uint32_t time_ms, uint8_t note)
+{
+    RhythmAccumulator& acc = phrase->rhythm;
+    if(!acc.note_held || note != acc.held_note)
+        return;
+    float duration_ms = (float)(time_ms - acc.last_onset_ms);
+    int bin = rhythm_time_bin(duration_ms);
+    acc.duration_weight[bin] += 1.0f;
+    acc.duration_ms_sum[bin] += duration_ms;
+    acc.note_held = false;
+}
+
+bool rhythm_ready()
+{
+    for(int i = 0; i < RHYTHM_TIME_BINS; i++)
+    {
+        if(phrase->rhythm.ioi_weight[i] > 0.0f)
+            return true;
+    }
+    return false;
+}
+
+void seed_rhythm(uint32_t seed)
+{
+    rhythm_rng = seed ^ 0x52485954u;  // "RHYT": apart from the voice streams
+}
+
+// Bin drawn in proportion to its weight, -1 if nothing was learned
+int rhythm_draw_bin(const float* weight, int bins)
+{
+    float total = 0.0f;
+    for(int i = 0; i < bins; i++)
+        total += weight[i];
+    if(total <= 0.0f)
+        return -1;
+
+    float target = (float)(splitmix32(rhythm_rng) >> 8) * (1.0f / 16777216.0f) * total;
+    int last = -1;
+    for(int i = 0; i < bins; i++)
+    {
+        if(weight[i] <= 0.0f)
+            continue;
+        last = i;
+        target -= weight[i];
+        if(target < 0.0f)
+            return i;
+    }
+    return last;  // Rounding ran past the end
+}
+
+RhythmStep draw_rhythm_step()
+{
+    const RhythmAccumulator& acc = phrase->rhythm;
+    RhythmStep step;
+
+    int ioi_bin = rhythm_draw_bin(acc.ioi_weight, RHYTHM_TIME_BINS);
+    float ioi_ms = (ioi_bin >= 0) ? rhythm_mean_ms(acc.ioi_weight, acc.ioi_ms_sum, ioi_bin)
+                                  : RHYTHM_DEFAULT_IOI_MS;
+    int duration_bin = rhythm_draw_bin(acc.duration_weight, RHYTHM_TIME_BINS);
+    float duration_ms = (duration_bin >= 0)
+                            ? rhythm_mean_ms(acc.duration_weight, acc.duration_ms_sum, duration_bin)
+                            : ioi_ms * 0.5f;
+    if(duration_ms > ioi_ms)
+        duration_ms = ioi_ms;  // One voice never overlaps itself
+    int velocity_bin = rhythm_draw_bin(acc.velocity_weight, RHYTHM_VELOCITY_BINS);
+
+    step.ioi_ms = (uint16_t)(ioi_ms + 0.5f);
+    step.duration_ms = (uint16_t)(duration_ms + 0.5f);
+    step.velocity = (velocity_bin >= 0)
+                        ? (uint8_t)(velocity_bin * 128 / RHYTHM_VELOCITY_BINS + 64 / RHYTHM_VELOCITY_BINS)
+                        : RHYTHM_DEFAULT_VELOCITY;
+    return step;
+}
+
+// ============================================================================
+// SCALE QUANTIZATION (pitch lookup tables, rebuilt with the interval sampler)
+// ============================================================================
+// With a scale selected the generator moves in scale steps: the sampler's
+// interval histogram is remapped from semitones to steps when it is built,
+// and a move is degree_note[degree[note] + steps], two table lookups. Notes
+// that do not come from a step (Markov successors, a clamped octave
+// displacement, a voice starting at the register center) go through snap[].
+// Nothing is searched or rejected per note. The chromatic map is the
+// identity, so SCALE_SELECT_CHROMATIC generates exactly as before.
+
+int scale_select = SCALE_SELECT_CHROMATIC;
+
+// Main loop / control context (fits the active phrase if it changed)
+int scale_key_for(int select)
+{
+    const LearnedTendencies& t = phrase->tendencies;
+    if(select != SCALE_SELECT_CHROMATIC && !t.scale_fitted)
+        fit_scale(phrase->tendencies, phrase->tendency_acc);
+    if(select == SCALE_SELECT_AUTO)
+        return 1 + t.scale_template * PITCH_CLASSES + t.scale_root;
+    if(select >= SCALE_SELECT_FIXED && select < SCALE_SELECT_COUNT)
+    {
+        int tmpl = select - SCALE_SELECT_FIXED;
+        return 1 + tmpl * PITCH_CLASSES + t.template_root[tmpl];
+    }
+    return 0;
+}
+
+void build_scale_map(ScaleMap& map, int key)
+{
+    uint16_t mask = 0xFFF;
+    if(key > 0)
+        mask = rotate_pitch_classes(scale_template_mask[(key - 1) / PITCH_CLASSES],
+                                    (key - 1) % PITCH_CLASSES);
+    map.steps_per_octave = (uint8_t)__builtin_popcount(mask);
+
+    uint8_t degree_of[128];
+    int count = 0;
+    for(int note = 0; note < 128; note++)
+    {
+        if(mask & (1u << (note % PITCH_CLASSES)))
+        {
+            degree_of[note] = (uint8_t)count;
+            map.degree_note[count++] = (uint8_t)note;
+        }
+    }
+    map.degree_count = (uint8_t)count;
+
+    // Nearest in-scale note: outward search, lower side first
+    for(int note = 0; note < 128; note++)
+    {
+        int snapped = note;
+        for(int dist = 0; dist < PITCH_CLASSES; dist++)
+        {
+            if(note - dist >= 0 && (mask & (1u << ((note - dist) % PITCH_CLASSES))))
+            {
+                snapped = note - dist;
+                break;
+            }
+            if(note + dist < 128 && (mask & (1u << ((note + dist) % PITCH_CLASSES))))
+            {
+                snapped = note + dist;
+                break;
+            }
+        }
+        map.snap[note] = (uint8_t)snapped;
+        map.degree[note] = degree_of[snapped];
+    }
+}
+
+// ============================================================================
+// INTERVAL SAMPLER (alias table, rebuilt on learn / shape change)
+// ============================================================================
+// The learned interval histogram is reshaped by MOTION (scaled by ENERGY) and
+// LEAP SHAPE, then packed into a Walker/Vose alias table. Sampling costs one
+// random draw and one table lookup regardless of histogram resolution. The
+// table is rebuilt from the control loop only when a phrase is learned or the
+// quantized shape parameters change; two copies are kept so the generator
+// (audio interrupt) always reads a complete table.
+
+IntervalSampler interval_samplers[2];
+std::atomic<int> interval_sampler_active{0};
+bool interval_sampler_built = false;
+
+// Build the shaped interval distribution and its alias table, in steps of
+// sampler.scale (filled in first)
+void build_interval_sampler(IntervalSampler& sampler, float motion_bias, float leap_shape)
+{
+    const int N = INTERVAL_HISTOGRAM_SIZE;
+    float weights[INTERVAL_HISTOGRAM_SIZE] = {};
+
+    // Learned semitone sizes as scale steps (nonzero stays at least one step)
+    float counts[INTERVAL_HISTOGRAM_SIZE] = {};
+    int steps_per_octave = sampler.scale.steps_per_octave;
+    for(int i = 0; i < N; i++)
+    {
+        // Default to whole step if no data
+        float w = (phrase->tendencies.total_intervals <= 0.0f) ? (i == 2 ? 1.0f : 0.0f)
+                                                       : phrase->tendencies.interval_counts[i];
+        int steps = (i * steps_per_octave + PITCH_CLASSES / 2) / PITCH_CLASSES;
+        if(i > 0 && steps == 0)
+            steps = 1;
+        counts[steps] += w;
+    }
+
+    for(int i = 0; i < N; i++)
+    {
+        float w = counts[i];
+        if(w <= 0.0f)
+            continue;
+
+        // Bias toward smaller or larger intervals based on MOTION parameter
+        if(motion_bias < 0.5f)
+        {
+            // Bias toward smaller intervals
+            float scale = motion_bias * 2.0f;  // 0.0 to 1.0
+            int size = (int)(i * scale + 0.5f);
+            if(size == 0)
+            {
+                // Prefer steps over repeats when going small (50/50)
+                weights[0] += w * 0.5f;
+                weights[1] += w * 0.5f;
+            }
+            else
+            {
+                weights[size] += w;
+            }
+        }
+        else
+        {
+            // Bias toward larger intervals
+            float scale = (motion_bias - 0.5f) * 2.0f;  // 0.0 to 1.0
+            int boost = (int)(scale * 4.0f);  // Add up to 4 semitones
+            int size = i + boost;
+            weights[size > MAX_INTERVAL ? MAX_INTERVAL : size] += w;
+        }
+    }
+
+    // LEAP SHAPE: exponential decay of interval size (0.5 = learned shape,
+    // lower = steeper falloff toward small intervals, higher = flatter)
+    float decay = (0.5f - leap_shape) * 2.0f * LEAP_SHAPE_MAX_DECAY;
+    float total = 0.0f;
+    for(int i = 0; i < N; i++)
+    {
+        weights[i] *= expf(-decay * (float)i);
+        total += weights[i];
+    }
+
+    // Vose alias method: scale to mean 1.0 and pair small columns with large
+    uint8_t small[INTERVAL_HISTOGRAM_SIZE];
+    uint8_t large[INTERVAL_HISTOGRAM_SIZE];
+    int small_count = 0;
+    int large_count = 0;
+    float scaled[INTERVAL_HISTOGRAM_SIZE];
+    for(int i = 0; i < N; i++)
+    {
+        sampler.probability[i] = (total > 0.0f) ? weights[i] / total : 1.0f / (float)N;
+        scaled[i] = sampler.probability[i] * (float)N;
+        if(scaled[i] < 1.0f)
+            small[small_count++] = (uint8_t)i;
+        else
+            large[large_count++] = (uint8_t)i;
+    }
+    while(small_count > 0 && large_count > 0)
+    {
+        uint8_t s = small[--small_count];
+        uint8_t l = large[--large_count];
+        sampler.threshold[s] = scaled[s];
+        sampler.alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+        if(scaled[l] < 1.0f)
+            small[small_count++] = l;
+        else
+            large[large_count++] = l;
+    }
+    // Leftovers are 1.0 up to rounding error
+    while(large_count > 0)
+    {
+        uint8_t l = large[--large_count];
+        sampler.threshold[l] = 1.0f;
+        sampler.alias[l] = l;
+    }
+    while(small_count > 0)
+    {
+        uint8_t s = small[--small_count];
+        sampler.threshold[s] = 1.0f;
+        sampler.alias[s] = s;
+    }
+
+    // Q16 copies for the fixed-point path, with the direction and register
+    // it reads from here instead of phrase->tendencies
+    for(int i = 0; i < N; i++)
+    {
+        sampler.fixed.probability[i] = q16_from_float(sampler.probability[i]);
+        sampler.fixed.threshold[i] = q16_from_float(sampler.threshold[i]);
+    }
+    sampler.fixed.learned_up_probability = q16_from_float(FloatMath::learned_up_probability(sampler));
+    sampler.fixed.register_center = q16_from_float(FloatMath::register_center(sampler));
+}
+
+// Rebuild the sampler if the shape parameters moved (control loop context)
+// force = true after a new phrase has been analyzed
+IntervalSampler phrase_samplers[PHRASE_SLOTS];   // Last sampler built per phrase slot
+bool phrase_sampler_valid[PHRASE_SLOTS] = {};
+
+void refresh_interval_sampler(bool force)
+{
+    int motion_key = (int)(derived.value[DERIVED_MOTION] * SAMPLER_KEY_STEPS);
+    int leap_key = (int)(parameters_smoothed[PARAM_LEAP_SHAPE] * SAMPLER_KEY_STEPS);
+    int scale_key = scale_key_for(scale_select);
+
+    int active = interval_sampler_active.load(std::memory_order_relaxed);
+    const IntervalSampler& current = interval_samplers[active];
+    if(!force && interval_sampler_built && current.motion_key == motion_key &&
+       current.leap_key == leap_key && current.scale_key == scale_key)
+        return;
+
+    // Build into the inactive copy, then publish it; the scale tables are
+    // carried over unless the scale changed
+    IntervalSampler& next = interval_samplers[active ^ 1];
+    if(interval_sampler_built && current.scale_key == scale_key)
+        next.scale = current.scale;
+    else
+        build_scale_map(next.scale, scale_key);
+    next.scale_key = scale_key;
+    build_interval_sampler(next,
+                           (float)motion_key / SAMPLER_KEY_STEPS,
+                           (float)leap_key / SAMPLER_KEY_STEPS);
+    next.motion_key = motion_key;
+    next.leap_key = leap_key;
+    interval_sampler_active.store(active ^ 1, std::memory_order_release);
+    interval_sampler_built = true;
+
+    // Keep a copy with the phrase it was built from
+    phrase_samplers[phrase_slot] = next;
+    phrase_sampler_valid[phrase_slot] = true;
+}
+
+// Phrase switch: publish the slot's own sampler if it matches the current
+// MOTION/LEAP SHAPE keys, otherwise build it
+void install_phrase_sampler()
+{
+    int motion_key = (int)(derived.value[DERIVED_MOTION] * SAMPLER_KEY_STEPS);
+    int leap_key = (int)(parameters_smoothed[PARAM_LEAP_SHAPE] * SAMPLER_KEY_STEPS);
+    const IntervalSampler& cached = phrase_samplers[phrase_slot];
+    if(!phrase_sampler_valid[phrase_slot] || cached.motion_key != motion_key
+       || cached.leap_key != leap_key || cached.scale_key != scale_key_for(scale_select))
+    {
+        refresh_interval_sampler(true);
+        return;
+    }
+    int active = interval_sampler_active.load(std::memory_order_relaxed);
+    interval_samplers[active ^ 1] = cached;
+    interval_sampler_active.store(active ^ 1, std::memory_order_release);
+    interval_sampler_built = true;
+}
+
+// Weighted random selection from the shaped interval distribution
+// Returns interval size (0-MAX_INTERVAL scale steps), O(1)
+template <class M>
+int select_interval_from_distribution(int v, const IntervalSampler& sampler)
+{
+    // One draw picks the column and the keep/alias decision
+    int column;
+    typename M::value_t position = M::random_column(v, INTERVAL_HISTOGRAM_SIZE, column);
+    return (position < M::threshold(sampler, column)) ? column : sampler.alias[column];
+}
+
+// Probability of ascending, from learned tendencies, DIRECTION parameter, and register gravity
+// Register gravity as a shift of the up probability (-0.5 to +0.5 max)
+template <class M>
+typename M::value_t register_gravity_shift(int v)
+{
+    typedef typename M::value_t value_t;
+
+    // Apply register gravity - bias direction toward center pitch
+    // Gravity increases as we approach phrase target length, decreases with high energy
+    // (0.0 = no gravity, 1.0 = strong pull to center)
+    value_t gravity_influence = M::k(0.0f);
+    value_t effective_gravity = M::params(control_snapshot()).value[DERIVED_GRAVITY];
+
+    // Boost gravity near phrase boundaries
+    if(voices.phrase_target_length[v] > 0)
+    {
+        value_t phrase_progress = M::ratio(voices.phrase_note_count[v], voices.phrase_target_length[v]);
+        if(phrase_progress > M::k(0.7f))  // In last 30% of phrase
+        {
+            value_t phrase_boost = M::div_by(phrase_progress - M::k(0.7f), 0.3f);  // 0.0 to 1.0
+            effective_gravity = effective_gravity + M::mul(phrase_boost, M::k(0.3f));  // Add up to 0.3
+            if(effective_gravity > M::k(1.0f)) effective_gravity = M::k(1.0f);
+        }
+    }
+
+    if(effective_gravity > M::k(0.05f))  // Only apply if gravity is meaningful
+    {
+        // Calculate distance from learned center (in semitones)
+        value_t distance_from_center =
+            M::from_int(voices.current_note[v]) - M::register_center(active_interval_sampler());
+
+        // Normalize to roughly -1.0 to +1.0 (assuming ±24 semitone typical range)
+        value_t normalized_distance = M::div_by(distance_from_center, 24.0f);
+        if(normalized_distance < M::k(-1.0f)) normalized_distance = M::k(-1.0f);
+        if(normalized_distance > M::k(1.0f)) normalized_distance = M::k(1.0f);
+
+        // Gravity pulls toward center:
+        // If above center (positive distance), bias downward (negative influence)
+        // If below center (negative distance), bias upward (positive influence)
+        gravity_influence = M::mul(-normalized_distance, effective_gravity);
+    }
+
+    return M::mul(gravity_influence, M::k(0.5f));
+}
+
+float FloatMath::learned_up_probability(const IntervalSampler&)
+{
+    // Calculate base probability from learned tendencies
+    float learned_up_probability = 0.5f;
+    float total_directional = phrase->tendencies.ascending_count + phrase->tendencies.descending_count;
+    if(total_directional > 0.0f)
+    {
+        learned_up_probability = phrase->tendencies.ascending_count / total_directional;
+    }
+    return learned_up_probability;
+}
+
+float FloatMath::register_center(const IntervalSampler&)
+{
+    return phrase->tendencies.register_center;
+}
+
+template <class M>
+typename M::value_t direction_up_probability(int v)
+{
+    typedef typename M::value_t value_t;
+    value_t learned_up_probability = M::learned_up_probability(active_interval_sampler());
+
+    // Blend learned tendency with direction parameter
+    const typename M::params_t& params = M::params(control_snapshot());
+    value_t blend_factor = params.direction_blend;  // 0.0 to 1.0
+    value_t base_probability = M::mul(learned_up_probability, M::k(1.0f) - blend_factor) +
+                               M::mul(params.direction_target, blend_factor);
+
+    // Apply gravity as probability shift
+    value_t final_probability = base_probability + register_gravity_shift<M>(v);
+    if(final_probability < M::k(0.0f)) final_probability = M::k(0.0f);
+    if(final_probability > M::k(1.0f)) final_probability = M::k(1.0f);
+
+    return final_probability;
+}
+
+// Select direction based on learned tendencies, DIRECTION parameter, and register gravity
+// Returns true for ascending, false for descending
+template <class M>
+bool select_direction(int v)
+{
+    return M::random(v) < direction_up_probability<M>(v);
+}
+
+// Octave displacement choices (cumulative walk of the shift probabilities)
+const int OCTAVE_SHIFT_COUNT = 4;
+const int octave_shifts[OCTAVE_SHIFT_COUNT] = {12, -12, 24, -24};
+// Low range: only ±1 octave
+const float octave_shift_probs_narrow[OCTAVE_SHIFT_COUNT] = {0.5f, 0.5f, 0.0f, 0.0f};
+// High range: can do ±1 or ±2 octaves
+const float octave_shift_probs_wide[OCTAVE_SHIFT_COUNT] = {0.5f, 0.25f, 0.125f, 0.125f};
+const q16_t octave_shift_probs_narrow_q16[OCTAVE_SHIFT_COUNT] = {
+    q16_from_float(0.5f), q16_from_float(0.5f), 0, 0};
+const q16_t octave_shift_probs_wide_q16[OCTAVE_SHIFT_COUNT] = {
+    q16_from_float(0.5f), q16_from_float(0.25f), q16_from_float(0.125f), q16_from_float(0.125f)};
+
+const float* FloatMath::octave_shift_probs(bool wide)
+{
+    return wide ? octave_shift_probs_wide : octave_shift_probs_narrow;
+}
+
+const q16_t* FixedMath::octave_shift_probs(bool wide)
+{
+    return wide ? octave_shift_probs_wide_q16 : octave_shift_probs_narrow_q16;
+}
+
+// Probability that a note gets displaced (0% below 0.1, ~20% at 1.0)
+// and which shift table applies
+template <class M>
+typename M::value_t octave_displacement_probability(const typename M::value_t** shift_probs)
+{
+    // RANGE_WIDTH with energy applied (0.0 = no displacement, 1.0 = frequent/large)
+    // High energy = more octave displacements
+    typename M::value_t range_param = M::params(control_snapshot()).value[DERIVED_RANGE];
+
+    // Decide displacement amount based on RANGE setting
+    *shift_probs = M::octave_shift_probs(range_param >= M::k(0.5f));
+
+    // No displacement if parameter very low
+    if(range_param < M::k(0.1f))
+        return M::k(0.0f);
+    return M::mul(range_param, M::k(0.2f));
+}
+
+// Apply octave displacement based on RANGE_WIDTH parameter
+// Occasionally transposes notes by ±1 or ±2 octaves for variety
+template <class M>
+uint8_t apply_octave_displacement(int v, uint8_t note)
+{
+    const typename M::value_t* shift_probs;
+    typename M::value_t displacement_probability = octave_displacement_probability<M>(&shift_probs);
+
+    // Most of the time, no displacement
+    if(displacement_probability <= M::k(0.0f) || M::random(v) > displacement_probability)
+        return note;
+
+    typename M::value_t roll = M::random(v);
+    int octave_shift = octave_shifts[OCTAVE_SHIFT_COUNT - 1];
+    for(int i = 0; i < OCTAVE_SHIFT_COUNT; i++)
+    {
+        roll -= shift_probs[i];
+        if(roll < M::k(0.0f))
+        {
+            octave_shift = octave_shifts[i];
+            break;
+        }
+    }
+
+    // Apply displacement with MIDI range clamping (back onto the scale)
+    int displaced = note + octave_shift;
+    displaced = displaced < 0 ? 0 : (displaced > 127 ? 127 : displaced);
+
+    return active_interval_sampler().scale.snap[displaced];
+}
+
+// ============================================================================
+// CANDIDATE SELECTION
+// ============================================================================
+// CANDIDATE_REJECTION: draw interval, direction and displacement, then let
+// memory bias accept/reject, retrying up to 4 times (the original pipeline).
+// CANDIDATE_WEIGHTED: enumerate every reachable note, weight it by interval
+// probability x direction probability x displacement probability x memory
+// weight, and sample once. Cost per note is bounded (at most 128 pitches)
+// and the result follows the parameter distribution exactly, including at
+// MEMORY extremes where the retry loop gives up or saturates.
+
+CandidateMode candidate_mode = CANDIDATE_WEIGHTED;
+
+// One candidate from interval, direction and displacement (no memory bias)
+template <class M>
+uint8_t draw_candidate(int v)
+{
+    const IntervalSampler& sampler = active_interval_sampler();
+
+    // Select interval size from learned distribution (shaped by MOTION)
+    int interval_size = select_interval_from_distribution<M>(v, sampler);
+
+    // Select direction (includes register gravity influence)
+    bool go_up = select_direction<M>(v);
+
+    // Apply interval with direction, in scale steps (clamped to MIDI range)
+    int signed_interval = go_up ? interval_size : -interval_size;
+    uint8_t new_note = scale_step(sampler.scale, voices.current_note[v], signed_interval);
+
+    // Apply octave displacement for variety
+    return apply_octave_displacement<M>(v, new_note);
+}
+
+// Rejection mode: retry until memory bias accepts (or max attempts reached)
+template <class M>
+uint8_t select_candidate_rejection(int v)
+{
+    uint8_t candidate_note = 0;
+    int attempts = 0;
+    const int MAX_ATTEMPTS = 4;  // Try up to 4 times to find acceptable note
+
+    while(attempts < MAX_ATTEMPTS)
+    {
+        candidate_note = draw_candidate<M>(v);
+
+        // Apply memory bias - accept or reject based on recent history
+        if(apply_memory_bias<M>(v, candidate_note))
+        {
+            // Note accepted!
+            break;
+        }
+
+        attempts++;
+    }
+    return candidate_note;
+}
+
+// Weighted mode: accumulate the probability of every reachable pitch, apply
+// memory weights, sample once
+template <class M>
+uint8_t select_candidate_weighted(int v)
+{
+    typedef typename M::value_t value_t;
+    const IntervalSampler& sampler = active_interval_sampler();
+    const typename M::params_t& params = M::params(control_snapshot());
+
+    value_t up_probability = direction_up_probability<M>(v);
+    const value_t* shift_probs;
+    value_t displacement_probability = octave_displacement_probability<M>(&shift_probs);
+
+    value_t pitch_weight[128] = {};
+    int lowest = 127;
+    int highest = 0;
+
+    for(int size = 0; size < INTERVAL_HISTOGRAM_SIZE; size++)
+    {
+        value_t interval_probability = M::interval_probability(sampler, size);
+        if(interval_probability <= M::k(0.0f))
+            continue;
+
+        // Unison is the same note either way
+        int directions = (size == 0) ? 1 : 2;
+        for(int d = 0; d < directions; d++)
+        {
+            value_t direction_probability = (size == 0) ? M::k(1.0f)
+                                            : (d == 0) ? up_probability
+                                                       : M::k(1.0f) - up_probability;
+            value_t weight = M::mul(interval_probability, direction_probability);
+            if(weight <= M::k(0.0f))
+                continue;
+
+            int base = scale_step(sampler.scale, voices.current_note[v], (d == 0) ? size : -size);
+
+            // Undisplaced note plus each octave displacement
+            pitch_weight[base] += M::mul(weight, M::k(1.0f) - displacement_probability);
+            if(base < lowest) lowest = base;
+            if(base > highest) highest = base;
+            if(displacement_probability <= M::k(0.0f))
+                continue;
+            for(int i = 0; i < OCTAVE_SHIFT_COUNT; i++)
+            {
+                if(shift_probs[i] <= M::k(0.0f))
+                    continue;
+                int displaced = base + octave_shifts[i];
+                displaced = sampler.scale.snap[displaced < 0 ? 0 : (displaced > 127 ? 127 : displaced)];
+                pitch_weight[displaced] += M::mul(M::mul(weight, displacement_probability), shift_probs[i]);
+                if(displaced < lowest) lowest = displaced;
+                if(displaced > highest) highest = displaced;
+            }
+        }
+    }
+
+    // Memory weight per reachable pitch
+    value_t total = M::k(0.0f);
+    for(int note = lowest; note <= highest; note++)
+    {
+        if(pitch_weight[note] > M::k(0.0f))
+            pitch_weight[note] = M::mul(pitch_weight[note],
+                                        M::memory_weight(params, count_in_history(v, (uint8_t)note)));
+        total += pitch_weight[note];
+    }
+
+    // Every reachable pitch fully avoided: ignore memory for this note
+    if(total <= M::k(0.0f))
+        return draw_candidate<M>(v);
+
+    // Single draw over the accumulated weights
+    value_t target = M::mul(M::random(v), total);
+    for(int note = lowest; note < highest; note++)
+    {
+        target -= pitch_weight[note];
+        if(target < M::k(0.0f))
+            return (uint8_t)note;
+    }
+    return (uint8_t)highest;
+}
+
+// ============================================================================
+// MARKOV TRANSITION MODEL (alternate generation engine)
+// ============================================================================
+// Learns which signed interval follows the last k intervals (k = 1..3) of the
+// corpus, in a fixed-size open-addressed hash table. Each context keeps its
+// few most frequent successors, so a draw walks at most MARKOV_SUCCESSORS
+// entries. A voice running the Markov engine backs off to shorter contexts
+// when the longer one was never seen, and to the tendency engine when none
+// was. Register gravity and memory weight the successors, and octave
+// displacement is applied to the result, exactly as for the tendency engine.
+
+// Table layout (MarkovContext) is part of the phrase bank, see PhraseSlot
+const int MARKOV_MAX_PROBES = 8;
+const int MARKOV_SYMBOLS = 2 * MAX_INTERVAL + 1;  // Signed intervals -12..+12
+
+uint32_t markov_table_full = 0;    // Contexts dropped: no free slot within probe range
+
+// Interval to table symbol (0..MARKOV_SYMBOLS-1), capped like the histogram
+inline uint32_t markov_symbol(int interval)
+{
+    if(interval > MAX_INTERVAL) interval = MAX_INTERVAL;
+    if(interval < -MAX_INTERVAL) interval = -MAX_INTERVAL;
+    return (uint32_t)(interval + MAX_INTERVAL);
+}
+
+inline int8_t markov_clamp_interval(int interval)
+{
+    return (int8_t)((int)markov_symbol(interval) - MAX_INTERVAL);
+}
+
+// Pack order and context (most recent interval first) into a nonzero key
+uint32_t markov_key(const int* context, int order)
+{
+    uint32_t key = (uint32_t)order;
+    for(int i = 0; i < order; i++)
+        key = key * MARKOV_SYMBOLS + markov_symbol(context[i]);
+    return key;
+}
+
+// Find the slot for key, claiming an empty one if create is set
+MarkovContext* markov_find(uint32_t key, bool create)
+{
+    uint32_t slot = (key * 2654435761u) >> (32 - MARKOV_TABLE_BITS);  // Knuth multiplicative hash
+    for(int probe = 0; probe < MARKOV_MAX_PROBES; probe++)
+    {
+        MarkovContext& entry = phrase->markov_table[(slot + probe) & (MARKOV_TABLE_SLOTS - 1)];
+        if(entry.key == key)
+            return &entry;
+        if(entry.key == 0)
+        {
+            if(!create)
+                return nullptr;
+            entry = MarkovContext();
+            entry.key = key;
+            return &entry;
+        }
+    }
+    if(create)
+        markov_table_full++;
+    return nullptr;
+}
+
+void markov_reset()
+{
+    for(int i = 0; i < MARKOV_TABLE_SLOTS; i++)
+        phrase->markov_table[i].key = 0;
+}
+
+// Count one transition; a full successor list replaces its rarest entry
+void markov_count(MarkovContext& entry, int8_t interval)
+{
+    int target = -1;
+    int rarest = 0;
+    for(int i = 0; i < MARKOV_SUCCESSORS; i++)
+    {
+        if(entry.count[i] > 0 && entry.successor[i] == interval)
+        {
+            target = i;
+            break;
+        }
+        if(entry.count[i] < entry.count[rarest])
+            rarest = i;
+    }
+    if(target < 0)
+    {
+        target = rarest;
+        entry.successor[target] = interval;
+        entry.count[target] = 0;
+    }
+
+    // Halve the whole context before a count saturates (keeps proportions)
+    if(entry.count[target] == 255)
+    {
+        for(int i = 0; i < MARKOV_SUCCESSORS; i++)
+            entry.count[i] = (entry.count[i] + 1) >> 1;
+    }
+    entry.count[target]++;
+}
+
+// Learn the transitions ending at the newest corpus note (O(1) per note)
+void markov_learn_latest()
+{
+    int available = corpus_count() - 1;  // Intervals in the corpus
+    if(available < 2)
+        return;
+
+    int next = corpus_note(0) - corpus_note(1);
+    int context[MARKOV_MAX_ORDER];
+    for(int k = 1; k <= MARKOV_MAX_ORDER && k < available; k++)
+    {
+        context[k - 1] = corpus_note(k) - corpus_note(k + 1);
+        MarkovContext* entry = markov_find(markov_key(context, k), true);
+        if(entry)
+            markov_count(*entry, markov_clamp_interval(next));
+    }
+}
+
+// Last `order` intervals played by voice v, most recent first
+// Returns false if the voice has not played enough notes yet
+bool markov_voice_context(int v, int order, int* context)
+{
+    if(voices.history_count[v] < order + 1)
+        return false;
+    int index = voices.history_index[v];
+    for(int i = 0; i < order; i++)
+    {
+        uint8_t newer = voices.history[v][(index + NOTE_HISTORY_SIZE - 1 - i) % NOTE_HISTORY_SIZE];
+        uint8_t older = voices.history[v][(index + NOTE_HISTORY_SIZE - 2 - i) % NOTE_HISTORY_SIZE];
+        context[i] = newer - older;
+    }
+    return true;
+}
+
+// Markov engine: longest known context, successors weighted by gravity and
+// memory, one draw, then octave displacement
+template <class M>
+uint8_t select_candidate_markov(int v, int order)
+{
+    typedef typename M::value_t value_t;
+    const MarkovContext* entry = nullptr;
+    int context[MARKOV_MAX_ORDER];
+    for(int k = order; k >= 1 && !entry; k--)
+    {
+        if(markov_voice_context(v, k, context))
+            entry = markov_find(markov_key(context, k), false);
+    }
+    if(!entry)
+        return (candidate_mode == CANDIDATE_WEIGHTED) ? select_candidate_weighted<M>(v)
+                                                      : select_candidate_rejection<M>(v);
+
+    // Gravity scales ascending against descending successors
+    const ScaleMap& scale = active_interval_sampler().scale;
+    const typename M::params_t& params = M::params(control_snapshot());
+    value_t up_scale = M::k(1.0f) + M::mul(M::k(2.0f), register_gravity_shift<M>(v));
+    value_t down_scale = M::k(2.0f) - up_scale;
+
+    value_t gravity_weight[MARKOV_SUCCESSORS];
+    value_t weight[MARKOV_SUCCESSORS];
+    uint8_t base[MARKOV_SUCCESSORS];
+    value_t gravity_total = M::k(0.0f);
+    value_t total = M::k(0.0f);
+    for(int i = 0; i < MARKOV_SUCCESSORS; i++)
+    {
+        int interval = entry->successor[i];
+        int note = voices.current_note[v] + interval;
+        base[i] = scale.snap[note < 0 ? 0 : (note > 127 ? 127 : note)];
+        gravity_weight[i] = M::mul(M::from_int(entry->count[i]),
+                                   interval > 0 ? up_scale : (interval < 0 ? down_scale : M::k(1.0f)));
+        weight[i] = M::mul(gravity_weight[i], M::memory_weight(params, count_in_history(v, base[i])));
+        gravity_total += gravity_weight[i];
+        total += weight[i];
+    }
+
+    // Every successor fully avoided by memory: ignore memory for this note
+    const value_t* draw_weight = weight;
+    if(total <= M::k(0.0f))
+    {
+        if(gravity_total <= M::k(0.0f))
+            return draw_candidate<M>(v);
+        draw_weight = gravity_weight;
+        total = gravity_total;
+    }
+
+    // Single draw over the successors
+    value_t target = M::mul(M::random(v), total);
+    int chosen = 0;
+    for(int i = 0; i < MARKOV_SUCCESSORS; i++)
+    {
+        if(draw_weight[i] <= M::k(0.0f))
+            continue;
+        chosen = i;
+        target -= draw_weight[i];
+        if(target < M::k(0.0f))
+            break;
+    }
+
+    return apply_octave_displacement<M>(v, base[chosen]);
+}
+
+// ENGINE parameter -> engine per voice (0 = tendency engine, k = Markov order k)
+// 0-19% TEND, 20-39% MKV1, 40-59% MKV2, 60-79% MKV3,
+// 80-100% MIX: voice v runs order v % 4 (voice 0 tendencies, 1-3 Markov)
+uint32_t engine_assignment_serial = 0;   // Bumped whenever an assignment changes
+
+void assign_voice_engines(float engine_param)
+{
+    int zone = (int)(engine_param * 5.0f);
+    if(zone > 4) zone = 4;
+    for(int v = 0; v < MAX_VOICES; v++)
+    {
+        uint8_t order = (zone < 4) ? (uint8_t)zone : (uint8_t)(v % (MARKOV_MAX_ORDER + 1));
+        if(voices.markov_order[v] != order)
+        {
+            voices.markov_order[v] = order;
+            engine_assignment_serial++;
+        }
+    }
+}
+
+// Generate next note based on learned tendencies and parameters
+template <class M>
+uint8_t generate_next_note_with(int v)
+{
+    // ENERGY scaling of motion, memory, gravity, range and phrase length is
+    // precomputed in derive_parameters() and read from the published control
+    // snapshot; MOTION and LEAP SHAPE are folded into the interval sampler,
+    // see refresh_interval_sampler()
+
+    // Update phrase target length from PHRASE parameter, scaled by energy
+    voices.phrase_target_length[v] = control_snapshot().derived.phrase_target_length;
+
+    // Pick the next note (memory bias included)
+    uint8_t candidate_note;
+    if(voices.markov_order[v] > 0)
+        candidate_note = select_candidate_markov<M>(v, voices.markov_order[v]);
+    else if(candidate_mode == CANDIDATE_WEIGHTED)
+        candidate_note = select_candidate_weighted<M>(v);
+    else
+        candidate_note = select_candidate_rejection<M>(v);
+
+    // Add accepted note to history
+    add_note_to_history(v, candidate_note);
+
+    // Update phrase tracking
+    voices.phrase_note_count[v]++;
+
+    // Check if we should reset phrase (soft boundary)
+    if(voices.phrase_note_count[v] >= voices.phrase_target_length[v])
+    {
+        // Probabilistic reset - higher chance as we go past target
+        int overrun = voices.phrase_note_count[v] - voices.phrase_target_length[v];
+        typename M::value_t reset_probability =
+            M::k(0.5f) + M::mul(M::ratio(overrun, voices.phrase_target_length[v]), M::k(0.5f));
+        if(reset_probability > M::k(1.0f)) reset_probability = M::k(1.0f);
+
+        if(M::random(v) < reset_probability)
+        {
+            voices.phrase_note_count[v] = 0;
+            // Optionally reseed RNG for variation
+            seed_voice_rng(v, random_u32(v) ^ rng_jitter());
+        }
+    }
+
+    // Store for next iteration
+    voices.previous_note[v] = voices.current_note[v];
+    voices.last_interval[v] = candidate_note - voices.current_note[v];
+    voices.last_direction_up[v] = (candidate_note > voices.current_note[v]);
+
+    return candidate_note;
+}
+
+template uint8_t generate_next_note_with<FloatMath>(int v);
+template uint8_t generate_next_note_with<FixedMath>(int v);
+
+// Initialize a voice from the learned tendencies (start at the register center)
+void reset_voice(int v, uint32_t seed)
+{
+    uint8_t center = (uint8_t)phrase->tendencies.register_center;
+    voices.current_note[v] = interval_sampler_built ? active_interval_sampler().scale.snap[center]
+                                                    : center;
+    voices.previous_note[v] = voices.current_note[v];
+    voices.output_note[v] = voices.current_note[v];
+    voices.last_interval[v] = 0;
+    voices.last_direction_up[v] = (phrase->tendencies.ascending_count >= phrase->tendencies.descending_count);
+    voices.midi_channel[v] = (uint8_t)v;
+
+    // Clear note history for memory bias system
+    clear_note_history(v);
+
+    // Initialize phrase tracking
+    voices.phrase_note_count[v] = 0;
+    voices.phrase_target_length[v] = 12;  // Default medium length
+
+    seed_voice_rng(v, seed);
+}
+
+// ============================================================================
+// LOOKAHEAD PRE-GENERATION QUEUE
+// ============================================================================
+// The main loop runs each voice LOOKAHEAD_DEPTH notes ahead in idle time, so a
+// trigger only pops a ready note. The voice state therefore sits at the NEWEST
+// queued note; every entry keeps an undo record (the small state fields plus
+// the history slot it overwrote), so unplayed notes can be retracted and
+// regenerated when parameters move or a new phrase arrives. Pops (audio
+// interrupt) and retractions (main loop) race on the tail with a CAS, so
+// neither side ever blocks.
+
+bool lookahead_enabled = true;
+
+LookaheadQueue lookahead[MAX_VOICES];
+DerivedParams lookahead_derived;       // Derived block the queues were built from
+int      lookahead_sampler = -1;       // Interval sampler copy they were built from
+uint32_t lookahead_engines = 0;        // Engine assignment they were built with
+uint32_t lookahead_underruns = 0;      // Triggers that found an empty queue
+uint32_t lookahead_recomputes = 0;     // Notes retracted and regenerated
+
+// Audio interrupt: take the next ready note of voice v
+bool lookahead_pop(int v, uint8_t& note)
+{
+    LookaheadQueue& q = lookahead[v];
+    uint32_t t = q.tail.load(std::memory_order_relaxed);
+    // Signed: the tail briefly runs past the head while a retraction is undone
+    if((int32_t)(q.head.load(std::memory_order_acquire) - t) <= 0)
+        return false;
+    note = q.entries[t % LOOKAHEAD_DEPTH].note;
+    // Only the main loop can race us, and it cannot preempt the interrupt
+    q.tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+// Main loop: generate one note ahead for voice v
+void lookahead_push(int v)
+{
+    LookaheadQueue& q = lookahead[v];
+    uint32_t h = q.head.load(std::memory_order_relaxed);
+    LookaheadEntry& e = q.entries[h % LOOKAHEAD_DEPTH];
+
+    e.current_note = voices.current_note[v];
+    e.previous_note = voices.previous_note[v];
+    e.last_direction_up = voices.last_direction_up[v];
+    e.last_interval = voices.last_interval[v];
+    e.history_grew = voices.history_count[v] < NOTE_HISTORY_SIZE;
+    e.evicted_note = voices.history[v][voices.history_index[v]];
+    e.phrase_note_count = voices.phrase_note_count[v];
+    e.phrase_target_length = voices.phrase_target_length[v];
+    e.rng_pool_base = voices.rng_pool_base[v];
+    e.rng_pool_index = voices.rng_pool_index[v];
+
+    e.note = generate_next_note(v);
+    voices.current_note[v] = e.note;
+
+    q.head.store(h + 1, std::memory_order_release);
+}
+
+// Main loop: roll voice state back over one retracted entry
+void lookahead_undo(int v, const LookaheadEntry& e)
+{
+    int index = (voices.history_index[v] + NOTE_HISTORY_SIZE - 1) % NOTE_HISTORY_SIZE;
+    voices.history_pitch_count[v][voices.history[v][index]]--;
+    if(e.history_grew)
+    {
+        voices.history_count[v]--;
+    }
+    else
+    {
+        voices.history[v][index] = e.evicted_note;
+        voices.history_pitch_count[v][e.evicted_note]++;
+    }
+    voices.history_index[v] = (uint16_t)index;
+
+    voices.current_note[v] = e.current_note;
+    voices.previous_note[v] = e.previous_note;
+    voices.last_direction_up[v] = e.last_direction_up;
+    voices.last_interval[v] = e.last_interval;
+    voices.phrase_note_count[v] = e.phrase_note_count;
+    voices.phrase_target_length[v] = e.phrase_target_length;
+    // Refill from the recorded base only if the pool has moved on since
+    if(memcmp(&voices.rng_pool_base[v], &e.rng_pool_base, sizeof(RngStream)) != 0)
+    {
+        voices.rng_stream[v] = e.rng_pool_base;
+        rng_fill(v);
+    }
+    voices.rng_pool_index[v] = e.rng_pool_index;
+}
+
+// Main loop: retract all but the first `keep` unplayed notes of voice v
+void lookahead_retract(int v, int keep)
+{
+    LookaheadQueue& q = lookahead[v];
+    uint32_t h = q.head.load(std::memory_order_relaxed);
+    uint32_t t = q.tail.load(std::memory_order_acquire);
+    uint32_t new_head;
+    do
+    {
+        if(h - t <= (uint32_t)keep)
+            return;
+        new_head = t + keep;
+        // Claim the retracted range by moving the tail past it; the CAS fails
+        // if a trigger popped an entry in the meantime
+    } while(!q.tail.compare_exchange_weak(t, h, std::memory_order_acq_rel));
+
+    // Entries [t, h) are ours: undo [new_head, h) newest first, then hand the
+    // kept ones [t, new_head) back by lowering head before restoring the tail
+    for(uint32_t i = h; i > new_head; i--)
+    {
+        lookahead_undo(v, q.entries[(i - 1) % LOOKAHEAD_DEPTH]);
+        lookahead_recomputes++;
+    }
+    q.head.store(new_head, std::memory_order_release);
+    q.tail.store(t, std::memory_order_release);
+}
+
+// Drop every queued note without undo (voice state is about to be reset)
+void lookahead_clear(int v)
+{
+    lookahead[v].tail.store(lookahead[v].head.load(std::memory_order_relaxed),
+                            std::memory_order_release);
+}
+
+// Main loop: recompute stale notes and keep every active voice topped up
+void service_lookahead()
+{
+    if(!lookahead_enabled || learning_state != STATE_GENERATING)
+        return;
+
+    // Queued notes were drawn from an older shape: keep the imminent note,
+    // recompute the rest
+    int sampler = interval_sampler_active.load(std::memory_order_relaxed);
+    bool stale = (sampler != lookahead_sampler) || (engine_assignment_serial != lookahead_engines);
+    for(int i = 0; i < DERIVED_COUNT && !stale; i++)
+        stale = fabsf(derived.value[i] - lookahead_derived.value[i]) > LOOKAHEAD_PARAM_TOLERANCE;
+    stale = stale || fabsf(derived.direction_blend - lookahead_derived.direction_blend) > LOOKAHEAD_PARAM_TOLERANCE
+                  || derived.direction_target != lookahead_derived.direction_target;
+    if(stale)
+    {
+        for(int v = 0; v < MAX_VOICES; v++)
+            lookahead_retract(v, LOOKAHEAD_KEEP);
+        lookahead_derived = derived;
+        lookahead_sampler = sampler;
+        lookahead_engines = engine_assignment_serial;
+    }
+
+    for(int v = 0; v < active_voice_count; v++)
+    {
+        LookaheadQueue& q = lookahead[v];
+        while(q.head.load(std::memory_order_relaxed) - q.tail.load(std::memory_order_acquire)
+              < LOOKAHEAD_DEPTH)
+            lookahead_push(v);
+    }
+}
+
+// ============================================================================
+// CONTROL TICK
+// ============================================================================
+
+// Control context, after parameters_smoothed[] has been updated
+void apply_parameters()
+{
+    // Number of generator voices stepped per trigger (1 to MAX_VOICES)
+    active_voice_count = 1 + (int)(parameters_smoothed[PARAM_VOICE_COUNT] * (MAX_VOICES - 1) + 0.5f);
+
+    // Tendency or Markov engine per voice
+    assign_voice_engines(parameters_smoothed[PARAM_ENGINE]);
+
+    // Derive energy-coupled values once per tick, then reshape the
+    // interval sampler if MOTION/ENERGY/LEAP SHAPE moved
+    derive_parameters();
+    publish_control_snapshot(active_voice_count);
+    refresh_interval_sampler(false);
+}
+
+// ============================================================================
+// LEARNING ENTRY POINTS
+// ============================================================================
+// The parts of learning that do not touch hardware: the firmware wraps them
+// with its timeouts, LED and MIDI echo, the host simulator calls them directly.
+
+// Forget the active slot's corpus and everything learned from it
+void reset_corpus()
+{
+    phrase->note_buffer_count = 0;
+    phrase->note_buffer_written = 0;
+    reset_tendency_analysis();
+    markov_reset();
+}
+
+// Store one note in the active slot's corpus and fold it into the analysis
+void corpus_add_note(uint8_t note)
+{
+    phrase->note_buffer[phrase->note_buffer_written & (LEARN_CORPUS_SIZE - 1)] = note;
+    phrase->note_buffer_written++;
+    phrase->note_buffer_count++;
+
+    analyze_note(note);
+    markov_learn_latest();
+    if(phrase_injecting)
+        refresh_interval_sampler(true);  // Generation follows the new phrase
+}
+
+// Live phrase injection: the next notes form a new phrase blended into the
+// (fading) corpus while generation continues
+void begin_injection()
+{
+    phrase_injecting = true;
+    phrase->note_buffer_count = 0;
+    begin_phrase_analysis();
+}
+
+// A phrase has been learned: shape the sampler, start every voice from it
+void begin_generating(uint32_t seed)
+{
+    // Tendencies were analyzed note by note; shape the sampler
+    refresh_interval_sampler(true);
+    phrase->tendencies_ready = true;
+
+    // Initialize generation state of every voice from learned notes
+    for(int v = 0; v < MAX_VOICES; v++)
+    {
+        lookahead_clear(v);
+        reset_voice(v, seed);
+    }
+    seed_rhythm(seed);
+    lookahead_derived = derived;
+    lookahead_sampler = interval_sampler_active.load(std::memory_order_relaxed);
+
+    learning_state = STATE_GENERATING;
+}
@@ -0,0 +1,719 @@
+/**
+ * Generative Generator - generator core
+ *
+ * Learning, tendency analysis and note generation, independent of the Daisy
+ * hardware. The firmware (GenerativeGenerator.cpp) and the host simulator
+ * (host/) both build generator_core.cpp; the only thing the core needs from
+ * its platform is a millisecond clock, see platform_now_ms().
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// ============================================================================
+// PLATFORM HOOKS
+// ============================================================================
+
+// Milliseconds since startup (System::GetNow() on the Daisy, virtual time on
+// the host); only used to seed random streams
+uint32_t platform_now_ms();
+
+// ============================================================================
+// GENERATOR INPUTS
+// ============================================================================
+
+const int TOTAL_PARAMS = 16;
+
+// Parameter indices (for clarity)
+enum ParamIndex {
+    // Page 0: Performance - Direct Control
+    PARAM_MOTION = 0,
+    PARAM_MEMORY = 1,
+    PARAM_REGISTER = 2,
+    PARAM_DIRECTION = 3,
+    // Page 1: Performance - Macro & Evolution
+    PARAM_PHRASE = 4,
+    PARAM_ENERGY = 5,
+    PARAM_STABILITY = 6,
+    PARAM_FORGETFULNESS = 7,
+    // Page 2: Structural - Shape & Gravity
+    PARAM_LEAP_SHAPE = 8,
+    PARAM_DIRECTION_MEMORY = 9,
+    PARAM_HOME_REGISTER = 10,
+    PARAM_RANGE_WIDTH = 11,
+    // Page 3: Utility - Learning & I/O
+    PARAM_LEARN_TIMEOUT = 12,
+    PARAM_ECHO_NOTES = 13,
+    PARAM_VOICE_COUNT = 14,
+    PARAM_ENGINE = 15
+};
+
+// Smoothed parameter values (0.0-1.0), written by the control loop
+extern float parameters_smoothed[TOTAL_PARAMS];
+
+void default_parameters();
+
+// ============================================================================
+// NOTE LEARNING SYSTEM
+// ============================================================================
+
+// Learning states
+enum LearningState {
+    STATE_IDLE,        // Waiting for input
+    STATE_LEARNING,    // Recording notes
+    STATE_GENERATING   // Playing back variations
+};
+
+extern LearningState learning_state;
+extern bool phrase_injecting;      // New phrase arriving while GENERATING
+
+// Note buffer: ring-buffered learning corpus (stores MIDI note numbers 0-127)
+// Every learned or injected note is kept until LEARN_CORPUS_SIZE newer ones
+// overwrite it. A single phrase ends after MAX_LEARN_NOTES; longer playing
+// continues as back-to-back injected phrases into the same corpus.
+#ifndef LEARN_CORPUS_SIZE
+#define LEARN_CORPUS_SIZE 1024
+#endif
+static_assert((LEARN_CORPUS_SIZE & (LEARN_CORPUS_SIZE - 1)) == 0,
+              "LEARN_CORPUS_SIZE must be a power of two");
+const int MIN_LEARN_NOTES = 4;
+const int MAX_LEARN_NOTES = 16;         // Notes per phrase
+
+// ============================================================================
+// TENDENCY ANALYSIS (extracted from learned notes)
+// ============================================================================
+
+// Interval histogram resolution (0..MAX_INTERVAL semitones, larger is capped)
+const int MAX_INTERVAL = 12;
+const int INTERVAL_HISTOGRAM_SIZE = MAX_INTERVAL + 1;
+
+// Scale templates fitted to the learned pitch classes (see SCALE QUANTIZATION)
+enum ScaleTemplate {
+    SCALE_MAJOR = 0,
+    SCALE_NATURAL_MINOR,
+    SCALE_HARMONIC_MINOR,
+    SCALE_DORIAN,
+    SCALE_MAJOR_PENTATONIC,
+    SCALE_MINOR_PENTATONIC,
+    SCALE_TEMPLATE_COUNT
+};
+const int PITCH_CLASSES = 12;
+
+// FORGETFULNESS maps to the half-life of a note's weight, in notes:
+// 0.0 = LEARN_CORPUS_SIZE (the whole corpus counts), 1.0 = FORGET_HALF_LIFE_MIN
+const float FORGET_HALF_LIFE_MIN = 4.0f;
+
+struct LearnedTendencies {
+    // Interval distribution (weighted histogram of interval sizes)
+    float interval_counts[INTERVAL_HISTOGRAM_SIZE];  // 0=unison, 1=semitone, ... 12=octave
+    float total_intervals;
+
+    // Direction tendencies (weighted counts)
+    float ascending_count;
+    float descending_count;
+    float repeat_count;      // Same note twice in a row
+
+    // Register analysis
+    float register_center;   // Average MIDI note number
+    float register_range;    // Max - min note
+    uint8_t register_min;
+    uint8_t register_max;
+
+    // Most common intervals (for weighted generation)
+    int most_common_interval;
+    int second_common_interval;
+
+    // Scale fitted to the pitch classes: best template and root overall,
+    // and the best root of every template (valid while scale_fitted)
+    bool    scale_fitted;
+    uint8_t scale_template;
+    uint8_t scale_root;
+    uint8_t template_root[SCALE_TEMPLATE_COUNT];
+};
+
+// Online accumulator behind tendencies
+struct TendencyAccumulator {
+    float interval_weight[INTERVAL_HISTOGRAM_SIZE];
+    float ascending;
+    float descending;
+    float repeat;
+    float pitch_class_weight[PITCH_CLASSES];
+    float note_sum;          // Weighted sum of notes (register center)
+    float note_weight;
+    uint8_t phrase_min;      // Register extent of the current phrase
+    uint8_t phrase_max;
+    uint8_t previous_note;
+    int phrase_notes;        // Notes of the current phrase analyzed so far
+};
+
+// Rhythm of the learned notes (see RHYTHM ANALYSIS): inter-onset interval
+// and duration histograms on a log time scale, RHYTHM_BINS_PER_OCTAVE bins
+// per doubling from RHYTHM_MIN_MS (25 ms - 2.7 s) with the weighted time sum
+// of each bin, and velocity in RHYTHM_VELOCITY_BINS steps. Decayed per note
+// like the pitch tendencies.
+const int   RHYTHM_TIME_BINS = 28;
+const int   RHYTHM_BINS_PER_OCTAVE = 4;
+const float RHYTHM_MIN_MS = 25.0f;
+const int   RHYTHM_VELOCITY_BINS = 16;  // 8 velocity values per bin
+
+struct RhythmAccumulator {
+    float    ioi_weight[RHYTHM_TIME_BINS];
+    float    ioi_ms_sum[RHYTHM_TIME_BINS];       // Mean IOI of bin i = sum / weight
+    float    duration_weight[RHYTHM_TIME_BINS];
+    float    duration_ms_sum[RHYTHM_TIME_BINS];
+    float    velocity_weight[RHYTHM_VELOCITY_BINS];
+    uint32_t last_onset_ms;  // Onset of the latest learned note
+    uint8_t  held_note;      // That note, while note_held
+    bool     onset_valid;    // last_onset_ms belongs to the current phrase
+    bool     note_held;      // Its release (duration) is still to come
+};
+
+// Phrase bank: every learned phrase keeps its own corpus and its complete
+// analysis (tendency and rhythm accumulators, published tendencies, Markov table), so
+// switching phrases only moves the `phrase` pointer. Learning, analysis and
+// generation always work on the active slot.
+#define MARKOV_MAX_ORDER 3
+#define MARKOV_TABLE_BITS 8
+#define MARKOV_TABLE_SLOTS (1 << MARKOV_TABLE_BITS)
+#define MARKOV_SUCCESSORS 4              // Successors kept per context
+
+struct MarkovContext {
+    uint32_t key;                            // 0 = empty slot
+    int8_t   successor[MARKOV_SUCCESSORS];   // Signed interval
+    uint8_t  count[MARKOV_SUCCESSORS];       // 0 = unused entry
+};
+
+struct PhraseSlot {
+    uint8_t  note_buffer[LEARN_CORPUS_SIZE];     // Corpus ring
+    uint32_t note_buffer_written;                // Notes ever stored (ring head)
+    int32_t  note_buffer_count;                  // Notes in the current phrase
+    bool     tendencies_ready;                   // A phrase has been learned (generation allowed)
+    LearnedTendencies   tendencies;
+    TendencyAccumulator tendency_acc;
+    RhythmAccumulator   rhythm;
+    MarkovContext       markov_table[MARKOV_TABLE_SLOTS];
+};
+
+#define PHRASE_SLOTS 4
+extern PhraseSlot phrase_bank[PHRASE_SLOTS];
+extern PhraseSlot* phrase;                       // Active slot
+extern int phrase_slot;
+
+int  corpus_count();
+uint8_t corpus_note(int age);
+void reset_tendency_analysis();
+void begin_phrase_analysis();
+float forget_decay_per_note();
+void decay_tendency_analysis(float decay);
+void analyze_learned_notes();
+void analyze_note(uint8_t note);
+void fit_scale(LearnedTendencies& tendencies, const TendencyAccumulator& acc);
+
+// ============================================================================
+// FIXED POINT (Q16, for the fixed-point generator path)
+// ============================================================================
+
+// Signed 16.16: 1.0 = Q16_ONE. Values are converted from float in control
+// context only; the fixed-point generator path itself never touches the FPU.
+typedef int32_t q16_t;
+const int   Q16_SHIFT = 16;
+const q16_t Q16_ONE = 1 << Q16_SHIFT;
+
+// Rounded conversion (constant folded when x is a constant)
+constexpr q16_t q16_from_float(float x)
+{
+    return (q16_t)(x * (float)Q16_ONE + (x < 0.0f ? -0.5f : 0.5f));
+}
+
+// Product of two Q16 values (one SMULL on the Cortex-M7)
+inline q16_t q16_mul(q16_t a, q16_t b)
+{
+    return (q16_t)(((int64_t)a * b) >> Q16_SHIFT);
+}
+
+// ============================================================================
+// DERIVED PARAMETERS (computed once per control tick)
+// ============================================================================
+
+enum DerivedIndex {
+    DERIVED_MOTION = 0,   // MOTION + energy: more leaps
+    DERIVED_MEMORY,       // MEMORY - energy: more novelty
+    DERIVED_GRAVITY,      // REGISTER - energy: more exploration
+    DERIVED_RANGE,        // RANGE_WIDTH + energy: more octave displacement
+    DERIVED_PHRASE,       // PHRASE + energy: looser, longer phrases
+    DERIVED_COUNT
+};
+
+// Source parameter and energy coupling (+ = increases with energy)
+struct EnergyCoupling {
+    ParamIndex source;
+    float      energy_scale;
+};
+
+struct alignas(32) DerivedParams {
+    float   value[DERIVED_COUNT];       // Energy-coupled values, clamped 0.0-1.0
+    float   direction_blend;            // How far DIRECTION overrides learned (0.0-1.0)
+    float   direction_target;           // 1.0 = up, 0.0 = down
+    int32_t phrase_target_length;       // 4 to 32 notes
+};
+static_assert(sizeof(DerivedParams) == 32, "DerivedParams should fill one cache line");
+
+extern DerivedParams derived;
+
+// Clamp to 0.0-1.0 (compiles to VMINNM/VMAXNM, no branches)
+inline float clamp01(float x)
+{
+    return fminf(fmaxf(x, 0.0f), 1.0f);
+}
+
+void derive_parameters();
+
+// ============================================================================
+// CONTROL SNAPSHOT (control context -> generator / audio callback)
+// ============================================================================
+
+// The derived block in Q16, plus the memory weight slope: a note seen n times
+// in the history weighs 1 + memory_bias * n / NOTE_HISTORY_SIZE
+struct FixedDerivedParams {
+    q16_t value[DERIVED_COUNT];
+    q16_t direction_blend;
+    q16_t direction_target;
+    q16_t memory_bias;
+};
+
+struct ControlSnapshot {
+    DerivedParams derived;
+    FixedDerivedParams fixed;           // Same tick, for the fixed-point path
+    float   smoothed[TOTAL_PARAMS];
+    int32_t active_voice_count;
+};
+
+extern ControlSnapshot control_snapshots[2];
+extern std::atomic<int> control_snapshot_active;
+
+void publish_control_snapshot(int voice_count);
+
+// Any context: the most recently published tick
+inline const ControlSnapshot& control_snapshot()
+{
+    return control_snapshots[control_snapshot_active.load(std::memory_order_acquire)];
+}
+
+// ============================================================================
+// GENERATOR VOICES (struct-of-arrays)
+// ============================================================================
+
+#define MAX_VOICES 8
+
+// Note history for memory/repetition bias
+// Size can be raised for long-form memory (e.g. -DNOTE_HISTORY_SIZE=256);
+// lookups stay O(1) through the per-pitch occupancy counters
+#ifndef NOTE_HISTORY_SIZE
+#define NOTE_HISTORY_SIZE 8
+#endif
+static_assert(NOTE_HISTORY_SIZE > 0 && NOTE_HISTORY_SIZE <= 1024,
+              "NOTE_HISTORY_SIZE must be 1-1024");
+
+// xoshiro128++ state, RNG_LANES interleaved lanes (one stream per voice).
+// Lanes are stored component-wise so a pool fill steps all lanes with the
+// same instructions and no dependency between them.
+#define RNG_LANES 4
+#define RNG_POOL_SIZE 16  // Values per block fill (multiple of RNG_LANES)
+
+struct RngStream {
+    uint32_t s0[RNG_LANES];
+    uint32_t s1[RNG_LANES];
+    uint32_t s2[RNG_LANES];
+    uint32_t s3[RNG_LANES];
+};
+
+struct GeneratorVoices {
+    // Generation state
+    uint8_t  current_note[MAX_VOICES];          // Current generated note (MIDI)
+    uint8_t  previous_note[MAX_VOICES];         // Previous note for direction memory
+    int16_t  last_interval[MAX_VOICES];         // Last interval taken
+    bool     last_direction_up[MAX_VOICES];     // Last direction was ascending
+
+    // Phrase length tracking
+    int32_t  phrase_note_count[MAX_VOICES];     // Notes generated in current phrase
+    int32_t  phrase_target_length[MAX_VOICES];  // Target phrase length (from PHRASE parameter)
+
+    // Independent random stream per voice, drawn through a block-filled pool
+    RngStream rng_stream[MAX_VOICES];           // State after the last pool fill
+    RngStream rng_pool_base[MAX_VOICES];        // State the current pool was filled from
+    uint32_t  rng_pool[MAX_VOICES][RNG_POOL_SIZE];
+    uint8_t   rng_pool_index[MAX_VOICES];       // Next unused pool value
+
+    // Engine: 0 = learned tendencies, 1-3 = Markov model of that order
+    uint8_t  markov_order[MAX_VOICES];
+
+    // Output
+    uint8_t  output_note[MAX_VOICES];           // Last note actually emitted
+    uint8_t  midi_channel[MAX_VOICES];          // 0-15
+
+    // Note history (circular buffer) with per-pitch occupancy counters
+    uint16_t history_count[MAX_VOICES];
+    uint16_t history_index[MAX_VOICES];
+    uint8_t  history[MAX_VOICES][NOTE_HISTORY_SIZE];
+    uint16_t history_pitch_count[MAX_VOICES][128];
+};
+
+extern GeneratorVoices voices;
+extern int active_voice_count;   // Voices stepped per trigger (VOICES parameter)
+
+// ============================================================================
+// RANDOM NUMBER GENERATION
+// ============================================================================
+
+#ifndef RNG_FIXED_SEED
+#define RNG_FIXED_SEED 0  // 0 = seed from platform_now_ms()
+#endif
+
+extern uint32_t rng_fixed_seed;
+
+// Seed for voice resets
+inline uint32_t rng_session_seed()
+{
+    return (rng_fixed_seed != 0) ? rng_fixed_seed : platform_now_ms();
+}
+
+// Extra variation mixed in at phrase boundaries (none when deterministic)
+inline uint32_t rng_jitter()
+{
+    return (rng_fixed_seed != 0) ? 0u : platform_now_ms();
+}
+
+void rng_fill(int v);
+void seed_voice_rng(int v, uint32_t seed);
+
+// Next raw 32-bit value from a voice's stream
+inline uint32_t random_u32(int v)
+{
+    if(voices.rng_pool_index[v] >= RNG_POOL_SIZE)
+        rng_fill(v);
+    return voices.rng_pool[v][voices.rng_pool_index[v]++];
+}
+
+// Random float 0.0 to 1.0 (exclusive) from a voice's stream: the top 23 bits
+// become the mantissa of a float in [1, 2), no division
+inline float random_float(int v)
+{
+    uint32_t bits = (random_u32(v) >> 9) | 0x3F800000u;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f - 1.0f;
+}
+
+// ============================================================================
+// RHYTHM ANALYSIS (learned timing, sampled by the self-clocked mode)
+// ============================================================================
+
+// One drawn note of the learned rhythm
+struct RhythmStep {
+    uint16_t ioi_ms;       // Time to the next onset
+    uint16_t duration_ms;  // Note length (at most ioi_ms)
+    uint8_t  velocity;     // 1-127
+};
+
+extern uint32_t rhythm_rng;  // Stream of the rhythm draws (separate from every voice)
+
+// Learning (fed alongside corpus_add_note): a note starts / a note ends
+void rhythm_learn_onset(uint32_t time_ms, uint8_t note, uint8_t velocity);
+void rhythm_learn_release(uint32_t time_ms, uint8_t note);
+
+int   rhythm_time_bin(float ms);
+float rhythm_bin_ms(int bin);
+bool  rhythm_ready();        // The active slot has learned at least one interval
+void  seed_rhythm(uint32_t seed);
+RhythmStep draw_rhythm_step();
+
+// ============================================================================
+// SCALE QUANTIZATION (pitch lookup tables, rebuilt with the interval sampler)
+// ============================================================================
+
+// scale_select: chromatic (raw semitones, no quantization), the template that
+// fits the learned pitch classes best, or SCALE_SELECT_FIXED + template on
+// that template's best-fitting root
+const int SCALE_SELECT_CHROMATIC = 0;
+const int SCALE_SELECT_AUTO = 1;
+const int SCALE_SELECT_FIXED = 2;
+const int SCALE_SELECT_COUNT = SCALE_SELECT_FIXED + SCALE_TEMPLATE_COUNT;
+extern int scale_select;
+
+// Every MIDI note of the scale numbered in ascending order (its degree);
+// a move of k scale steps is degree_note[degree[note] + k]
+struct ScaleMap {
+    uint8_t snap[128];          // Nearest in-scale note (ties go down)
+    uint8_t degree[128];        // Degree of snap[note]
+    uint8_t degree_note[128];   // Note of each degree
+    uint8_t degree_count;       // In-scale notes in 0-127
+    uint8_t steps_per_octave;   // 12 = chromatic
+};
+
+extern const char* const scale_template_names[SCALE_TEMPLATE_COUNT];  // Up to 4 characters
+extern const char* const pitch_class_names[PITCH_CLASSES];           // "C", "C#", ...
+
+int  scale_key_for(int select);   // 0 = chromatic, else 1 + template * 12 + root
+void build_scale_map(ScaleMap& map, int key);
+
+// Move a note by signed scale steps, clamped to the MIDI range
+inline uint8_t scale_step(const ScaleMap& map, uint8_t note, int steps)
+{
+    int d = (int)map.degree[note] + steps;
+    d = d < 0 ? 0 : (d >= map.degree_count ? map.degree_count - 1 : d);
+    return map.degree_note[d];
+}
+
+// ============================================================================
+// INTERVAL SAMPLER (alias table, rebuilt on learn / shape change)
+// ============================================================================
+
+// The sampler tables in Q16, with the learned direction and register the
+// float path reads from phrase->tendencies (published with them, since the
+// sampler is rebuilt whenever those change during generation)
+struct FixedSamplerTables {
+    q16_t probability[INTERVAL_HISTOGRAM_SIZE];
+    q16_t threshold[INTERVAL_HISTOGRAM_SIZE];
+    q16_t learned_up_probability;   // ascending / (ascending + descending), 0.5 if none
+    q16_t register_center;          // MIDI note
+};
+
+// Interval sizes are scale steps of the sampler's scale (semitones when
+// chromatic); sampler and scale are published together
+struct IntervalSampler {
+    float   probability[INTERVAL_HISTOGRAM_SIZE];  // Shaped distribution (sums to 1.0)
+    float   threshold[INTERVAL_HISTOGRAM_SIZE];  // Probability of keeping column i
+    uint8_t alias[INTERVAL_HISTOGRAM_SIZE];      // Interval used otherwise
+    FixedSamplerTables fixed;                    // Same tables for the fixed-point path
+    int     motion_key;                          // Quantized shape it was built for
+    int     leap_key;
+    int     scale_key;                           // Scale it was built for
+    ScaleMap scale;
+};
+
+const float SAMPLER_KEY_STEPS = 64.0f;       // Shape parameter quantization
+const float LEAP_SHAPE_MAX_DECAY = 0.5f;     // Weight decay per semitone at LEAP SHAPE 0/1
+
+extern IntervalSampler interval_samplers[2];
+extern std::atomic<int> interval_sampler_active;
+extern bool interval_sampler_built;
+extern IntervalSampler phrase_samplers[PHRASE_SLOTS];
+extern bool phrase_sampler_valid[PHRASE_SLOTS];
+
+// Any context: the most recently published sampler
+inline const IntervalSampler& active_interval_sampler()
+{
+    return interval_samplers[interval_sampler_active.load(std::memory_order_acquire)];
+}
+
+void build_interval_sampler(IntervalSampler& sampler, float motion_bias, float leap_shape);
+void refresh_interval_sampler(bool force);
+void install_phrase_sampler();
+
+// ============================================================================
+// NOTE GENERATION SYSTEM
+// ============================================================================
+
+enum CandidateMode {
+    CANDIDATE_REJECTION = 0,
+    CANDIDATE_WEIGHTED = 1
+};
+extern CandidateMode candidate_mode;
+
+extern uint32_t markov_table_full;        // Contexts dropped: no free slot within probe range
+extern uint32_t engine_assignment_serial; // Bumped whenever an assignment changes
+
+void add_note_to_history(int v, uint8_t note);
+void clear_note_history(int v);
+void markov_reset();
+void markov_learn_latest();
+void assign_voice_engines(float engine_param);
+
+// ----------------------------------------------------------------------------
+// Generator arithmetic: the decision pipeline (direction, gravity, memory,
+// displacement, candidate weights and draws) is written once against a math
+// policy and instantiated for both. FloatMath is the reference; FixedMath
+// runs the same decisions in Q16 integers from the tables published with the
+// control snapshot and the interval sampler, so a note costs a fixed sequence
+// of integer multiplies and adds: no FPU, no libm, no data-dependent
+// float-to-int conversions. Its random draws are the top 16 bits of the same
+// streams, so the two paths follow the same distributions but not the same
+// note sequence.
+// ----------------------------------------------------------------------------
+
+#ifndef GENERATOR_FIXED_POINT
+#define GENERATOR_FIXED_POINT 0  // 1 = generate_next_note() runs FixedMath
+#endif
+
+struct FloatMath {
+    typedef float value_t;
+    typedef DerivedParams params_t;
+
+    static constexpr value_t k(float x) { return x; }
+    static value_t from_int(int x) { return (float)x; }
+    static value_t mul(value_t a, value_t b) { return a * b; }
+    static value_t div_by(value_t a, float divisor) { return a / divisor; }
+    static value_t ratio(int numerator, int denominator)
+    {
+        return (float)numerator / (float)denominator;
+    }
+
+    // Uniform in [0, 1)
+    static value_t random(int v) { return random_float(v); }
+
+    // Uniform column of `columns`, and the position inside it in [0, 1)
+    static value_t random_column(int v, int columns, int& column)
+    {
+        float x = random_float(v) * (float)columns;
+        column = (int)x;
+        if(column >= columns) column = columns - 1;
+        return x - (float)column;
+    }
+
+    static const params_t& params(const ControlSnapshot& snapshot) { return snapshot.derived; }
+    static value_t memory_weight(const params_t& params, int history_count);
+
+    static value_t interval_probability(const IntervalSampler& sampler, int size)
+    {
+        return sampler.probability[size];
+    }
+    static value_t threshold(const IntervalSampler& sampler, int column)
+    {
+        return sampler.threshold[column];
+    }
+    static value_t learned_up_probability(const IntervalSampler& sampler);
+    static value_t register_center(const IntervalSampler& sampler);
+    static const value_t* octave_shift_probs(bool wide);
+};
+
+struct FixedMath {
+    typedef q16_t value_t;
+    typedef FixedDerivedParams params_t;
+
+    static constexpr value_t k(float x) { return q16_from_float(x); }
+    static value_t from_int(int x) { return (q16_t)(x * Q16_ONE); }
+    static value_t mul(value_t a, value_t b) { return q16_mul(a, b); }
+    static value_t div_by(value_t a, float divisor) { return q16_mul(a, k(1.0f / divisor)); }
+
+    // Saturates at 2.0 (every caller caps the ratio at 1.0 or below)
+    static value_t ratio(int numerator, int denominator)
+    {
+        if(numerator > 2 * denominator)
+            numerator = 2 * denominator;
+        return (q16_t)(((uint32_t)numerator << Q16_SHIFT) / (uint32_t)denominator);
+    }
+
+    static value_t random(int v) { return (q16_t)(random_u32(v) >> (32 - Q16_SHIFT)); }
+
+    static value_t random_column(int v, int columns, int& column)
+    {
+        uint64_t x = (uint64_t)random_u32(v) * (uint32_t)columns;
+        column = (int)(x >> 32);
+        return (q16_t)((uint32_t)x >> (32 - Q16_SHIFT));
+    }
+
+    static const params_t& params(const ControlSnapshot& snapshot) { return snapshot.fixed; }
+    static value_t memory_weight(const params_t& params, int history_count)
+    {
+        q16_t weight = Q16_ONE + params.memory_bias * history_count / NOTE_HISTORY_SIZE;
+        return weight > 0 ? weight : 0;
+    }
+
+    static value_t interval_probability(const IntervalSampler& sampler, int size)
+    {
+        return sampler.fixed.probability[size];
+    }
+    static value_t threshold(const IntervalSampler& sampler, int column)
+    {
+        return sampler.fixed.threshold[column];
+    }
+    static value_t learned_up_probability(const IntervalSampler& sampler)
+    {
+        return sampler.fixed.learned_up_probability;
+    }
+    static value_t register_center(const IntervalSampler& sampler)
+    {
+        return sampler.fixed.register_center;
+    }
+    static const value_t* octave_shift_probs(bool wide);
+};
+
+#if GENERATOR_FIXED_POINT
+typedef FixedMath GeneratorMath;
+#else
+typedef FloatMath GeneratorMath;
+#endif
+
+// Next note of voice v with either policy (instantiated for both), and with
+// the one the build selected
+template <class Math>
+uint8_t generate_next_note_with(int v);
+
+inline uint8_t generate_next_note(int v)
+{
+    return generate_next_note_with<GeneratorMath>(v);
+}
+
+void reset_voice(int v, uint32_t seed);
+
+// ============================================================================
+// LOOKAHEAD PRE-GENERATION QUEUE
+// ============================================================================
+
+#define LOOKAHEAD_DEPTH 4                       // Notes queued ahead per voice
+const int LOOKAHEAD_KEEP = 1;                   // Entries kept on a parameter change
+const float LOOKAHEAD_PARAM_TOLERANCE = 0.02f;  // Derived change that forces a recompute
+extern bool lookahead_enabled;
+
+struct LookaheadEntry {
+    uint8_t  note;
+    // Undo record: voice state before this note was generated
+    uint8_t  current_note;
+    uint8_t  previous_note;
+    bool     last_direction_up;
+    int16_t  last_interval;
+    uint8_t  evicted_note;      // History slot content that was overwritten
+    bool     history_grew;      // History was not yet full (nothing evicted)
+    int32_t  phrase_note_count;
+    int32_t  phrase_target_length;
+    RngStream rng_pool_base;    // Stream position: pool base and index
+    uint8_t   rng_pool_index;
+};
+
+struct LookaheadQueue {
+    LookaheadEntry entries[LOOKAHEAD_DEPTH];
+    std::atomic<uint32_t> head{0};  // Written by main loop (generator)
+    std::atomic<uint32_t> tail{0};  // Advanced by trigger pops and by retraction
+};
+
+extern LookaheadQueue lookahead[MAX_VOICES];
+extern DerivedParams lookahead_derived;   // Derived block the queues were built from
+extern int      lookahead_sampler;        // Interval sampler copy they were built from
+extern uint32_t lookahead_engines;        // Engine assignment they were built with
+extern uint32_t lookahead_underruns;      // Triggers that found an empty queue
+extern uint32_t lookahead_recomputes;     // Notes retracted and regenerated
+
+bool lookahead_pop(int v, uint8_t& note);
+void lookahead_push(int v);
+void lookahead_retract(int v, int keep);
+void lookahead_clear(int v);
+void service_lookahead();
+
+// ============================================================================
+// CONTROL TICK
+// ============================================================================
+
+void apply_parameters();
+
+// ============================================================================
+// LEARNING ENTRY POINTS
+// ============================================================================
+
+void reset_corpus();
+void corpus_add_note(uint8_t note);
+void begin_injection();
+void begin_generating(uint32_t seed);
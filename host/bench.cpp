@@ -0,0 +1,219 @@
+/**
+ * Generative Generator - host benchmark
+ *
+ * Host counterpart of the on-target benchmark build: runs the core benchmarks
+ * (../benchmark.cpp) and prints one line per result. Cycles come from the TSC
+ * on x86 (nanoseconds elsewhere), so compare runs of the same machine only.
+ *
+ *   gg_bench [-n notes]                      Run, print results
+ *   gg_bench [-n notes] --compare base.txt   Run, compare against a saved run
+ *   gg_bench --compare base.txt new.txt      Compare two saved runs (also
+ *                                            works on target serial logs)
+ *   -t <percent>                             Regression threshold (default 10)
+ *
+ * --compare exits with status 1 if any avg_cycles grew by more than the
+ * threshold.
+ */
+
+#include "benchmark.h"
+#include "generator_core.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// ============================================================================
+// PLATFORM HOOKS
+// ============================================================================
+
+uint32_t platform_now_ms()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+static uint64_t steady_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint32_t platform_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__rdtsc();
+#else
+    return (uint32_t)steady_ns();
+#endif
+}
+
+// Counter rate, measured once against the steady clock
+uint32_t platform_cycles_per_second()
+{
+    static uint32_t rate = 0;
+    if(rate == 0)
+    {
+        uint64_t start_ns = steady_ns();
+        uint32_t start = platform_cycles();
+        while(steady_ns() - start_ns < 20000000)  // 20 ms
+            ;
+        uint64_t cycles = (uint32_t)(platform_cycles() - start);
+        rate = (uint32_t)(cycles * 1000000000u / (steady_ns() - start_ns));
+    }
+    return rate;
+}
+
+// ============================================================================
+// COMPARISON
+// ============================================================================
+
+struct SavedResult {
+    std::string name;
+    unsigned long avg_cycles;
+};
+
+static std::vector<SavedResult> parse_results(FILE* f)
+{
+    std::vector<SavedResult> results;
+    char line[256];
+    while(fgets(line, sizeof(line), f))
+    {
+        char name[64];
+        unsigned long count, avg, max, ns;
+        // Lines may carry a log prefix on target captures: find the name
+        const char* starts[] = {"gen.", "learn.", "analyze.", "sampler.", "rhythm.",
+                                "control.", "lookahead.", "loop.", "display."};
+        const char* p = nullptr;
+        for(const char* s : starts)
+        {
+            const char* found = strstr(line, s);
+            if(found && (!p || found < p))
+                p = found;
+        }
+        if(p && sscanf(p, "%63s %lu %lu %lu %lu", name, &count, &avg, &max, &ns) == 5)
+            results.push_back({name, avg});
+    }
+    return results;
+}
+
+static bool load_results(const char* path, std::vector<SavedResult>& results)
+{
+    FILE* f = fopen(path, "r");
+    if(!f)
+    {
+        fprintf(stderr, "gg_bench: cannot read %s\n", path);
+        return false;
+    }
+    results = parse_results(f);
+    fclose(f);
+    return true;
+}
+
+// Returns the number of regressions beyond threshold_percent
+static int compare_results(const std::vector<SavedResult>& base,
+                           const std::vector<SavedResult>& current, double threshold_percent)
+{
+    int regressions = 0;
+    printf("%-24s %10s %10s %8s\n", "# name", "base", "current", "change");
+    for(const SavedResult& now : current)
+    {
+        for(const SavedResult& old : base)
+        {
+            if(old.name != now.name)
+                continue;
+            double change = old.avg_cycles
+                                ? 100.0 * ((double)now.avg_cycles - (double)old.avg_cycles)
+                                      / (double)old.avg_cycles
+                                : 0.0;
+            bool regressed = change > threshold_percent;
+            printf("%-24s %10lu %10lu %+7.1f%%%s\n", now.name.c_str(), old.avg_cycles,
+                   now.avg_cycles, change, regressed ? "  REGRESSION" : "");
+            regressions += regressed ? 1 : 0;
+        }
+    }
+    return regressions;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+static void usage()
+{
+    fprintf(stderr, "usage: gg_bench [-n notes] [-t percent] [--compare base.txt [new.txt]]\n");
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t notes = 20000;
+    double threshold = 10.0;
+    const char* base_path = nullptr;
+    const char* current_path = nullptr;
+
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "-n") == 0 && has_value)
+            notes = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        else if(strcmp(argv[i], "-t") == 0 && has_value)
+            threshold = atof(argv[++i]);
+        else if(strcmp(argv[i], "--compare") == 0 && has_value)
+        {
+            base_path = argv[++i];
+            if(i + 1 < argc && argv[i + 1][0] != '-')
+                current_path = argv[++i];
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    std::vector<SavedResult> current;
+    if(current_path)
+    {
+        if(!load_results(current_path, current))
+            return 2;
+    }
+    else
+    {
+        default_parameters();
+        lookahead_enabled = false;
+
+        static BenchReport report;
+        run_core_benchmarks(report, notes);
+
+        char line[BENCH_LINE_SIZE];
+        if(!base_path)
+            printf("%-24s %8s %10s %10s %10s\n", "# name", "count", "avg_cycles", "max_cycles",
+                   "avg_ns");
+        for(int i = 0; i < report.count; i++)
+        {
+            bench_format(report.results[i], line, sizeof(line));
+            if(!base_path)
+                printf("%s\n", line);
+            current.push_back({report.results[i].name, (unsigned long)report.results[i].avg_cycles});
+        }
+    }
+
+    if(!base_path)
+        return 0;
+
+    std::vector<SavedResult> base;
+    if(!load_results(base_path, base))
+        return 2;
+    int regressions = compare_results(base, current, threshold);
+    if(regressions > 0)
+        fprintf(stderr, "gg_bench: %d result(s) regressed by more than %.1f%%\n", regressions,
+                threshold);
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * Generative Generator - host tool options
+ *
+ * See options.h.
+ */
+
+#include "options.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+const char* const param_names[TOTAL_PARAMS] = {
+    "motion", "memory", "register", "direction",
+    "phrase", "energy", "stability", "forget",
+    "leap", "dirmem", "home", "range",
+    "timeout", "echo", "voices", "engine"
+};
+
+int parse_parameter(const char* assignment, float& value)
+{
+    const char* eq = strchr(assignment, '=');
+    if(!eq)
+        return -1;
+    size_t length = eq - assignment;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+    {
+        if(strlen(param_names[i]) == length && strncmp(assignment, param_names[i], length) == 0)
+        {
+            value = clamp01((float)atof(eq + 1));
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parse_scale(const char* name)
+{
+    if(strcasecmp(name, "off") == 0)
+        return SCALE_SELECT_CHROMATIC;
+    if(strcasecmp(name, "auto") == 0)
+        return SCALE_SELECT_AUTO;
+    for(int t = 0; t < SCALE_TEMPLATE_COUNT; t++)
+    {
+        if(strcasecmp(name, scale_template_names[t]) == 0)
+            return SCALE_SELECT_FIXED + t;
+    }
+    return -1;
+}
+
+void print_option_names(FILE* f)
+{
+    fprintf(f, "parameters:");
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        fprintf(f, " %s", param_names[i]);
+    fprintf(f, "\nscales: off auto");
+    for(int t = 0; t < SCALE_TEMPLATE_COUNT; t++)
+        fprintf(f, " %s", scale_template_names[t]);
+    fprintf(f, "\n");
+}
+
+bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f)
+        return false;
+    uint8_t chunk[4096];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    fclose(f);
+    return true;
+}
+
+bool write_file(const char* path, const std::vector<uint8_t>& data)
+{
+    FILE* f = fopen(path, "wb");
+    if(!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
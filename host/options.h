@@ -0,0 +1,28 @@
+/**
+ * Generative Generator - host tool options
+ *
+ * Command-line names of the parameters and scales, and whole-file I/O, shared
+ * by the simulator (gg_sim) and the renderer (gg_render).
+ */
+
+#pragma once
+
+#include "generator_core.h"
+
+#include <cstdio>
+#include <vector>
+
+// Command-line names, in ParamIndex order
+extern const char* const param_names[TOTAL_PARAMS];
+
+// "<name>=<value>" (value 0.0-1.0, clamped): the parameter's index, or -1
+int parse_parameter(const char* assignment, float& value);
+
+// off, auto or a scale template name: the scale_select value, or -1
+int parse_scale(const char* name);
+
+// Parameter and scale names for usage messages
+void print_option_names(FILE* f);
+
+bool read_file(const char* path, std::vector<uint8_t>& data);
+bool write_file(const char* path, const std::vector<uint8_t>& data);
@@ -0,0 +1,407 @@
+/**
+ * Generative Generator - replay renderer
+ *
+ * Replays a replay log (../replay_log.h) recorded on the module
+ * (test_midi_replay.py) or written by gg_sim -w through the generator core,
+ * as fast as the core allows, and writes the generated notes to a Standard
+ * MIDI File: format 0, one channel per voice, the tempo of the clock tracked
+ * when recording started. A log renders the same notes every time; a seed,
+ * parameter or scale override renders the same performance (phrase, moves
+ * and triggers) under another setting for A/B comparison.
+ *
+ *   gg_render [options] <log>
+ *
+ *   -o <file.mid>     Write the notes as a Standard MIDI File
+ *   -t                Print the notes as "<ms> <voice> <note> <velocity> <length>"
+ *   -s <seed>         Replay with another seed (non-zero)
+ *   -p <name>=<value> Hold a parameter, 0.0-1.0 (its logged moves are ignored)
+ *   -k <scale>        Hold the scale: off, auto, maj, min, ...
+ *   -r <count>        Replay count times (throughput; the output is the first)
+ *
+ * Triggers, notes and throughput are reported on stderr.
+ */
+
+#include "generator_core.h"
+#include "options.h"
+#include "replay_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// ============================================================================
+// PLATFORM HOOKS
+// ============================================================================
+
+// The log fixes the seed, so the clock is never read for one
+uint32_t platform_now_ms()
+{
+    return 0;
+}
+
+// ============================================================================
+// REPLAY
+// ============================================================================
+
+struct RenderSettings {
+    uint32_t seed;                     // 0 = the logged seed
+    bool     param_held[TOTAL_PARAMS];
+    float    param_value[TOTAL_PARAMS];
+    int      scale;                    // -1 = logged
+};
+
+struct RenderedNote {
+    uint64_t sample;
+    uint16_t length_ms;
+    uint8_t  voice;
+    uint8_t  channel;
+    uint8_t  note;
+    uint8_t  velocity;
+};
+
+struct RenderStats {
+    uint32_t triggers;
+    uint32_t skipped;   // Triggers that found no phrase to generate from
+};
+
+// Log order is main loop order; put every trigger back after the state
+// events it was generated with (stable, so log order holds otherwise)
+static void sort_events(std::vector<ReplayEvent>& events)
+{
+    auto key = [](const ReplayEvent& e) {
+        return (uint64_t)e.serial * 2 + (e.type == REPLAY_TRIGGER ? 1 : 0);
+    };
+    std::stable_sort(events.begin(), events.end(),
+                     [&](const ReplayEvent& a, const ReplayEvent& b) { return key(a) < key(b); });
+}
+
+static void select_slot(int slot)
+{
+    phrase_slot = slot;
+    phrase = &phrase_bank[slot];
+}
+
+// Core state at the start of the log
+static void replay_setup(const ReplayHeader& header, const RenderSettings& settings)
+{
+    default_parameters();
+    lookahead_enabled = false;
+    rng_fixed_seed = settings.seed ? settings.seed : header.seed;
+    candidate_mode = (CandidateMode)header.candidate_mode;
+    scale_select = (settings.scale >= 0) ? settings.scale : header.scale_select;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+        parameters_smoothed[i] = settings.param_held[i] ? settings.param_value[i]
+                                                        : replay_parameter(header.parameters[i]);
+
+    memset(phrase_bank, 0, sizeof(phrase_bank));
+    for(int s = 0; s < PHRASE_SLOTS; s++)
+        phrase_sampler_valid[s] = false;
+    select_slot(header.phrase_slot % PHRASE_SLOTS);
+    memcpy(phrase, header.phrase_data, sizeof(PhraseSlot));
+    learning_state = (LearningState)header.learning_state;
+    phrase_injecting = header.phrase_injecting;
+
+    apply_parameters();
+    refresh_interval_sampler(true);
+}
+
+// The core calls the firmware made for one state event
+static void replay_state_event(const ReplayEvent& e, const RenderSettings& settings)
+{
+    switch(e.type)
+    {
+        case REPLAY_PARAM:
+            if(!settings.param_held[e.index])
+                parameters_smoothed[e.index] = replay_parameter(e.value);
+            break;
+        case REPLAY_SCALE:
+            if(settings.scale < 0)
+                scale_select = e.index;
+            break;
+        case REPLAY_LEARN_START:
+            learning_state = STATE_LEARNING;
+            reset_corpus();
+            break;
+        case REPLAY_INJECT_START: begin_injection(); break;
+        case REPLAY_NOTE_ON:
+            corpus_add_note(e.index);
+            rhythm_learn_onset(e.time_ms, e.index, e.velocity);
+            break;
+        case REPLAY_NOTE_OFF: rhythm_learn_release(e.time_ms, e.index); break;
+        case REPLAY_INJECT_END: phrase_injecting = false; break;
+        case REPLAY_GENERATE: begin_generating(rng_session_seed()); break;
+        case REPLAY_PHRASE_CLEAR:
+            learning_state = STATE_IDLE;
+            phrase->note_buffer_count = 0;
+            phrase->note_buffer_written = 0;
+            phrase_injecting = false;
+            phrase->tendencies_ready = false;
+            break;
+        case REPLAY_PHRASE_SLOT:
+            select_slot(e.index);
+            if(e.slot_data)
+                memcpy(phrase, e.slot_data, sizeof(PhraseSlot));
+            install_phrase_sampler();
+            learning_state = phrase->tendencies_ready ? STATE_GENERATING : STATE_IDLE;
+            break;
+        default: break;
+    }
+}
+
+static RenderStats replay(const ReplayHeader& header, const std::vector<ReplayEvent>& events,
+                          const RenderSettings& settings, std::vector<RenderedNote>* notes)
+{
+    RenderStats stats = {};
+    replay_setup(header, settings);
+
+    // The module applies its parameters every control tick: once before the
+    // next trigger covers every change since the last one
+    bool changed = false;
+    for(const ReplayEvent& e : events)
+    {
+        if(e.type != REPLAY_TRIGGER)
+        {
+            replay_state_event(e, settings);
+            changed = true;
+            continue;
+        }
+
+        if(changed)
+        {
+            apply_parameters();
+            changed = false;
+        }
+        stats.triggers++;
+        if(learning_state != STATE_GENERATING || !phrase->tendencies_ready)
+        {
+            stats.skipped++;
+            continue;
+        }
+        int voice_count = control_snapshot().active_voice_count;
+        for(int v = 0; v < voice_count; v++)
+        {
+            uint8_t note = generate_next_note(v);
+            voices.current_note[v] = note;
+            voices.output_note[v] = note;
+            if(notes)
+                notes->push_back({e.sample, e.value, (uint8_t)v, voices.midi_channel[v], note,
+                                  e.velocity});
+        }
+    }
+    return stats;
+}
+
+// ============================================================================
+// STANDARD MIDI FILE
+// ============================================================================
+
+const int SMF_DIVISION = 480;   // Ticks per quarter note
+
+struct SmfEvent {
+    uint64_t tick;
+    uint32_t order;
+    uint8_t  status;
+    uint8_t  data1;
+    uint8_t  data2;
+};
+
+static void put_be(std::vector<uint8_t>& out, uint32_t value, int bytes)
+{
+    for(int i = bytes - 1; i >= 0; i--)
+        out.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static void put_vlq(std::vector<uint8_t>& out, uint32_t value)
+{
+    uint8_t bytes[5];
+    int n = 0;
+    do
+    {
+        bytes[n++] = value & 0x7F;
+        value >>= 7;
+    } while(value);
+    while(n > 1)
+        out.push_back(bytes[--n] | 0x80);
+    out.push_back(bytes[0]);
+}
+
+static std::vector<uint8_t> build_smf(const ReplayHeader& header,
+                                      const std::vector<RenderedNote>& notes)
+{
+    uint32_t tempo_us = header.tempo_period_us ? header.tempo_period_us : 500000;  // 120 BPM
+    double ticks_per_sample = (double)SMF_DIVISION * 1e6 / ((double)tempo_us * header.sample_rate);
+
+    // Note Off sorts before a Note On of the same tick (repeated notes)
+    std::vector<SmfEvent> events;
+    for(const RenderedNote& n : notes)
+    {
+        uint64_t on = (uint64_t)((double)n.sample * ticks_per_sample + 0.5);
+        uint64_t length = (uint64_t)((double)n.length_ms * header.sample_rate / 1000.0
+                                         * ticks_per_sample + 0.5);
+        events.push_back({on + (length ? length : 1), (uint32_t)events.size(),
+                          (uint8_t)(0x80 | n.channel), n.note, 0});
+        events.push_back({on, (uint32_t)events.size(), (uint8_t)(0x90 | n.channel), n.note,
+                          n.velocity});
+    }
+    std::sort(events.begin(), events.end(), [](const SmfEvent& a, const SmfEvent& b) {
+        if(a.tick != b.tick)
+            return a.tick < b.tick;
+        if((a.status & 0xF0) != (b.status & 0xF0))
+            return (a.status & 0xF0) == 0x80;
+        return a.order < b.order;
+    });
+
+    std::vector<uint8_t> track;
+    put_vlq(track, 0);
+    const uint8_t tempo[] = {0xFF, 0x51, 0x03};
+    track.insert(track.end(), tempo, tempo + 3);
+    put_be(track, tempo_us, 3);
+    uint64_t tick = 0;
+    for(const SmfEvent& e : events)
+    {
+        put_vlq(track, (uint32_t)(e.tick - tick));
+        tick = e.tick;
+        track.push_back(e.status);
+        track.push_back(e.data1);
+        track.push_back(e.data2);
+    }
+    put_vlq(track, 0);
+    const uint8_t end_of_track[] = {0xFF, 0x2F, 0x00};
+    track.insert(track.end(), end_of_track, end_of_track + 3);
+
+    std::vector<uint8_t> out = {'M', 'T', 'h', 'd'};
+    put_be(out, 6, 4);
+    put_be(out, 0, 2);  // Format 0
+    put_be(out, 1, 2);
+    put_be(out, SMF_DIVISION, 2);
+    const uint8_t chunk[] = {'M', 'T', 'r', 'k'};
+    out.insert(out.end(), chunk, chunk + 4);
+    put_be(out, (uint32_t)track.size(), 4);
+    out.insert(out.end(), track.begin(), track.end());
+    return out;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: gg_render [-o file.mid] [-t] [-s seed] [-p name=value]... [-k scale] [-r count]\n"
+            "                 <log>\n");
+    print_option_names(stderr);
+}
+
+int main(int argc, char** argv)
+{
+    RenderSettings settings = {};
+    settings.scale = -1;
+    const char* output = nullptr;
+    const char* input = nullptr;
+    bool text = false;
+    long repeat = 1;
+
+    for(int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if(strcmp(arg, "-o") == 0 && has_value)
+            output = argv[++i];
+        else if(strcmp(arg, "-t") == 0)
+            text = true;
+        else if(strcmp(arg, "-s") == 0 && has_value)
+            settings.seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        else if(strcmp(arg, "-p") == 0 && has_value)
+        {
+            float value;
+            int index = parse_parameter(argv[++i], value);
+            if(index < 0)
+            {
+                usage();
+                return 2;
+            }
+            settings.param_held[index] = true;
+            settings.param_value[index] = value;
+        }
+        else if(strcmp(arg, "-k") == 0 && has_value)
+        {
+            settings.scale = parse_scale(argv[++i]);
+            if(settings.scale < 0)
+            {
+                usage();
+                return 2;
+            }
+        }
+        else if(strcmp(arg, "-r") == 0 && has_value)
+            repeat = atol(argv[++i]);
+        else if(arg[0] != '-' && !input)
+            input = arg;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if(!input || repeat < 1)
+    {
+        usage();
+        return 2;
+    }
+
+    // Decode the whole log up front
+    std::vector<uint8_t> data;
+    if(!read_file(input, data))
+    {
+        fprintf(stderr, "gg_render: cannot read %s\n", input);
+        return 1;
+    }
+    ReplayReader reader;
+    ReplayHeader header;
+    if(!replay_open(reader, data.data(), (uint32_t)data.size(), header))
+    {
+        fprintf(stderr, "gg_render: %s: not a replay log of this build (version %d, %s generator)\n",
+                input, REPLAY_VERSION, GENERATOR_FIXED_POINT ? "fixed-point" : "float");
+        return 1;
+    }
+    std::vector<ReplayEvent> events;
+    ReplayEvent event;
+    int status;
+    while((status = replay_next(reader, event)) > 0)
+        events.push_back(event);
+    if(status < 0)
+        fprintf(stderr, "gg_render: %s: truncated at byte %u, rendering what was read\n", input,
+                reader.pos);
+    sort_events(events);
+
+    std::vector<RenderedNote> notes;
+    RenderStats stats = {};
+    auto start = std::chrono::steady_clock::now();
+    for(long r = 0; r < repeat; r++)
+        stats = replay(header, events, settings, r == 0 ? &notes : nullptr);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(text)
+    {
+        for(const RenderedNote& n : notes)
+            printf("%llu %u %u %u %u\n",
+                   (unsigned long long)(n.sample * 1000 / header.sample_rate), (unsigned)n.voice,
+                   (unsigned)n.note, (unsigned)n.velocity, (unsigned)n.length_ms);
+    }
+    if(output && !write_file(output, build_smf(header, notes)))
+    {
+        fprintf(stderr, "gg_render: cannot write %s\n", output);
+        return 1;
+    }
+
+    double rendered = (double)notes.size() * repeat;
+    fprintf(stderr, "gg_render: %u triggers (%u without a phrase), %zu notes, %u state events",
+            stats.triggers, stats.skipped, notes.size(), reader.events);
+    if(seconds > 0.0 && rendered > 0)
+        fprintf(stderr, ", %.0f notes/s", rendered / seconds);
+    fprintf(stderr, "\n");
+    return 0;
+}
@@ -0,0 +1,523 @@
+/**
+ * Generative Generator - headless host simulator
+ *
+ * Runs the generator core (../generator_core.cpp) on Linux without the Daisy
+ * hardware. A phrase is learned from a Standard MIDI File or a note list,
+ * then notes are generated as fast as the core allows and streamed to stdout
+ * as "<step> <voice> <note>" lines. Throughput is reported on stderr.
+ *
+ *   gg_sim [options] <input.mid | notes.txt>
+ *
+ *   -n <count>        Trigger steps to run (default 10000)
+ *   -v <voices>       Generator voices, 1-8 (default 1)
+ *   -s <seed>         Deterministic seed (default 1, 0 = seed from the clock)
+ *   -p <name>=<value> Set a parameter, 0.0-1.0 (e.g. -p energy=0.8)
+ *   -k <scale>        Quantize to a scale: off (default), auto (fitted to the
+ *                     input), or maj, min, hmin, dor, pent, mpnt on the
+ *                     fitted root
+ *   -l                Go through the lookahead queue like the firmware does
+ *   -q                Quiet: no note output, statistics only
+ *   -w <log>          Also write the run as a replay log for gg_render: the
+ *                     phrase played and the steps triggered 250 ms apart,
+ *                     parameters on the log's 10-bit grid
+ *   -c                Compare the fixed-point path with float instead: note
+ *                     and interval histograms of both under the seed, against
+ *                     float under the next four seeds; exit status 1 if
+ *                     fixed-point is further from float than any of those
+ *
+ * A note list holds MIDI note numbers or names (C4 = 60, F#3, Bb2), separated
+ * by whitespace or commas; '#' starts a comment. Inputs longer than one
+ * phrase are learned as back-to-back injected phrases, as on the module.
+ */
+
+#include "generator_core.h"
+#include "options.h"
+#include "replay_log.h"
+
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// ============================================================================
+// PLATFORM HOOKS
+// ============================================================================
+
+// Wall clock, so that -s 0 differs from run to run
+uint32_t platform_now_ms()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// ============================================================================
+// INPUT
+// ============================================================================
+
+static uint32_t read_be(const uint8_t* p, int bytes)
+{
+    uint32_t value = 0;
+    for(int i = 0; i < bytes; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+struct InputNote {
+    uint32_t tick;
+    uint32_t order;   // File order, keeps simultaneous notes stable
+    uint8_t  note;
+};
+
+// Note On events (velocity > 0) of every track, in time order
+static bool parse_midi_file(const std::vector<uint8_t>& data, std::vector<uint8_t>& notes)
+{
+    if(data.size() < 14 || memcmp(data.data(), "MThd", 4) != 0)
+        return false;
+    size_t pos = 8 + read_be(&data[4], 4);
+    std::vector<InputNote> events;
+
+    while(pos + 8 <= data.size())
+    {
+        uint32_t length = read_be(&data[pos + 4], 4);
+        bool is_track = memcmp(&data[pos], "MTrk", 4) == 0;
+        size_t p = pos + 8;
+        size_t end = std::min(data.size(), p + length);
+        pos = p + length;
+        if(!is_track)
+            continue;
+
+        uint32_t tick = 0;
+        uint8_t status = 0;
+        while(p < end)
+        {
+            uint32_t delta = 0;
+            do
+                delta = (delta << 7) | (data[p] & 0x7F);
+            while((data[p++] & 0x80) && p < end);
+            tick += delta;
+            if(p >= end)
+                break;
+
+            if(data[p] & 0x80)
+                status = data[p++];
+            if(status == 0xFF || status == 0xF0 || status == 0xF7)
+            {
+                if(status == 0xFF)
+                    p++;  // Meta type
+                uint32_t skip = 0;
+                while(p < end)
+                {
+                    uint8_t b = data[p++];
+                    skip = (skip << 7) | (b & 0x7F);
+                    if(!(b & 0x80))
+                        break;
+                }
+                p += skip;
+                status = 0;  // Running status is cancelled
+                continue;
+            }
+
+            int data_bytes = ((status & 0xE0) == 0xC0) ? 1 : 2;
+            if(p + data_bytes > end)
+                break;
+            if((status & 0xF0) == 0x90 && data[p + 1] > 0)
+                events.push_back({tick, (uint32_t)events.size(), (uint8_t)(data[p] & 0x7F)});
+            p += data_bytes;
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+                     [](const InputNote& a, const InputNote& b) { return a.tick < b.tick; });
+    for(const InputNote& e : events)
+        notes.push_back(e.note);
+    return true;
+}
+
+// MIDI note number or name (C4 = 60)
+static bool parse_note_token(const std::string& token, uint8_t& note)
+{
+    if(isdigit((unsigned char)token[0]))
+    {
+        int value = atoi(token.c_str());
+        if(value < 0 || value > 127)
+            return false;
+        note = (uint8_t)value;
+        return true;
+    }
+
+    static const int pitch_class[7] = {9, 11, 0, 2, 4, 5, 7};  // A B C D E F G
+    char letter = (char)toupper((unsigned char)token[0]);
+    if(letter < 'A' || letter > 'G')
+        return false;
+    int value = pitch_class[letter - 'A'];
+    size_t i = 1;
+    for(; i < token.size() && (token[i] == '#' || token[i] == 'b'); i++)
+        value += (token[i] == '#') ? 1 : -1;
+    if(i >= token.size())
+        return false;
+    value += (atoi(token.c_str() + i) + 1) * 12;
+    if(value < 0 || value > 127)
+        return false;
+    note = (uint8_t)value;
+    return true;
+}
+
+static bool parse_note_list(const std::vector<uint8_t>& data, std::vector<uint8_t>& notes)
+{
+    std::string token;
+    bool comment = false;
+    for(size_t i = 0; i <= data.size(); i++)
+    {
+        char c = (i < data.size()) ? (char)data[i] : '\n';
+        if(c == '\n')
+            comment = false;
+        if(c == '#' && token.empty())
+            comment = true;
+        if(comment || isspace((unsigned char)c) || c == ',')
+        {
+            if(!token.empty())
+            {
+                uint8_t note;
+                if(!parse_note_token(token, note))
+                {
+                    fprintf(stderr, "gg_sim: bad note '%s'\n", token.c_str());
+                    return false;
+                }
+                notes.push_back(note);
+                token.clear();
+            }
+            continue;
+        }
+        token += c;
+    }
+    return true;
+}
+
+// ============================================================================
+// SIMULATION
+// ============================================================================
+
+const uint32_t SIM_SAMPLE_RATE = 48000;
+const uint32_t SIM_STEP_MS = 250;    // Spacing of the notes and steps in a written log
+const uint16_t SIM_GATE_MS = 125;
+
+// Replay log of the run (-w), nullptr when not written
+static ReplayWriter* sim_log = nullptr;
+
+static void log_event(ReplayEventType type)
+{
+    if(sim_log)
+        replay_put_event(*sim_log, type);
+}
+
+static void learn_note(uint8_t note, uint32_t index)
+{
+    corpus_add_note(note);
+    if(sim_log)
+        replay_put_note_on(*sim_log, index * SIM_STEP_MS, note, 100);
+}
+
+// Learn the input the way the module does: the first MAX_LEARN_NOTES form the
+// learned phrase, the rest arrive as injected phrases while generating
+static void learn_notes(const std::vector<uint8_t>& notes, uint32_t seed)
+{
+    learning_state = STATE_LEARNING;
+    reset_corpus();
+    log_event(REPLAY_LEARN_START);
+
+    size_t i = 0;
+    for(; i < notes.size() && phrase->note_buffer_count < MAX_LEARN_NOTES; i++)
+        learn_note(notes[i], (uint32_t)i);
+    begin_generating(seed);
+    log_event(REPLAY_GENERATE);
+
+    while(i < notes.size())
+    {
+        begin_injection();
+        log_event(REPLAY_INJECT_START);
+        for(; i < notes.size() && phrase->note_buffer_count < MAX_LEARN_NOTES; i++)
+            learn_note(notes[i], (uint32_t)i);
+        phrase_injecting = false;
+        log_event(REPLAY_INJECT_END);
+    }
+}
+
+// ============================================================================
+// FIXED-POINT COMPARISON (-c)
+// ============================================================================
+
+// Notes and signed intervals (per voice, successive notes) of one run
+struct RunHistograms {
+    std::vector<long> note;
+    std::vector<long> interval;
+};
+
+template <typename M>
+static RunHistograms run_histograms(const std::vector<uint8_t>& notes, uint32_t seed, long steps)
+{
+    RunHistograms h;
+    h.note.assign(128, 0);
+    h.interval.assign(255, 0);
+    learn_notes(notes, seed);
+    apply_parameters();
+    for(long step = 0; step < steps; step++)
+    {
+        for(int v = 0; v < active_voice_count; v++)
+        {
+            uint8_t previous = voices.current_note[v];
+            uint8_t note = generate_next_note_with<M>(v);
+            voices.current_note[v] = note;
+            voices.output_note[v] = note;
+            h.note[note]++;
+            if(step > 0)
+                h.interval[(int)note - (int)previous + 127]++;
+        }
+    }
+    return h;
+}
+
+// Total variation distance of two histograms: 0 = same shape, 1 = disjoint
+static double histogram_distance(const std::vector<long>& a, const std::vector<long>& b)
+{
+    double total_a = 0.0, total_b = 0.0, sum = 0.0;
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        total_a += (double)a[i];
+        total_b += (double)b[i];
+    }
+    if(total_a <= 0.0 || total_b <= 0.0)
+        return 1.0;
+    for(size_t i = 0; i < a.size(); i++)
+        sum += fabs((double)a[i] / total_a - (double)b[i] / total_b);
+    return sum * 0.5;
+}
+
+// The fixed-point path draws from the same streams, so under one seed it
+// should follow float within the spread of float runs under other seeds
+const uint32_t COMPARE_OTHER_SEEDS = 4;
+
+static int compare_fixed_point(const std::vector<uint8_t>& notes, uint32_t seed, long steps)
+{
+    RunHistograms fixed = run_histograms<FixedMath>(notes, seed, steps);
+    RunHistograms reference = run_histograms<FloatMath>(notes, seed, steps);
+    double note_fixed = histogram_distance(fixed.note, reference.note);
+    double interval_fixed = histogram_distance(fixed.interval, reference.interval);
+
+    double note_spread = 0.0, interval_spread = 0.0;
+    for(uint32_t i = 1; i <= COMPARE_OTHER_SEEDS; i++)
+    {
+        RunHistograms other = run_histograms<FloatMath>(notes, seed + i, steps);
+        note_spread = std::max(note_spread, histogram_distance(other.note, reference.note));
+        interval_spread =
+            std::max(interval_spread, histogram_distance(other.interval, reference.interval));
+    }
+
+    printf("# histogram distance to float (seed %u), %ld steps x %d voices\n", seed, steps,
+           active_voice_count);
+    printf("#           fixed   float seeds %u-%u (max)\n", seed + 1, seed + COMPARE_OTHER_SEEDS);
+    printf("notes      %.4f  %.4f\n", note_fixed, note_spread);
+    printf("intervals  %.4f  %.4f\n", interval_fixed, interval_spread);
+
+    bool matches = note_fixed <= note_spread && interval_fixed <= interval_spread;
+    fprintf(stderr, "gg_sim: fixed-point path %s float\n",
+            matches ? "matches" : "differs from");
+    return matches ? 0 : 1;
+}
+
+static void begin_log(ReplayWriter& w, std::vector<uint8_t>& buffer, size_t notes, long steps)
+{
+    ReplayHeader header = {};
+    header.seed = rng_fixed_seed;
+    header.sample_rate = SIM_SAMPLE_RATE;
+    header.scale_select = (uint8_t)scale_select;
+    header.candidate_mode = (uint8_t)candidate_mode;
+    header.phrase_slot = (uint8_t)phrase_slot;
+    header.learning_state = (uint8_t)learning_state;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+    {
+        header.parameters[i] = replay_quantize(parameters_smoothed[i]);
+        parameters_smoothed[i] = replay_parameter(header.parameters[i]);
+    }
+    header.phrase_data = (const uint8_t*)phrase;
+
+    // Note events take at most 8 bytes, triggers 15
+    buffer.resize(REPLAY_HEADER_SIZE + 8 * (notes + 4) + 15 * (size_t)steps + 1);
+    replay_begin(w, buffer.data(), (uint32_t)buffer.size(), header);
+    sim_log = &w;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: gg_sim [-n count] [-v voices] [-s seed] [-p name=value]... [-k scale] [-l] [-q]\n"
+            "              [-w log | -c] <input.mid | notes.txt>\n");
+    print_option_names(stderr);
+}
+
+int main(int argc, char** argv)
+{
+    long steps = 10000;
+    int voice_count = 1;
+    uint32_t seed = 1;
+    bool quiet = false;
+    bool compare = false;
+    const char* input = nullptr;
+    const char* log_path = nullptr;
+
+    default_parameters();
+    lookahead_enabled = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if(strcmp(arg, "-n") == 0 && has_value)
+            steps = atol(argv[++i]);
+        else if(strcmp(arg, "-v") == 0 && has_value)
+            voice_count = atoi(argv[++i]);
+        else if(strcmp(arg, "-s") == 0 && has_value)
+            seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        else if(strcmp(arg, "-p") == 0 && has_value)
+        {
+            float value;
+            int index = parse_parameter(argv[++i], value);
+            if(index < 0)
+            {
+                usage();
+                return 2;
+            }
+            parameters_smoothed[index] = value;
+        }
+        else if(strcmp(arg, "-k") == 0 && has_value)
+        {
+            int select = parse_scale(argv[++i]);
+            if(select < 0)
+            {
+                usage();
+                return 2;
+            }
+            scale_select = select;
+        }
+        else if(strcmp(arg, "-w") == 0 && has_value)
+            log_path = argv[++i];
+        else if(strcmp(arg, "-l") == 0)
+            lookahead_enabled = true;
+        else if(strcmp(arg, "-q") == 0)
+            quiet = true;
+        else if(strcmp(arg, "-c") == 0)
+            compare = true;
+        else if(arg[0] != '-' && !input)
+            input = arg;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if(!input || steps < 0 || voice_count < 1 || voice_count > MAX_VOICES || (compare && log_path))
+    {
+        usage();
+        return 2;
+    }
+    parameters_smoothed[PARAM_VOICE_COUNT] = (float)(voice_count - 1) / (float)(MAX_VOICES - 1);
+
+    // Load the phrase
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> notes;
+    if(!read_file(input, data))
+    {
+        fprintf(stderr, "gg_sim: cannot read %s\n", input);
+        return 1;
+    }
+    bool parsed = (data.size() >= 4 && memcmp(data.data(), "MThd", 4) == 0)
+                      ? parse_midi_file(data, notes)
+                      : parse_note_list(data, notes);
+    if(!parsed || (int)notes.size() < MIN_LEARN_NOTES)
+    {
+        fprintf(stderr, "gg_sim: %s: need at least %d notes\n", input, MIN_LEARN_NOTES);
+        return 1;
+    }
+
+    // Deterministic unless asked to seed from the clock (a log records the seed)
+    rng_fixed_seed = seed;
+    uint32_t session_seed = rng_session_seed();
+    if(compare)
+    {
+        apply_parameters();
+        return compare_fixed_point(notes, session_seed, steps);
+    }
+    ReplayWriter log_writer;
+    std::vector<uint8_t> log_data;
+    if(log_path)
+    {
+        rng_fixed_seed = session_seed;
+        begin_log(log_writer, log_data, notes.size(), steps);
+    }
+    apply_parameters();
+    learn_notes(notes, session_seed);
+    apply_parameters();
+
+    // One step = one Gate 1 trigger: every active voice produces a note
+    static char line[64 * MAX_VOICES];
+    auto start = std::chrono::steady_clock::now();
+    for(long step = 0; step < steps; step++)
+    {
+        if(sim_log)
+            replay_put_trigger(*sim_log, sim_log->events,
+                               (uint32_t)(step * (SIM_STEP_MS * SIM_SAMPLE_RATE / 1000)), 100,
+                               SIM_GATE_MS);
+        size_t length = 0;
+        for(int v = 0; v < active_voice_count; v++)
+        {
+            uint8_t note;
+            if(lookahead_enabled)
+            {
+                service_lookahead();
+                if(!lookahead_pop(v, note))
+                    note = voices.output_note[v];
+            }
+            else
+            {
+                note = generate_next_note(v);
+                voices.current_note[v] = note;
+            }
+            voices.output_note[v] = note;
+            if(!quiet)
+                length += snprintf(line + length, sizeof(line) - length, "%ld %d %u\n", step, v,
+                                   (unsigned)note);
+        }
+        if(!quiet)
+            fwrite(line, 1, length, stdout);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long generated = steps * active_voice_count;
+    fprintf(stderr, "gg_sim: learned %zu notes, generated %ld notes (%d voices) in %.3f s",
+            notes.size(), generated, active_voice_count, seconds);
+    if(seconds > 0.0 && generated > 0)
+        fprintf(stderr, ", %.0f notes/s, %.1f ns/note", generated / seconds,
+                seconds * 1e9 / generated);
+    fprintf(stderr, "\n");
+
+    if(log_path)
+    {
+        replay_end(log_writer);
+        log_data.resize(log_writer.length);
+        if(log_writer.full || !write_file(log_path, log_data))
+        {
+            fprintf(stderr, "gg_sim: cannot write %s\n", log_path);
+            return 1;
+        }
+    }
+
+    int scale_key = active_interval_sampler().scale_key;
+    if(scale_key > 0)
+        fprintf(stderr, "gg_sim: scale %s %s\n", pitch_class_names[(scale_key - 1) % PITCH_CLASSES],
+                scale_template_names[(scale_key - 1) / PITCH_CLASSES]);
+    return 0;
+}
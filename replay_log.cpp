@@ -0,0 +1,315 @@
+/**
+ * Generative Generator - replay log
+ *
+ * Encoding and decoding of the replay log. See replay_log.h.
+ */
+
+#include "replay_log.h"
+
+// ============================================================================
+// WRITER
+// ============================================================================
+
+static const uint8_t replay_magic[4] = {'G', 'G', 'R', 'L'};
+
+static int put_u32(uint8_t* p, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(value >> (8 * i));
+    return 4;
+}
+
+static int put_varint(uint8_t* p, uint32_t value)
+{
+    int n = 0;
+    while(value >= 0x80)
+    {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+// Append one encoded event, or mark the log full
+static bool put(ReplayWriter& w, const uint8_t* event, int length)
+{
+    if(w.full || w.ended || w.length + (uint32_t)length + 1 > w.capacity)
+    {
+        w.full = !w.ended;
+        return false;
+    }
+    memcpy(w.data + w.length, event, length);
+    w.length += length;
+    return true;
+}
+
+static bool put_state(ReplayWriter& w, const uint8_t* event, int length)
+{
+    if(!put(w, event, length))
+        return false;
+    w.events++;
+    return true;
+}
+
+void replay_begin(ReplayWriter& w, uint8_t* data, uint32_t capacity, const ReplayHeader& header)
+{
+    w.data = data;
+    w.capacity = capacity;
+    w.length = 0;
+    w.events = 0;
+    w.triggers = 0;
+    w.last_sample = 0;
+    w.last_ms = header.start_ms;
+    w.full = capacity < (uint32_t)REPLAY_HEADER_SIZE + 1;
+    w.ended = false;
+    if(w.full)
+        return;
+
+    uint8_t* p = data;
+    memcpy(p, replay_magic, 4);
+    p += 4;
+    *p++ = REPLAY_VERSION;
+    p += put_u32(p, sizeof(PhraseSlot));
+    *p++ = GENERATOR_FIXED_POINT;
+    p += put_u32(p, header.seed);
+    p += put_u32(p, header.sample_rate);
+    p += put_u32(p, header.tempo_period_us);
+    p += put_u32(p, header.start_ms);
+    *p++ = header.scale_select;
+    *p++ = header.candidate_mode;
+    *p++ = header.phrase_slot;
+    *p++ = header.learning_state;
+    *p++ = header.phrase_injecting ? 1 : 0;
+    for(int i = 0; i < TOTAL_PARAMS; i++)
+    {
+        *p++ = (uint8_t)header.parameters[i];
+        *p++ = (uint8_t)(header.parameters[i] >> 8);
+    }
+    memcpy(p, header.phrase_data, sizeof(PhraseSlot));
+    p += sizeof(PhraseSlot);
+    w.length = (uint32_t)(p - data);
+}
+
+bool replay_put_trigger(ReplayWriter& w, uint32_t serial, uint32_t sample_time, uint8_t velocity,
+                        uint16_t length_ms)
+{
+    uint8_t event[1 + 5 + 5 + 1 + 3];
+    int n = 0;
+    event[n++] = REPLAY_TRIGGER;
+    n += put_varint(event + n, w.events - serial);
+    n += put_varint(event + n, w.triggers ? sample_time - w.last_sample : 0);
+    event[n++] = velocity;
+    n += put_varint(event + n, length_ms);
+    if(!put(w, event, n))
+        return false;
+    w.last_sample = sample_time;
+    w.triggers++;
+    return true;
+}
+
+bool replay_put_param(ReplayWriter& w, int index, uint16_t value)
+{
+    const uint8_t event[4] = {REPLAY_PARAM, (uint8_t)index, (uint8_t)value, (uint8_t)(value >> 8)};
+    return put_state(w, event, sizeof(event));
+}
+
+bool replay_put_scale(ReplayWriter& w, int select)
+{
+    const uint8_t event[2] = {REPLAY_SCALE, (uint8_t)select};
+    return put_state(w, event, sizeof(event));
+}
+
+static bool put_note(ReplayWriter& w, ReplayEventType type, uint32_t time_ms, uint8_t note,
+                     uint8_t velocity)
+{
+    uint8_t event[1 + 5 + 2];
+    int n = 0;
+    event[n++] = (uint8_t)type;
+    n += put_varint(event + n, time_ms - w.last_ms);
+    event[n++] = note;
+    if(type == REPLAY_NOTE_ON)
+        event[n++] = velocity;
+    if(!put_state(w, event, n))
+        return false;
+    w.last_ms = time_ms;
+    return true;
+}
+
+bool replay_put_note_on(ReplayWriter& w, uint32_t time_ms, uint8_t note, uint8_t velocity)
+{
+    return put_note(w, REPLAY_NOTE_ON, time_ms, note, velocity);
+}
+
+bool replay_put_note_off(ReplayWriter& w, uint32_t time_ms, uint8_t note)
+{
+    return put_note(w, REPLAY_NOTE_OFF, time_ms, note, 0);
+}
+
+// The slot contents are copied straight into the log (too large for a
+// staging buffer), so the fit check is done here
+bool replay_put_phrase_slot(ReplayWriter& w, int slot, const PhraseSlot* contents)
+{
+    uint32_t length = 3 + (contents ? sizeof(PhraseSlot) : 0);
+    if(w.full || w.ended || w.length + length + 1 > w.capacity)
+    {
+        w.full = !w.ended;
+        return false;
+    }
+    uint8_t* p = w.data + w.length;
+    p[0] = REPLAY_PHRASE_SLOT;
+    p[1] = (uint8_t)slot;
+    p[2] = contents ? 1 : 0;
+    if(contents)
+        memcpy(p + 3, contents, sizeof(PhraseSlot));
+    w.length += length;
+    w.events++;
+    return true;
+}
+
+bool replay_put_event(ReplayWriter& w, ReplayEventType type)
+{
+    const uint8_t event[1] = {(uint8_t)type};
+    return put_state(w, event, sizeof(event));
+}
+
+void replay_end(ReplayWriter& w)
+{
+    if(w.ended || w.length >= w.capacity)
+        return;
+    w.data[w.length++] = REPLAY_END;
+    w.ended = true;
+}
+
+// ============================================================================
+// READER
+// ============================================================================
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool get_varint(ReplayReader& r, uint32_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 35; shift += 7)
+    {
+        if(r.pos >= r.size)
+            return false;
+        uint8_t b = r.data[r.pos++];
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool get_byte(ReplayReader& r, uint8_t& value)
+{
+    if(r.pos >= r.size)
+        return false;
+    value = r.data[r.pos++];
+    return true;
+}
+
+bool replay_open(ReplayReader& r, const uint8_t* data, uint32_t size, ReplayHeader& header)
+{
+    if(size < (uint32_t)REPLAY_HEADER_SIZE || memcmp(data, replay_magic, 4) != 0
+       || data[4] != REPLAY_VERSION || get_u32(data + 5) != sizeof(PhraseSlot)
+       || data[9] != GENERATOR_FIXED_POINT)
+        return false;
+
+    const uint8_t* p = data + 10;
+    header.seed = get_u32(p);
+    header.sample_rate = get_u32(p + 4);
+    header.tempo_period_us = get_u32(p + 8);
+    header.start_ms = get_u32(p + 12);
+    p += 16;
+    header.scale_select = *p++;
+    header.candidate_mode = *p++;
+    header.phrase_slot = *p++;
+    header.learning_state = *p++;
+    header.phrase_injecting = *p++ != 0;
+    for(int i = 0; i < TOTAL_PARAMS; i++, p += 2)
+        header.parameters[i] = (uint16_t)(p[0] | (p[1] << 8));
+    header.phrase_data = p;
+
+    r.data = data;
+    r.size = size;
+    r.pos = REPLAY_HEADER_SIZE;
+    r.events = 0;
+    r.triggers = 0;
+    r.sample = 0;
+    r.last_ms = header.start_ms;
+    return true;
+}
+
+int replay_next(ReplayReader& r, ReplayEvent& e)
+{
+    uint8_t type;
+    if(!get_byte(r, type) || type >= REPLAY_EVENT_COUNT)
+        return -1;
+    e.type = (ReplayEventType)type;
+    e.serial = r.events;
+    e.index = 0;
+    e.velocity = 0;
+    e.value = 0;
+    e.slot_data = nullptr;
+    e.sample = r.sample;
+
+    uint32_t lag, delta, length;
+    uint8_t low, high, has_contents;
+    switch(e.type)
+    {
+        case REPLAY_END: return 0;
+
+        case REPLAY_TRIGGER:
+            if(!get_varint(r, lag) || lag > r.events || !get_varint(r, delta)
+               || !get_byte(r, e.velocity) || !get_varint(r, length) || length > 0xFFFF)
+                return -1;
+            r.sample += r.triggers ? delta : 0;
+            r.triggers++;
+            e.serial = r.events - lag;
+            e.sample = r.sample;
+            e.value = (uint16_t)length;
+            return 1;
+
+        case REPLAY_PARAM:
+            if(!get_byte(r, e.index) || !get_byte(r, low) || !get_byte(r, high)
+               || e.index >= TOTAL_PARAMS)
+                return -1;
+            e.value = (uint16_t)(low | (high << 8));
+            break;
+
+        case REPLAY_SCALE:
+            if(!get_byte(r, e.index))
+                return -1;
+            break;
+
+        case REPLAY_NOTE_ON:
+        case REPLAY_NOTE_OFF:
+            if(!get_varint(r, delta) || !get_byte(r, e.index)
+               || (e.type == REPLAY_NOTE_ON && !get_byte(r, e.velocity)))
+                return -1;
+            r.last_ms += delta;
+            break;
+
+        case REPLAY_PHRASE_SLOT:
+            if(!get_byte(r, e.index) || !get_byte(r, has_contents) || e.index >= PHRASE_SLOTS)
+                return -1;
+            if(has_contents)
+            {
+                if(r.size - r.pos < sizeof(PhraseSlot))
+                    return -1;
+                e.slot_data = r.data + r.pos;
+                r.pos += sizeof(PhraseSlot);
+            }
+            break;
+
+        default: break;
+    }
+    e.time_ms = r.last_ms;
+    e.serial = ++r.events;
+    return 1;
+}
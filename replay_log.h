@@ -0,0 +1,148 @@
+/**
+ * Generative Generator - replay log
+ *
+ * Compact binary record of everything the generator core's output depends
+ * on: the seed, the learned phrase, the parameter automation and the note
+ * triggers. The firmware records one in RAM and dumps it over SysEx
+ * (test_midi_replay.py); the host renderer (host/build/gg_render) replays it
+ * through the same core and writes the notes to a Standard MIDI File, so a
+ * performance can be rendered again with another seed or parameter set for
+ * A/B comparison. Shared by both builds, like generator_core.cpp.
+ *
+ * Layout (little endian):
+ *
+ *   header   "GGRL" <version> <sizeof(PhraseSlot) u32> <GENERATOR_FIXED_POINT> <seed u32>
+ *            <sample rate u32> <tempo period us u32> <start ms u32>
+ *            <scale_select> <candidate_mode> <phrase_slot> <learning_state>
+ *            <phrase_injecting> <parameter u16 x TOTAL_PARAMS>
+ *            <active phrase slot, sizeof(PhraseSlot) bytes>
+ *   events   <type> <fields>, unsigned values as LEB128 varints
+ *   end      REPLAY_END
+ *
+ * Triggers and state changes come from different contexts on the module
+ * (the audio callback generates, the main loop learns and moves
+ * parameters), so they are written in the order the main loop sees them and
+ * each trigger carries how many state events it has to go back: it was
+ * generated with the state after the first (events - lag) state events.
+ */
+
+#pragma once
+
+#include "generator_core.h"
+
+// ============================================================================
+// FORMAT
+// ============================================================================
+
+#define REPLAY_VERSION 2
+const int REPLAY_HEADER_SIZE = 4 + 1 + 4 + 1 + 4 * 4 + 5 + 2 * TOTAL_PARAMS + (int)sizeof(PhraseSlot);
+
+// Parameters are logged (and seen by the core while recording) on a 10-bit grid
+const int REPLAY_PARAM_STEPS = 1023;
+
+inline uint16_t replay_quantize(float value)
+{
+    return (uint16_t)(clamp01(value) * REPLAY_PARAM_STEPS + 0.5f);
+}
+
+inline float replay_parameter(uint16_t value)
+{
+    return (float)value / REPLAY_PARAM_STEPS;
+}
+
+// Event types and their fields. Every type but REPLAY_TRIGGER is a state
+// event, numbered from 1 in log order; the core call each stands for is the
+// one the firmware made.
+enum ReplayEventType {
+    REPLAY_END = 0,
+    REPLAY_TRIGGER,       // <lag> <samples since the last trigger> <velocity> <length ms>
+    REPLAY_PARAM,         // <index> <value u16>: parameters_smoothed[index]
+    REPLAY_SCALE,         // <select>: scale_select
+    REPLAY_LEARN_START,   // learning_state = STATE_LEARNING, reset_corpus()
+    REPLAY_INJECT_START,  // begin_injection()
+    REPLAY_NOTE_ON,       // <ms since the last note event> <note> <velocity>:
+                          //   corpus_add_note(), rhythm_learn_onset()
+    REPLAY_NOTE_OFF,      // <ms since the last note event> <note>: rhythm_learn_release()
+    REPLAY_INJECT_END,    // phrase_injecting = false
+    REPLAY_GENERATE,      // begin_generating(seed)
+    REPLAY_PHRASE_CLEAR,  // Learned phrase discarded, back to STATE_IDLE
+    REPLAY_PHRASE_SLOT,   // <slot> <0 | 1 + sizeof(PhraseSlot) bytes>: slot switched
+                          //   to (its contents the first time it appears)
+    REPLAY_EVENT_COUNT
+};
+
+// Session state at the start of the log
+struct ReplayHeader {
+    uint32_t seed;             // rng_fixed_seed while recording (never 0)
+    uint32_t sample_rate;      // Trigger time base
+    uint32_t tempo_period_us;  // Tracked clock (0 = none), tempo of the rendered file
+    uint32_t start_ms;         // Base of the note event times
+    uint8_t  scale_select;
+    uint8_t  candidate_mode;
+    uint8_t  phrase_slot;
+    uint8_t  learning_state;
+    bool     phrase_injecting;
+    uint16_t parameters[TOTAL_PARAMS];
+    const uint8_t* phrase_data;  // Contents of the active slot (PhraseSlot bytes)
+};
+
+// ============================================================================
+// WRITER
+// ============================================================================
+
+// Appends to a caller-owned buffer; one byte stays reserved for REPLAY_END.
+// A put that does not fit sets full and writes nothing.
+struct ReplayWriter {
+    uint8_t* data;
+    uint32_t capacity;
+    uint32_t length;
+    uint32_t events;          // State events written
+    uint32_t triggers;
+    uint32_t last_sample;     // Time of the previous trigger
+    uint32_t last_ms;         // Time of the previous note event
+    bool     full;
+    bool     ended;
+};
+
+void replay_begin(ReplayWriter& w, uint8_t* data, uint32_t capacity, const ReplayHeader& header);
+bool replay_put_trigger(ReplayWriter& w, uint32_t serial, uint32_t sample_time, uint8_t velocity,
+                        uint16_t length_ms);
+bool replay_put_param(ReplayWriter& w, int index, uint16_t value);
+bool replay_put_scale(ReplayWriter& w, int select);
+bool replay_put_note_on(ReplayWriter& w, uint32_t time_ms, uint8_t note, uint8_t velocity);
+bool replay_put_note_off(ReplayWriter& w, uint32_t time_ms, uint8_t note);
+bool replay_put_phrase_slot(ReplayWriter& w, int slot, const PhraseSlot* contents);
+bool replay_put_event(ReplayWriter& w, ReplayEventType type);  // Events without fields
+void replay_end(ReplayWriter& w);
+
+// ============================================================================
+// READER
+// ============================================================================
+
+struct ReplayEvent {
+    ReplayEventType type;
+    uint32_t serial;           // State event: its number; trigger: state events before it
+    uint64_t sample;           // Trigger: samples since the first trigger
+    uint32_t time_ms;          // Note events: absolute time (header.start_ms based)
+    uint8_t  index;            // Parameter index, note, slot or scale
+    uint8_t  velocity;
+    uint16_t value;            // Parameter value, trigger length (ms)
+    const uint8_t* slot_data;  // REPLAY_PHRASE_SLOT contents (nullptr = seen before)
+};
+
+struct ReplayReader {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t events;
+    uint32_t triggers;
+    uint64_t sample;
+    uint32_t last_ms;
+};
+
+// False if data is not a replay log of this build (version, PhraseSlot layout,
+// generator arithmetic)
+bool replay_open(ReplayReader& r, const uint8_t* data, uint32_t size, ReplayHeader& header);
+
+// 1 = event read, 0 = end of the log, -1 = truncated or corrupt
+int replay_next(ReplayReader& r, ReplayEvent& e);
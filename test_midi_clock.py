@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""
+MIDI Clock Tester for GenerativeGenerator
+Drives the module as a clock master (Start, 24 PPQN clock, Stop) and measures
+the clock the module sends in follow or internal mode (CC 103/104), optionally
+while the module plays dense notes and redraws the display (--load)
+"""
+
+import mido
+import time
+import argparse
+
+from test_midi_trace import list_midi_ports, resolve_port
+
+PPQN = 24
+CLOCK_OUT_CC = 103
+INTERNAL_TEMPO_CC = 104
+INTERNAL_TEMPO_MIN_BPM = 60
+
+# --load: a learned phrase played by all voices at x4 of the clock, and a
+# parameter sweep that keeps the display flushing
+MOTION_CC = 3
+VOICES_CC = 30
+CLOCK_RATE_CC = 89
+CLOCK_RATE_X4 = 115
+LOAD_PHRASE = [60, 62, 64, 67, 69, 67, 64, 62]
+LEARN_TIMEOUT_S = 2.5
+SWEEP_INTERVAL_S = 0.05
+
+# CC 103 values in the middle of each third of 0-127
+CLOCK_OUT_MODES = {'off': 0, 'follow': 64, 'internal': 127}
+
+def send_clock(outport, bpm, seconds, position=None):
+    """Start (or Song Position + Continue), clock for seconds, Stop"""
+    if position is None:
+        outport.send(mido.Message('start'))
+    else:
+        outport.send(mido.Message('songpos', pos=position))
+        outport.send(mido.Message('continue'))
+    interval = 60.0 / bpm / PPQN
+    next_time = time.perf_counter()
+    end = next_time + seconds
+    sent = 0
+    while next_time < end:
+        while time.perf_counter() < next_time:
+            pass
+        outport.send(mido.Message('clock'))
+        sent += 1
+        next_time += interval
+    outport.send(mido.Message('stop'))
+    print(f"Sent {sent} clocks at {bpm} BPM ({sent // PPQN} beats)")
+
+class ClockMeter:
+    """Timestamps the clock the module sends as it arrives (input callback)"""
+    def __init__(self):
+        self.times = []
+        self.notes = 0
+
+    def __call__(self, msg):
+        now = time.perf_counter()
+        if msg.type == 'clock':
+            self.times.append(now)
+        elif msg.type == 'note_on':
+            self.notes += 1
+        elif msg.type in ('start', 'stop', 'continue'):
+            print(f"  {msg.type} after {len(self.times)} clocks")
+
+    def report(self):
+        if len(self.times) < 2:
+            print("No clock received")
+            return
+        intervals = [b - a for a, b in zip(self.times, self.times[1:])]
+        mean = sum(intervals) / len(intervals)
+        deviations = sorted(abs(i - mean) for i in intervals)
+        p99 = deviations[min(len(deviations) - 1, int(len(deviations) * 0.99))]
+        print(f"Received {len(self.times)} clocks: {60.0 / (mean * PPQN):.2f} BPM, "
+              f"interval {mean * 1000:.2f} ms, max deviation {deviations[-1] * 1000:.2f} ms, "
+              f"99% within {p99 * 1000:.2f} ms")
+        if self.notes:
+            print(f"  with {self.notes} Note Ons ({self.notes / (self.times[-1] - self.times[0]):.0f}/s)")
+
+def start_load(outport, channel):
+    """Teach a phrase, play it on every voice at x4 of the clock"""
+    for note in LOAD_PHRASE:
+        outport.send(mido.Message('note_on', channel=channel, note=note, velocity=100))
+        time.sleep(0.1)
+        outport.send(mido.Message('note_off', channel=channel, note=note))
+    time.sleep(LEARN_TIMEOUT_S)
+    outport.send(mido.Message('control_change', channel=channel, control=VOICES_CC, value=127))
+    outport.send(mido.Message('control_change', channel=channel, control=CLOCK_RATE_CC, value=CLOCK_RATE_X4))
+    print(f"Load: {len(LOAD_PHRASE)}-note phrase, 8 voices, x4, CC {MOTION_CC} sweep")
+
+def sweep_load(outport, channel, seconds):
+    """Move a parameter for seconds so that every control tick redraws"""
+    end = time.perf_counter() + seconds
+    value, step = 0, 8
+    while time.perf_counter() < end:
+        outport.send(mido.Message('control_change', channel=channel, control=MOTION_CC, value=value))
+        value += step
+        if value > 127 or value < 0:
+            step = -step
+            value += 2 * step
+        time.sleep(SWEEP_INTERVAL_S)
+
+def main():
+    parser = argparse.ArgumentParser(description='Test MIDI clock sync on GenerativeGenerator')
+    parser.add_argument('-l', '--list', action='store_true', help='List available MIDI ports')
+    parser.add_argument('-o', '--output', type=str, help='MIDI output port to the module (name or index)')
+    parser.add_argument('-i', '--input', type=str, help='MIDI input port from the module (name or index)')
+    parser.add_argument('--send', type=float, metavar='BPM', help='Be the master: clock the module at BPM')
+    parser.add_argument('--position', type=int, metavar='SIXTEENTHS',
+                        help='With --send: Song Position + Continue instead of Start')
+    parser.add_argument('--mode', choices=CLOCK_OUT_MODES.keys(), help='Set the module clock out (CC 103)')
+    parser.add_argument('--tempo', type=int, metavar='BPM',
+                        help=f'Set the internal tempo (CC 104, {INTERNAL_TEMPO_MIN_BPM}-{INTERNAL_TEMPO_MIN_BPM + 127})')
+    parser.add_argument('--measure', action='store_true', help='Measure the clock the module sends')
+    parser.add_argument('--load', action='store_true',
+                        help='While measuring: dense note output and display redraws (teaches a phrase first)')
+    parser.add_argument('-s', '--seconds', type=float, default=10.0, help='Send / measure duration')
+    parser.add_argument('-c', '--channel', type=int, default=1, help='MIDI channel for CCs (1-16)')
+
+    args = parser.parse_args()
+
+    if args.list:
+        list_midi_ports()
+        return
+
+    out_name = resolve_port(args.output, mido.get_output_names())
+    in_name = resolve_port(args.input, mido.get_input_names())
+    if not out_name or (args.measure and not in_name):
+        print("Error: MIDI output (and input, to measure) ports are required (see --list)")
+        return
+
+    with mido.open_output(out_name) as outport:
+        channel = args.channel - 1
+        if args.tempo is not None:
+            value = max(0, min(127, args.tempo - INTERNAL_TEMPO_MIN_BPM))
+            outport.send(mido.Message('control_change', channel=channel, control=INTERNAL_TEMPO_CC, value=value))
+            print(f"Internal tempo {INTERNAL_TEMPO_MIN_BPM + value} BPM")
+        if args.mode:
+            outport.send(mido.Message('control_change', channel=channel, control=CLOCK_OUT_CC,
+                                      value=CLOCK_OUT_MODES[args.mode]))
+            print(f"Clock out: {args.mode}")
+
+        if args.load:
+            start_load(outport, channel)
+
+        meter = ClockMeter()
+        inport = mido.open_input(in_name, callback=meter) if args.measure else None
+        if args.send:
+            # In follow mode the module's clock is measured against ours
+            send_clock(outport, args.send, args.seconds, args.position)
+        elif args.load:
+            sweep_load(outport, channel, args.seconds)
+        elif args.measure:
+            time.sleep(args.seconds)
+        if inport:
+            time.sleep(0.1)
+            inport.close()
+            meter.report()
+
+if __name__ == "__main__":
+    main()
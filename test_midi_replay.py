@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+MIDI Replay Log Recorder for GenerativeGenerator
+Starts and stops a replay log recording over SysEx and saves the log for
+host/build/gg_render
+"""
+
+import mido
+import time
+import argparse
+
+from test_midi_trace import MANUFACTURER, DEVICE, list_midi_ports, resolve_port, read_u32, send_command
+
+REPLAY_START = 0x04
+REPLAY_STOP = 0x05
+REPLAY_QUERY = 0x06
+REPLAY_REPLY = 0x16
+
+FLAG_RECORDING = 0x01
+FLAG_FULL = 0x02
+
+def put_u32(value):
+    """Five 7-bit bytes, least significant first"""
+    return [(value >> (7 * i)) & 0x7F for i in range(5)]
+
+def unpack(data):
+    """7 bytes in 8: a byte of high bits (first byte's in bit 6), then the low bits"""
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        high = data[pos]
+        group = data[pos + 1:pos + 8]
+        for j, low in enumerate(group):
+            out.append(low | (((high >> (6 - j)) & 1) << 7))
+        pos += 1 + len(group)
+    return out
+
+def query_chunk(inport, outport, offset, timeout):
+    """One REPLAY_REPLY: (flags, length, data) or None on timeout"""
+    outport.send(mido.Message('sysex', data=[MANUFACTURER, DEVICE, REPLAY_QUERY] + put_u32(offset)))
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        msg = inport.poll()
+        if msg is None:
+            time.sleep(0.002)
+            continue
+        data = list(msg.data) if msg.type == 'sysex' else []
+        if len(data) < 14 or data[:3] != [MANUFACTURER, DEVICE, REPLAY_REPLY]:
+            continue
+        flags = data[3]
+        length, pos = read_u32(data, 4)
+        reply_offset, pos = read_u32(data, pos)
+        if reply_offset == offset:
+            return flags, length, unpack(data[pos:])
+    return None
+
+def dump_log(inport, outport, path, timeout):
+    """Read the whole log chunk by chunk (retrying lost replies) into path"""
+    log = bytearray()
+    flags, length = 0, None
+    retries = 0
+    while length is None or len(log) < length:
+        reply = query_chunk(inport, outport, len(log), timeout)
+        if reply is None:
+            retries += 1
+            if retries > 3:
+                print(f"Error: no reply at offset {len(log)}")
+                return False
+            continue
+        retries = 0
+        flags, length, chunk = reply
+        if not chunk:
+            break
+        log += chunk
+        print(f"\r  {len(log)} / {length} bytes", end="", flush=True)
+    print()
+
+    with open(path, 'wb') as f:
+        f.write(log)
+    state = "still recording (no end marker)" if flags & FLAG_RECORDING else "complete"
+    if flags & FLAG_FULL:
+        state += ", buffer was full"
+    print(f"Saved {len(log)} bytes to {path} ({state})")
+    return True
+
+def main():
+    parser = argparse.ArgumentParser(description='Record a replay log on GenerativeGenerator')
+    parser.add_argument('-l', '--list', action='store_true', help='List available MIDI ports')
+    parser.add_argument('-o', '--output', type=str, help='MIDI output port to the module (name or index)')
+    parser.add_argument('-i', '--input', type=str, help='MIDI input port from the module (name or index)')
+    parser.add_argument('--start', action='store_true', help='Start recording')
+    parser.add_argument('--stop', action='store_true', help='Stop recording')
+    parser.add_argument('--record', type=float, metavar='SECONDS',
+                        help='Start, record for SECONDS, stop and dump')
+    parser.add_argument('-d', '--dump', type=str, metavar='FILE', help='Save the log (stops recording first)')
+    parser.add_argument('-t', '--timeout', type=float, default=1.0, help='Reply timeout in seconds')
+
+    args = parser.parse_args()
+
+    if args.list:
+        list_midi_ports()
+        return
+
+    out_name = resolve_port(args.output, mido.get_output_names())
+    in_name = resolve_port(args.input, mido.get_input_names())
+    if not out_name or (args.dump and not in_name):
+        print("Error: MIDI output (and input, to dump) ports are required (see --list)")
+        return
+
+    with mido.open_output(out_name) as outport:
+        if args.start or args.record:
+            send_command(outport, REPLAY_START)
+            print("Recording started")
+        if args.record:
+            time.sleep(args.record)
+        if args.stop or args.record or args.dump:
+            send_command(outport, REPLAY_STOP)
+            print("Recording stopped")
+        if args.dump:
+            with mido.open_input(in_name) as inport:
+                dump_log(inport, outport, args.dump, args.timeout)
+        elif args.record:
+            print("Use --dump FILE to save the log")
+
+if __name__ == "__main__":
+    main()
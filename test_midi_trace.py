@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""
+MIDI Trace Dump for GenerativeGenerator
+Queries the hot-path cycle statistics and the debug log over SysEx
+"""
+
+import mido
+import time
+import argparse
+
+MANUFACTURER = 0x7D  # Non-commercial
+DEVICE = 0x47        # 'G'
+
+TRACE_QUERY = 0x01
+TRACE_RESET = 0x02
+LOG_QUERY = 0x03
+TRACE_REPLY = 0x11
+LOG_REPLY = 0x13
+
+TRACE_POINTS = ["gate->midi", "midi-in drain", "learn analysis", "display flush"]
+TRACE_BUCKETS = 16
+TRACE_BUCKET_SHIFT = 8
+
+DEBUG_EVENTS = ["STARTUP", "PAGE_CHANGE", "NOTE_RECEIVED", "LEARNING_START",
+                "LEARNING_STOP", "PICKUP_ACTIVE", "PICKUP_WAITING", "CLOCK_PULSE"]
+
+def list_midi_ports():
+    """List available MIDI ports"""
+    print("Available MIDI output ports:")
+    for i, port in enumerate(mido.get_output_names()):
+        print(f"  {i}: {port}")
+    print("Available MIDI input ports:")
+    for i, port in enumerate(mido.get_input_names()):
+        print(f"  {i}: {port}")
+
+def resolve_port(name, names):
+    """Port given as an index or a name (first port if None)"""
+    if name is None:
+        return names[0] if names else None
+    try:
+        index = int(name)
+        return names[index] if 0 <= index < len(names) else None
+    except ValueError:
+        return name
+
+def read_u32(data, pos):
+    """Five 7-bit bytes, least significant first"""
+    value = 0
+    for i in range(5):
+        value |= data[pos + i] << (7 * i)
+    return value & 0xFFFFFFFF, pos + 5
+
+def send_command(port, command):
+    port.send(mido.Message('sysex', data=[MANUFACTURER, DEVICE, command]))
+
+def collect_replies(port, command, expected, timeout):
+    """Gather reply messages (SysEx data without F0/F7) until all arrived"""
+    replies = []
+    deadline = time.time() + timeout
+    while time.time() < deadline and len(replies) < expected:
+        msg = port.poll()
+        if msg is None:
+            time.sleep(0.005)
+            continue
+        if (msg.type == 'sysex' and len(msg.data) >= 3 and msg.data[0] == MANUFACTURER
+                and msg.data[1] == DEVICE and msg.data[2] == command):
+            replies.append(list(msg.data))
+    return replies
+
+def print_trace(replies):
+    """Statistics per trace point in cycles and microseconds"""
+    print(f"{'point':<16} {'count':>8} {'min_us':>10} {'avg_us':>10} {'max_us':>10}")
+    for data in sorted(replies, key=lambda d: d[3]):
+        point = data[3]
+        pos = 4
+        count, pos = read_u32(data, pos)
+        minimum, pos = read_u32(data, pos)
+        maximum, pos = read_u32(data, pos)
+        average, pos = read_u32(data, pos)
+        clock, pos = read_u32(data, pos)
+        histogram = []
+        for _ in range(TRACE_BUCKETS):
+            value, pos = read_u32(data, pos)
+            histogram.append(value)
+
+        us = lambda cycles: cycles * 1e6 / clock if clock else 0.0
+        name = TRACE_POINTS[point] if point < len(TRACE_POINTS) else f"point {point}"
+        print(f"{name:<16} {count:>8} {us(minimum):>10.1f} {us(average):>10.1f} {us(maximum):>10.1f}")
+        peak = max(histogram) or 1
+        for b, value in enumerate(histogram):
+            if value == 0:
+                continue
+            low = 0 if b == 0 else 1 << (b + TRACE_BUCKET_SHIFT)
+            high = "inf" if b == TRACE_BUCKETS - 1 else f"{us(1 << (b + TRACE_BUCKET_SHIFT + 1)):.1f}"
+            bar = "#" * max(1, value * 40 // peak)
+            print(f"    {us(low):>9.1f} - {high:>9} us {value:>8} {bar}")
+
+def print_log(data):
+    """Debug log entries, oldest first"""
+    next_index = data[3]
+    entries = []
+    pos = 4
+    while pos + 12 <= len(data):
+        timestamp, pos = read_u32(data, pos)
+        event = data[pos]
+        values = [data[pos + 1 + 2 * d] | (data[pos + 2 + 2 * d] << 7) for d in range(3)]
+        pos += 7
+        entries.append((timestamp, event, values))
+    entries = entries[next_index:] + entries[:next_index]
+    for timestamp, event, values in entries:
+        if timestamp == 0 and event == 0:
+            continue  # Unused slot
+        name = DEBUG_EVENTS[event] if event < len(DEBUG_EVENTS) else f"EVENT_{event}"
+        print(f"  {timestamp:>10} ms  {name:<16} {values[0]:>3} {values[1]:>3} {values[2]:>3}")
+
+def main():
+    parser = argparse.ArgumentParser(description='Query hot-path traces from GenerativeGenerator')
+    parser.add_argument('-l', '--list', action='store_true', help='List available MIDI ports')
+    parser.add_argument('-o', '--output', type=str, help='MIDI output port to the module (name or index)')
+    parser.add_argument('-i', '--input', type=str, help='MIDI input port from the module (name or index)')
+    parser.add_argument('-r', '--reset', action='store_true', help='Reset the statistics after the dump')
+    parser.add_argument('--log', action='store_true', help='Dump the debug log instead')
+    parser.add_argument('-t', '--timeout', type=float, default=2.0, help='Reply timeout in seconds')
+
+    args = parser.parse_args()
+
+    if args.list:
+        list_midi_ports()
+        return
+
+    out_name = resolve_port(args.output, mido.get_output_names())
+    in_name = resolve_port(args.input, mido.get_input_names())
+    if not out_name or not in_name:
+        print("Error: MIDI input and output ports are both required (see --list)")
+        return
+
+    with mido.open_input(in_name) as inport, mido.open_output(out_name) as outport:
+        if args.log:
+            send_command(outport, LOG_QUERY)
+            replies = collect_replies(inport, LOG_REPLY, 1, args.timeout)
+            if replies:
+                print_log(replies[0])
+        else:
+            send_command(outport, TRACE_QUERY)
+            replies = collect_replies(inport, TRACE_REPLY, len(TRACE_POINTS), args.timeout)
+            if replies:
+                print_trace(replies)
+            if args.reset:
+                send_command(outport, TRACE_RESET)
+
+        if not replies:
+            print(f"Error: no reply from the module within {args.timeout} s")
+
+if __name__ == "__main__":
+    main()